@@ -0,0 +1,221 @@
+/*									tab:8
+ *
+ * bq.c - source file for byte queue abstraction in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    bq.c
+ * History:
+ *		1
+ *		First written.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "bq.h"
+
+/*
+    The BQ module holds a stream between reading and framing.  See bq.h.
+
+    Data occupy <len> bytes of the ring starting at offset <head>, possibly
+    wrapping past the end.  The slack area after the ring only ever holds
+    copies of bytes from the start of the ring, made by bq_peek, and is
+    never read into.
+*/
+
+
+/* BQ structure definition */
+struct bq_t {
+    int size;                 /* capacity of ring (bytes)                 */
+    int slack;                /* size of slack area after ring (bytes)    */
+    int head;                 /* offset of first byte held                */
+    int len;                  /* number of bytes held                     */
+    unsigned char* buf;       /* ring, followed by slack area             */
+};
+
+
+/*
+   Create a new BQ holding up to <size> bytes, able to show pieces of up
+   to <slack> bytes in one block.  Possible return values and meanings
+   include:
+     BQ_OK                  success; <new_bq> points to a pointer to
+				 the new BQ
+     BQ_BAD_PARAMETER       one or mores parameters passed were invalid
+     BQ_OUT_OF_MEMORY       inadequate memory to create BQ requested
+*/
+bq_err_t
+bq_create (bq_t** new_bq, int size, int slack)
+{
+    bq_t* bq;
+
+    /* Check parameters. */
+    if (new_bq == NULL || size < 1 || size > BQ_MAX_SIZE || slack < 0 ||
+	slack > size)
+	return BQ_BAD_PARAMETER;
+
+    /* Allocate necessary memory. */
+    if ((bq = calloc (1, sizeof (bq_t))) == NULL)
+	return BQ_OUT_OF_MEMORY;
+    if ((bq->buf = malloc (size + slack)) == NULL) {
+	free (bq);
+	return BQ_OUT_OF_MEMORY;
+    }
+
+    bq->size = size;
+    bq->slack = slack;
+
+    *new_bq = bq;
+    return BQ_OK;
+}
+
+
+/*
+   Discard all data held in BQ <bq>.
+*/
+void
+bq_reset (bq_t* bq)
+{
+    bq->head = 0;
+    bq->len = 0;
+}
+
+
+/*
+   Read as much data from file descriptor <fd> as BQ <bq> has room to
+   hold, with a single call.  Returns the number of bytes read, 0 at end
+   of file, or -1 with errno set if the read failed (including EAGAIN
+   for a non-blocking descriptor with nothing to read).  If the BQ is
+   full, returns -1 with errno set to ENOBUFS without reading.
+*/
+int
+bq_read (bq_t* bq, int fd)
+{
+    struct iovec iov[2];
+    int tail, room, n_iov = 1, rv;
+
+    if ((room = bq->size - bq->len) == 0) {
+	errno = ENOBUFS;
+	return -1;
+    }
+
+    /* The free space runs from the tail to the end of the ring, then
+       from the start of the ring to the head. */
+    tail = (bq->head + bq->len) % bq->size;
+    iov[0].iov_base = bq->buf + tail;
+    if (tail + room <= bq->size)
+	iov[0].iov_len = room;
+    else {
+	iov[0].iov_len = bq->size - tail;
+	iov[1].iov_base = bq->buf;
+	iov[1].iov_len = room - iov[0].iov_len;
+	n_iov = 2;
+    }
+
+    if ((rv = readv (fd, iov, n_iov)) > 0)
+	bq->len += rv;
+    return rv;
+}
+
+
+/*
+   Find the piece of up to <want> bytes at the front of BQ <bq>, setting
+   <*data> to point to it as one block.  Returns the length of the piece,
+   which is less than <want> only if the BQ holds fewer bytes or <want>
+   exceeds the slack size.  The data are not removed; see bq_consume.
+*/
+int
+bq_peek (bq_t* bq, int want, unsigned char** data)
+{
+    int flat = bq->size - bq->head;
+
+    if (want > bq->len)
+	want = bq->len;
+
+    /* Copy the wrapped part of the piece into the slack area. */
+    if (want > flat) {
+	if (want > flat + bq->slack)
+	    want = flat + bq->slack;
+	memcpy (bq->buf + bq->size, bq->buf, want - flat);
+    }
+
+    *data = bq->buf + bq->head;
+    return want;
+}
+
+
+/*
+   Remove <len> bytes (no more than are held) from the front of BQ <bq>.
+*/
+void
+bq_consume (bq_t* bq, int len)
+{
+    if (len > bq->len)
+	len = bq->len;
+    bq->len -= len;
+    bq->head = (bq->len == 0 ? 0 : (bq->head + len) % bq->size);
+}
+
+
+/*
+   Return the number of bytes held in BQ <bq>.
+*/
+int
+bq_length (bq_t* bq)
+{
+    return bq->len;
+}
+
+
+/*
+   Return the number of bytes that BQ <bq> has room to hold.
+*/
+int
+bq_room (bq_t* bq)
+{
+    return bq->size - bq->len;
+}
+
+
+/*
+   Destroy the BQ <bq> and free all memory associated with it.  Possible
+   return values and meanings include:
+     BQ_BAD_PARAMETER       parameter passed was invalid
+     BQ_OK                  success
+*/
+bq_err_t
+bq_destroy (bq_t* bq)
+{
+    /* Check parameter. */
+    if (bq == NULL)
+	return BQ_BAD_PARAMETER;
+
+    free (bq->buf);
+    free (bq);
+
+    return BQ_OK;
+}
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void
+bq_error (const char* msg, bq_err_t err)
+{
+    static const char* const bq_err_str[BQ_NO_SUCH_ERR] = {
+	"no error reported",
+	"bad parameter passed to BQ function",
+	"memory allocation failed",
+    };
+
+    if (msg == NULL)
+	fputs ("NULL message passed to bq_error.\n", stderr);
+    else if (err < 0 || err >= BQ_NO_SUCH_ERR)
+	fprintf (stderr, "%s: invalid error code passed to bq_error.\n", msg);
+    else
+	fprintf (stderr, "%s: %s\n", msg, bq_err_str[err]);
+}
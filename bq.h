@@ -0,0 +1,123 @@
+/*									tab:8
+ *
+ * bq.h - header file for byte queue abstraction in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    bq.h
+ * History:
+ *		1
+ *		First written.
+ */
+
+#if !defined (BQ_H)
+#define BQ_H
+
+/*
+    The BQ module defines a byte queue that decouples reading a stream
+    from a file descriptor from cutting the stream into frames.  BQ stands
+    for Byte Queue.  Data are read into a ring of fixed size with as few
+    system calls as possible, and are taken out from the front of the ring
+    in pieces of any size.
+
+    Because a piece may be needed as one contiguous block (for example,
+    to be compressed), the ring is followed by a slack area of a size
+    chosen at creation.  When a piece wraps past the end of the ring, its
+    wrapped part is copied into the slack, so that a piece of up to the
+    slack size can always be seen in one block.
+
+    Like the RB module, a BQ is not thread-safe; it is meant to be owned
+    by a single channel thread.
+*/
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define BQ_MAX_SIZE   (64 << 20)  /* limit on queue size (bytes)             */
+
+typedef struct bq_t bq_t;         /* opaque byte queue structure             */
+
+typedef enum {                    /* error messages defined by BQ module     */
+    BQ_OK = 0,                    /* operation suceeded                      */
+    BQ_BAD_PARAMETER,             /* bad parameter passed to BQ routine      */
+    BQ_OUT_OF_MEMORY,             /* memory allocation failed                */
+    BQ_NO_SUCH_ERR                /* limit on possible error codes           */
+} bq_err_t;
+
+
+/*
+   Create a new BQ holding up to <size> bytes, able to show pieces of up
+   to <slack> bytes in one block.  Possible return values and meanings
+   include:
+     BQ_OK                  success; <new_bq> points to a pointer to
+				 the new BQ
+     BQ_BAD_PARAMETER       one or mores parameters passed were invalid
+     BQ_OUT_OF_MEMORY       inadequate memory to create BQ requested
+*/
+bq_err_t bq_create (bq_t** new_bq, int size, int slack);
+
+
+/*
+   Discard all data held in BQ <bq>.
+*/
+void bq_reset (bq_t* bq);
+
+
+/*
+   Read as much data from file descriptor <fd> as BQ <bq> has room to
+   hold, with a single call.  Returns the number of bytes read, 0 at end
+   of file, or -1 with errno set if the read failed (including EAGAIN
+   for a non-blocking descriptor with nothing to read).  If the BQ is
+   full, returns -1 with errno set to ENOBUFS without reading.
+*/
+int bq_read (bq_t* bq, int fd);
+
+
+/*
+   Find the piece of up to <want> bytes at the front of BQ <bq>, setting
+   <*data> to point to it as one block.  Returns the length of the piece,
+   which is less than <want> only if the BQ holds fewer bytes or <want>
+   exceeds the slack size.  The data are not removed; see bq_consume.
+*/
+int bq_peek (bq_t* bq, int want, unsigned char** data);
+
+
+/*
+   Remove <len> bytes (no more than are held) from the front of BQ <bq>.
+*/
+void bq_consume (bq_t* bq, int len);
+
+
+/*
+   Return the number of bytes held in BQ <bq>.
+*/
+int bq_length (bq_t* bq);
+
+
+/*
+   Return the number of bytes that BQ <bq> has room to hold.
+*/
+int bq_room (bq_t* bq);
+
+
+/*
+   Destroy the BQ <bq> and free all memory associated with it.  Possible
+   return values and meanings include:
+     BQ_BAD_PARAMETER       parameter passed was invalid
+     BQ_OK                  success
+*/
+bq_err_t bq_destroy (bq_t* bq);
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void bq_error (const char* msg, bq_err_t err);
+
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* BQ_H */
@@ -0,0 +1,161 @@
+/*									tab:8
+ *
+ * chanbench.c - contention benchmark for the layout of channel_t
+ *
+ * Version:	    1
+ * Filename:	    chanbench.c
+ * History:
+ *		1
+ *		First written.
+ */
+
+#define _GNU_SOURCE   /* for CPU_COUNT and pthread_setaffinity_np */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fq.h"
+#include "lz.h"
+#include "tw.h"
+#include "relay.h"
+
+/*
+    Each channel is served by several threads at once (see the Memory
+    Layout section of the README).  This program runs one thread for
+    each of the busiest owners of channel_t state, each pinned to a CPU
+    of its own where there are enough, and has each write the fields it
+    writes for every frame, ITERATIONS times, timing the writes in CPU
+    time.
+
+    In the first run, the threads write their own fields of a channel_t,
+    as laid out in relay.h.  In the second, they write neighbouring
+    words of one cache line, as they would if the layout did not keep
+    them apart.  The difference is the cost of the line moving between
+    CPUs.  With one CPU, or threads that share a CPU, no line moves, and
+    the two runs take the same time.
+*/
+
+#define ITERATIONS 20000000
+
+#define NUM_ROLES  3
+
+/* a thread of the benchmark, with the two fields that it writes */
+typedef struct role_t role_t;
+struct role_t {
+    const char* name;          /* thread of the relay that it stands for */
+    volatile unsigned long* field[2];
+    int cpu;                   /* CPU to which it is pinned, or -1       */
+    double ns;                 /* time per iteration (ns)                */
+};
+
+static pthread_barrier_t start;
+
+
+/*
+   Return the CPU time used by the calling thread, in nanoseconds.  A
+   write that waits for a cache line to arrive uses CPU time, but time
+   spent waiting for a turn on a shared CPU does not.
+*/
+static unsigned long long
+cpu_ns (void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+   Body of each thread: pin it to its CPU, wait for the others, then
+   write the fields of the role_t <v_role> and time the writes.
+*/
+static void*
+writer (void* v_role)
+{
+    role_t* role = v_role;
+    unsigned long long begin;
+    cpu_set_t set;
+    int i;
+
+    if (role->cpu != -1) {
+	CPU_ZERO (&set);
+	CPU_SET (role->cpu, &set);
+	(void)pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+    }
+    (void)pthread_barrier_wait (&start);
+    begin = cpu_ns ();
+    for (i = 0; i < ITERATIONS; i++) {
+	(*role->field[0])++;
+	(*role->field[1])++;
+    }
+    role->ns = (double)(cpu_ns () - begin) / ITERATIONS;
+    return NULL;
+}
+
+
+/*
+   Run the threads described by <roles> together and print their times,
+   labelled with <label>.
+*/
+static void
+run (const char* label, role_t* roles)
+{
+    pthread_t ids[NUM_ROLES];
+    int i;
+
+    (void)pthread_barrier_init (&start, NULL, NUM_ROLES);
+    for (i = 0; i < NUM_ROLES; i++)
+	if (pthread_create (&ids[i], NULL, writer, &roles[i]) != 0) {
+	    perror ("pthread_create");
+	    exit (EXIT_PANIC);
+	}
+    for (i = 0; i < NUM_ROLES; i++)
+	(void)pthread_join (ids[i], NULL);
+    (void)pthread_barrier_destroy (&start);
+
+    for (i = 0; i < NUM_ROLES; i++)
+	printf ("%-8s %-13s %6.2f ns/iteration\n", label, roles[i].name,
+		roles[i].ns);
+}
+
+
+int
+main (void)
+{
+    static channel_t ct __attribute__ ((aligned (CACHE_LINE)));
+    static unsigned long line[8] __attribute__ ((aligned (CACHE_LINE)));
+    role_t roles[NUM_ROLES] = {
+	{"tcp_sender",   {&ct.tune.delivered,
+			  &ct.rtx.probes}},
+	{"tcp_receiver", {&ct.rx_missing, &ct.rx_late}},
+	{"udp_sender",   {&ct.sched[0].frames, &ct.sched[1].frames}}
+    };
+    cpu_set_t set;
+    int i, n_cpus;
+
+    (void)sched_getaffinity (0, sizeof (set), &set);
+    n_cpus = CPU_COUNT (&set);
+    printf ("%d CPUS%s\n", n_cpus, (n_cpus < NUM_ROLES ?
+				  " (threads share CPUs: expect no difference)" :
+				  ""));
+    for (i = 0; i < NUM_ROLES; i++)
+	roles[i].cpu = -1;
+    if (n_cpus >= NUM_ROLES) {
+	for (i = 0, n_cpus = 0; n_cpus < NUM_ROLES; i++)
+	    if (CPU_ISSET (i, &set))
+		roles[n_cpus++].cpu = i;
+    }
+
+    run ("layout", roles);
+    for (i = 0; i < NUM_ROLES; i++) {
+	roles[i].field[0] = &line[2 * i];
+	roles[i].field[1] = &line[2 * i + 1];
+    }
+    run ("shared", roles);
+    return 0;
+}
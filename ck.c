@@ -0,0 +1,286 @@
+/*									tab:8
+ *
+ * ck.c - source file for frame checksums in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    ck.c
+ * History:
+ *		1
+ *		First written.
+ */
+
+#include <string.h>
+
+#include "ck.h"
+
+/*
+    CRC-8 is the CRC of the original relay: the remainder of the message,
+    multiplied by x^8, on division by x^8 + x^2 + x + 1, most significant
+    bit first.  The table gives the remainder for each value of the next
+    byte combined with the remainder so far.
+
+    CRC-32C is bit-reflected, starts from all ones and is inverted at the
+    end, as in iSCSI.  Software computes it four bytes at a time
+    ("slicing by four"): crc32c_tab[k][b] is the CRC of byte <b> followed
+    by <k> zero bytes, so one lookup in each of four tables covers a
+    32-bit word.
+*/
+
+#define CRC32C_POLY 0x82F63B78U   /* Castagnoli polynomial, reflected */
+
+static unsigned char crc8_tab[256];
+static unsigned int crc32c_tab[4][256];
+
+/* whether to use the crc32 instruction */
+static int use_hw = 0;
+
+
+#if defined (__i386__) || defined (__x86_64__)
+
+/*
+   Update CRC-32C state <crc> with the <len> bytes at <buf>, using the
+   SSE4.2 crc32 instruction.  Callers must check that the processor has
+   it.
+*/
+__attribute__ ((target ("sse4.2")))
+static unsigned int
+crc32c_hw (unsigned int crc, const unsigned char* buf, size_t len)
+{
+    unsigned int word;
+#if defined (__x86_64__)
+    unsigned long long crc64 = crc, dword;
+
+    for (; len >= 8; buf += 8, len -= 8) {
+	memcpy (&dword, buf, 8);
+	crc64 = __builtin_ia32_crc32di (crc64, dword);
+    }
+    crc = crc64;
+#endif
+    for (; len >= 4; buf += 4, len -= 4) {
+	memcpy (&word, buf, 4);
+	crc = __builtin_ia32_crc32si (crc, word);
+    }
+    for (; len > 0; buf++, len--)
+	crc = __builtin_ia32_crc32qi (crc, *buf);
+    return crc;
+}
+
+
+/*
+   Copy the <len> bytes at <src> to <dst>, updating CRC-32C state <crc>
+   with them as they pass, using the SSE4.2 crc32 instruction.  Callers
+   must check that the processor has it.
+*/
+__attribute__ ((target ("sse4.2")))
+static unsigned int
+copy_crc32c_hw (unsigned int crc, unsigned char* dst,
+		const unsigned char* src, size_t len)
+{
+    unsigned int word;
+#if defined (__x86_64__)
+    unsigned long long crc64 = crc, dword;
+
+    for (; len >= 8; src += 8, dst += 8, len -= 8) {
+	memcpy (&dword, src, 8);
+	memcpy (dst, &dword, 8);
+	crc64 = __builtin_ia32_crc32di (crc64, dword);
+    }
+    crc = crc64;
+#endif
+    for (; len >= 4; src += 4, dst += 4, len -= 4) {
+	memcpy (&word, src, 4);
+	memcpy (dst, &word, 4);
+	crc = __builtin_ia32_crc32si (crc, word);
+    }
+    for (; len > 0; src++, dst++, len--)
+	crc = __builtin_ia32_crc32qi (crc, (*dst = *src));
+    return crc;
+}
+
+#endif /* x86 */
+
+
+/*
+   Update CRC-32C state <crc> with the <len> bytes at <buf>, in
+   software.
+*/
+static unsigned int
+crc32c_sw (unsigned int crc, const unsigned char* buf, size_t len)
+{
+    for (; len >= 4; buf += 4, len -= 4) {
+	crc ^= (buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+		((unsigned int)buf[3] << 24));
+	crc = (crc32c_tab[3][crc & 0xFF] ^
+	       crc32c_tab[2][(crc >> 8) & 0xFF] ^
+	       crc32c_tab[1][(crc >> 16) & 0xFF] ^
+	       crc32c_tab[0][crc >> 24]);
+    }
+    for (; len > 0; buf++, len--)
+	crc = crc32c_tab[0][(crc ^ *buf) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+
+/*
+   Copy the <len> bytes at <src> to <dst>, updating CRC-32C state <crc>
+   with them as they pass, in software.
+*/
+static unsigned int
+copy_crc32c_sw (unsigned int crc, unsigned char* dst,
+		const unsigned char* src, size_t len)
+{
+    unsigned int word;
+
+    for (; len >= 4; src += 4, dst += 4, len -= 4) {
+	word = (src[0] | (src[1] << 8) | (src[2] << 16) |
+		((unsigned int)src[3] << 24));
+	memcpy (dst, src, 4);
+	crc ^= word;
+	crc = (crc32c_tab[3][crc & 0xFF] ^
+	       crc32c_tab[2][(crc >> 8) & 0xFF] ^
+	       crc32c_tab[1][(crc >> 16) & 0xFF] ^
+	       crc32c_tab[0][crc >> 24]);
+    }
+    for (; len > 0; src++, dst++, len--)
+	crc = crc32c_tab[0][(crc ^ (*dst = *src)) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+
+/*
+   Build the tables and check for the crc32 instruction.
+*/
+void
+ck_init (void)
+{
+    unsigned int b, k, crc;
+
+    for (b = 0; b < 256; b++) {
+	for (crc = b, k = 0; k < 8; k++)
+	    crc = ((crc & 0x80) ? (crc << 1) ^ 0x107 : crc << 1);
+	crc8_tab[b] = crc;
+
+	for (crc = b, k = 0; k < 8; k++)
+	    crc = ((crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1);
+	crc32c_tab[0][b] = crc;
+    }
+    for (b = 0; b < 256; b++)
+	for (k = 1; k < 4; k++)
+	    crc32c_tab[k][b] = (crc32c_tab[0][crc32c_tab[k - 1][b] & 0xFF] ^
+				(crc32c_tab[k - 1][b] >> 8));
+
+#if defined (__i386__) || defined (__x86_64__)
+    __builtin_cpu_init ();
+    use_hw = (__builtin_cpu_supports ("sse4.2") != 0);
+#endif
+}
+
+
+/*
+   Return 1 if CRC-32C is computed by the crc32 instruction, or 0 if it
+   is computed in software.
+*/
+int
+ck_hardware (void)
+{
+    return use_hw;
+}
+
+
+/*
+   Compute CRC-32C in software from now on, even if the crc32 instruction
+   is available, so that the two can be compared (see ckbench.c).  Like
+   ck_init, must be called before any threads start.
+*/
+void
+ck_use_software (void)
+{
+    use_hw = 0;
+}
+
+
+/*
+   Return the CRC-8 checkbits of the <len> bytes at <buf>.
+*/
+unsigned int
+ck_crc8 (const unsigned char* buf, size_t len)
+{
+    unsigned int crc = 0;
+
+    while (len-- > 0)
+	crc = crc8_tab[crc ^ *buf++];
+    return crc;
+}
+
+
+/*
+   Return the CRC-32C of the <len> bytes at <buf>.
+*/
+unsigned int
+ck_crc32c (const unsigned char* buf, size_t len)
+{
+#if defined (__i386__) || defined (__x86_64__)
+    if (use_hw)
+	return ~crc32c_hw (~0U, buf, len);
+#endif
+    return ~crc32c_sw (~0U, buf, len);
+}
+
+
+/*
+   Return the CRC-8 checkbits of bytes whose checkbits so far are <crc>,
+   followed by the <len> bytes at <buf>.  The remainder so far is the
+   checkbits themselves.
+*/
+unsigned int
+ck_extend_crc8 (unsigned int crc, const unsigned char* buf, size_t len)
+{
+    while (len-- > 0)
+	crc = crc8_tab[crc ^ *buf++];
+    return crc;
+}
+
+
+/*
+   Return the CRC-32C of bytes whose CRC-32C so far is <crc>, followed by
+   the <len> bytes at <buf>.  The state so far is the CRC inverted.
+*/
+unsigned int
+ck_extend_crc32c (unsigned int crc, const unsigned char* buf, size_t len)
+{
+#if defined (__i386__) || defined (__x86_64__)
+    if (use_hw)
+	return ~crc32c_hw (~crc, buf, len);
+#endif
+    return ~crc32c_sw (~crc, buf, len);
+}
+
+
+/*
+   Copy the <len> bytes at <src> to <dst>, which must not overlap, and
+   return their CRC-8 checkbits, reading each byte only once.
+*/
+unsigned int
+ck_copy_crc8 (unsigned char* dst, const unsigned char* src, size_t len)
+{
+    unsigned int crc = 0;
+
+    while (len-- > 0)
+	crc = crc8_tab[crc ^ (*dst++ = *src++)];
+    return crc;
+}
+
+
+/*
+   Copy the <len> bytes at <src> to <dst>, which must not overlap, and
+   return their CRC-32C, reading each byte only once.
+*/
+unsigned int
+ck_copy_crc32c (unsigned char* dst, const unsigned char* src, size_t len)
+{
+#if defined (__i386__) || defined (__x86_64__)
+    if (use_hw)
+	return ~copy_crc32c_hw (~0U, dst, src, len);
+#endif
+    return ~copy_crc32c_sw (~0U, dst, src, len);
+}
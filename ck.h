@@ -0,0 +1,111 @@
+/*									tab:8
+ *
+ * ck.h - header file for frame checksums in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    ck.h
+ * History:
+ *		1
+ *		First written.
+ */
+
+#if !defined (CK_H)
+#define CK_H
+
+/*
+    The CK module computes the checksums that protect relay frames.  CK
+    stands for checksum.  Two are offered.  CRC-8 (generator polynomial
+    x^8 + x^2 + x + 1, the checkbits of the original relay) fits in one
+    byte but misses many corruptions of more than a few bits.  CRC-32C
+    (the Castagnoli polynomial, as used by iSCSI and SCTP) detects every
+    burst of up to 32 bits and all but one in 2^32 of other corruptions.
+
+    Both are table-driven in software.  On x86 processors with SSE4.2,
+    CRC-32C uses the crc32 instruction instead, eight bytes at a time
+    (four on 32-bit builds), which is much faster than either table.
+
+    Each checksum can also be computed as the bytes are copied, so that
+    data moved into or out of a frame are read only once, and extended
+    over bytes that follow those already checked.
+
+    ck_init must be called once, before any other CK routine and before
+    any threads start; after that, the routines are thread-safe.
+*/
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+
+/*
+   Build the tables and check for the crc32 instruction.
+*/
+void ck_init (void);
+
+
+/*
+   Return 1 if CRC-32C is computed by the crc32 instruction, or 0 if it
+   is computed in software.
+*/
+int ck_hardware (void);
+
+
+/*
+   Compute CRC-32C in software from now on, even if the crc32 instruction
+   is available, so that the two can be compared (see ckbench.c).  Like
+   ck_init, must be called before any threads start.
+*/
+void ck_use_software (void);
+
+
+/*
+   Return the CRC-8 checkbits of the <len> bytes at <buf>.
+*/
+unsigned int ck_crc8 (const unsigned char* buf, size_t len);
+
+
+/*
+   Return the CRC-32C of the <len> bytes at <buf>.
+*/
+unsigned int ck_crc32c (const unsigned char* buf, size_t len);
+
+
+/*
+   Return the CRC-8 checkbits of bytes whose checkbits so far are <crc>,
+   followed by the <len> bytes at <buf>.
+*/
+unsigned int ck_extend_crc8 (unsigned int crc, const unsigned char* buf,
+			     size_t len);
+
+
+/*
+   Return the CRC-32C of bytes whose CRC-32C so far is <crc>, followed by
+   the <len> bytes at <buf>.
+*/
+unsigned int ck_extend_crc32c (unsigned int crc, const unsigned char* buf,
+			       size_t len);
+
+
+/*
+   Copy the <len> bytes at <src> to <dst>, which must not overlap, and
+   return their CRC-8 checkbits, reading each byte only once.
+*/
+unsigned int ck_copy_crc8 (unsigned char* dst, const unsigned char* src,
+			   size_t len);
+
+
+/*
+   Copy the <len> bytes at <src> to <dst>, which must not overlap, and
+   return their CRC-32C, reading each byte only once.
+*/
+unsigned int ck_copy_crc32c (unsigned char* dst, const unsigned char* src,
+			     size_t len);
+
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* CK_H */
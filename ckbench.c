@@ -0,0 +1,134 @@
+/*									tab:8
+ *
+ * ckbench.c - timing of the frame checksums of the CK module
+ *
+ * Version:	    1
+ * Filename:	    ckbench.c
+ * History:
+ *		1
+ *		First written.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ck.h"
+
+/*
+    Time CRC-8 against CRC-32C, the latter with the crc32 instruction if
+    the CPU has it and then with the slicing-by-4 tables, for the sizes
+    of frame that the relay checks: a 7-byte ACK, a short frame, and a
+    full frame of MAX_PKT_LEN (256) bytes.  Each checksum is timed alone,
+    as when a frame with a session ID is sealed, and while copying, as
+    for every other frame sent and received.  Each result is the best of
+    RUNS runs of CALLS calls.
+*/
+
+#define CALLS 1000000
+#define RUNS  5
+
+/* the checksums timed, alone and while copying */
+typedef struct method_t method_t;
+struct method_t {
+    const char* name;
+    unsigned int (*sum) (const unsigned char* buf, size_t len);
+    unsigned int (*copy_sum) (unsigned char* dst, const unsigned char* src,
+			      size_t len);
+};
+
+static unsigned char src[256], dst[256];
+
+/* the sum of all checksums computed, printed so that none is optimized
+   away */
+static unsigned int total = 0;
+
+
+/*
+   Return the time in nanoseconds from CLOCK_MONOTONIC.
+*/
+static unsigned long long
+now_ns (void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+   Return the least time taken by one call of the checksum of <m> on
+   <len> bytes, over RUNS runs, in nanoseconds; time it while copying if
+   <copy> is set.
+*/
+static double
+time_method (const method_t* m, size_t len, int copy)
+{
+    unsigned long long start, ns, best = 0;
+    int run, i;
+
+    for (run = 0; run < RUNS; run++) {
+	start = now_ns ();
+	if (copy)
+	    for (i = 0; i < CALLS; i++)
+		total += m->copy_sum (dst, src, len);
+	else
+	    for (i = 0; i < CALLS; i++)
+		total += m->sum (src, len);
+	ns = now_ns () - start;
+	if (run == 0 || ns < best)
+	    best = ns;
+    }
+    return (double)best / CALLS;
+}
+
+
+/*
+   Print the time per call of each checksum in <methods> (<n_methods> of
+   them) for each frame size, labelled with <label>.
+*/
+static void
+report (const char* label, const method_t* methods, int n_methods)
+{
+    static const size_t sizes[] = {7, 64, 256};
+    double ns;
+    int i, j, copy;
+
+    for (i = 0; i < n_methods; i++)
+	for (copy = 0; copy < 2; copy++) {
+	    printf ("%-8s %-7s %-5s", label, methods[i].name,
+		    (copy ? "copy" : "alone"));
+	    for (j = 0; j < sizeof (sizes) / sizeof (sizes[0]); j++) {
+		ns = time_method (&methods[i], sizes[j], copy);
+		printf ("  %3dB %7.1fns %5.2fGB/s", (int)sizes[j], ns,
+			sizes[j] / ns);
+	    }
+	    putchar ('\n');
+	}
+}
+
+
+int
+main (void)
+{
+    static const method_t methods[] = {
+	{"CRC-8",   ck_crc8,   ck_copy_crc8},
+	{"CRC-32C", ck_crc32c, ck_copy_crc32c}
+    };
+    int i;
+
+    for (i = 0; i < sizeof (src); i++)
+	src[i] = i * 7 + 3;
+    ck_init ();
+
+    if (ck_hardware ())
+	report ("crc32", &methods[1], 1);
+    else
+	puts ("no crc32 instruction; CRC-32C in software only");
+    ck_use_software ();
+    report ("tables", methods, 2);
+
+    printf ("(total %08X)\n", total);
+    return 0;
+}
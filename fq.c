@@ -83,7 +83,9 @@ struct fq_t {
 
 /* 
    Create a new FQ holding up to <queue_len> items of up to <item_len> 
-   bytes.  Possible return values and meanings include:
+   bytes.  The FQ's memory is touched at creation, and so is placed on
+   the NUMA node of the calling thread.  Possible return values and
+   meanings include:
      FQ_OK                  success; <new_fq> points to a pointer to 
                                  the new FQ
      FQ_BAD_PARAMETER       one or mores parameters passed were invalid
@@ -120,6 +122,8 @@ fq_create (fq_t** new_fq, int queue_len, int item_len)
     fq->item_len = item_len;
     fq->head = fq->tail = 0;
     fq->data = data_block;
+    memset (data_block, 0, fq->queue_len * item_len);
+    memset (fq->length, 0, fq->queue_len * sizeof (int));
 
     *new_fq = fq;
     return FQ_OK;
@@ -142,10 +146,38 @@ fq_err_t
 fq_enqueue (fq_t* fq, const unsigned char* buf, int buf_len,
 	    pthread_cond_t* cond, pthread_mutex_t* lock)
 {
+    unsigned char* slot;
+    fq_err_t rv;
+
     /* Check parameters. */
     if (fq == NULL || buf == NULL || buf_len < 0 || buf_len > fq->item_len)
 	return FQ_BAD_PARAMETER;
 
+    /* Enqueue the item.  No lock is necessary. */
+    if ((rv = fq_reserve (fq, &slot)) != FQ_OK)
+	return rv;
+    memcpy (slot, buf, buf_len);
+    return fq_commit (fq, buf_len, cond, lock);
+}
+
+
+/*
+   Find room at the tail of FQ <fq> for the next item, which the writer
+   then builds in place and enqueues with fq_commit.  If the queue is
+   full when checked, the routine returns an error.  Possible return
+   values and meanings include:
+     FQ_OK                  success; <*slot> points to room for an item
+				 of up to the item length of the FQ
+     FQ_BAD_PARAMETER       one or mores parameters passed were invalid
+     FQ_ITEM_DISCARDED      no room (queue full)
+*/
+fq_err_t
+fq_reserve (fq_t* fq, unsigned char** slot)
+{
+    /* Check parameters. */
+    if (fq == NULL || slot == NULL)
+	return FQ_BAD_PARAMETER;
+
     /* Check for queue full condition.  False negatives cannot occur, 
        as the head of the queue only moves forward (and only up to the
        tail), and the tail cannot be moved by any other thread.  False
@@ -156,10 +188,33 @@ fq_enqueue (fq_t* fq, const unsigned char* buf, int buf_len,
 	/* Queue appears to be full.  Return an error message. */
 	return FQ_ITEM_DISCARDED;
     }
-         
-    /* Enqueue the item.  No lock is necessary. */
-    memcpy (fq->data +  fq->tail * fq->item_len, buf, buf_len);
-    fq->length[fq->tail] = buf_len;
+
+    *slot = fq->data + fq->tail * fq->item_len;
+    return FQ_OK;
+}
+
+
+/*
+   Enqueue the <item_len>-byte item built in the room last found by
+   fq_reserve on FQ <fq>, then wake up the reader if the queue might
+   have been empty by signalling the condition variable <cond> under the
+   mutex <lock>.  A writer that decides not to enqueue the item simply
+   does not call this routine.  Possible return values and meanings
+   include:
+     FQ_OK                  success
+     FQ_BAD_PARAMETER       one or mores parameters passed were invalid
+     FQ_POSIX_MUTEX_FAILURE a Posix mutex call failed
+     FQ_POSIX_COND_FAILURE  a Posix condition variable call failed
+*/
+fq_err_t
+fq_commit (fq_t* fq, int item_len, pthread_cond_t* cond,
+	   pthread_mutex_t* lock)
+{
+    /* Check parameters. */
+    if (fq == NULL || item_len < 0 || item_len > fq->item_len)
+	return FQ_BAD_PARAMETER;
+
+    fq->length[fq->tail] = item_len;
 
     /* Need a memory barrier here to prevent the tail increment from
        becoming visible before the copied data and its length. */
@@ -203,13 +258,42 @@ fq_enqueue (fq_t* fq, const unsigned char* buf, int buf_len,
 fq_err_t 
 fq_dequeue (fq_t* fq, unsigned char* buf, int* buf_len)
 {
+    unsigned char* item;
     int len;
+    fq_err_t rv;
 
     /* Check parameters. */
     if (fq == NULL || buf == NULL || 
         (buf_len == NULL && *buf_len != 0) || *buf_len < 0)
 	return FQ_BAD_PARAMETER;
 
+    /* Dequeue an item from queue i.  No lock is necessary. */
+    if ((rv = fq_peek (fq, &item, &len)) != FQ_OK)
+	return rv;
+    if (len > *buf_len)
+	return FQ_INADEQUATE_SPACE;
+    memcpy (buf, item, len);
+    *buf_len = len;
+    return fq_release (fq);
+}
+
+
+/*
+   Find the item at the head of FQ <fq>, which the reader then uses in
+   place and removes with fq_release.  An error is returned if the queue
+   was empty when checked.  Possible return values and meanings include:
+     FQ_OK                  success; <*item> points to the item, and
+				 <*item_len> holds its length
+     FQ_BAD_PARAMETER       one or mores parameters passed were invalid
+     FQ_QUEUE_EMPTY         nothing found (queue empty)
+*/
+fq_err_t
+fq_peek (fq_t* fq, unsigned char** item, int* item_len)
+{
+    /* Check parameters. */
+    if (fq == NULL || item == NULL || item_len == NULL)
+	return FQ_BAD_PARAMETER;
+
     /* Check for queue empty condition.  False negatives cannot occur, 
        as the head of the queue only moves forward (and only up to the
        tail), and the tail cannot be moved by any other thread. */
@@ -218,21 +302,35 @@ fq_dequeue (fq_t* fq, unsigned char* buf, int* buf_len)
 	return FQ_QUEUE_EMPTY;
     }
 
-    /* Dequeue an item from queue i.  No lock is necessary. */
-    if ((len = fq->length[fq->head]) > *buf_len)
-	return FQ_INADEQUATE_SPACE;
-    memcpy (buf, fq->data + fq->head * fq->item_len, len);
-    *buf_len = len;
+    *item = fq->data + fq->head * fq->item_len;
+    *item_len = fq->length[fq->head];
+    return FQ_OK;
+}
+
+
+/*
+   Remove the item last found by fq_peek from the head of FQ <fq>,
+   giving its room back to the writer.  The item must not be used
+   afterwards.  Possible return values and meanings include:
+     FQ_OK                  success
+     FQ_BAD_PARAMETER       parameter passed was invalid
+*/
+fq_err_t
+fq_release (fq_t* fq)
+{
+    /* Check parameter. */
+    if (fq == NULL)
+	return FQ_BAD_PARAMETER;
 
     /* Need a memory barrier here to prevent the head increment from
-       becoming visible before the copied data and its length.  A
-       slightly weaker barrier (stores can't pass loads) barrier
+       becoming visible before the item and its length have been read.
+       A slightly weaker barrier (stores can't pass loads) barrier
        would suffice in this case, but for simplicity I'm using the 
        same barrier necessary for enqueue.  */
     STORE_STORE_BARRIER ();
 
-    /* Head increment must only occur after data are copied to avoid
-       race condition with writer. */
+    /* Head increment must only occur after the item has been used to
+       avoid race condition with writer. */
     fq->head = (fq->head + 1) % fq->queue_len;
 
     return FQ_OK;
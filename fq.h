@@ -76,7 +76,9 @@ typedef enum {                    /* error messages defined by FQ module     */
 
 /* 
    Create a new FQ holding up to <queue_len> items of up to <item_len> 
-   bytes.  Possible return values and meanings include:
+   bytes.  The FQ's memory is touched at creation, and so is placed on
+   the NUMA node of the calling thread.  Possible return values and
+   meanings include:
      FQ_OK                  success; <new_fq> points to a pointer to 
 				 the new FQ
      FQ_BAD_PARAMETER       one or mores parameters passed were invalid
@@ -101,6 +103,35 @@ fq_err_t fq_enqueue (fq_t* fq, const unsigned char* buf, int buf_len,
 		     pthread_cond_t* cond, pthread_mutex_t* lock);
 
 
+/*
+   Find room at the tail of FQ <fq> for the next item, which the writer
+   then builds in place and enqueues with fq_commit, saving the copy
+   made by fq_enqueue.  If the queue is full when checked, the routine
+   returns an error.  Possible return values and meanings include:
+     FQ_OK                  success; <*slot> points to room for an item
+				 of up to the item length of the FQ
+     FQ_BAD_PARAMETER       one or mores parameters passed were invalid
+     FQ_ITEM_DISCARDED      no room (queue full)
+*/
+fq_err_t fq_reserve (fq_t* fq, unsigned char** slot);
+
+
+/*
+   Enqueue the <item_len>-byte item built in the room last found by
+   fq_reserve on FQ <fq>, then wake up the reader if the queue might
+   have been empty by signalling the condition variable <cond> under the
+   mutex <lock>.  A writer that decides not to enqueue the item simply
+   does not call this routine.  Possible return values and meanings
+   include:
+     FQ_OK                  success
+     FQ_BAD_PARAMETER       one or mores parameters passed were invalid
+     FQ_POSIX_MUTEX_FAILURE a Posix mutex call failed
+     FQ_POSIX_COND_FAILURE  a Posix condition variable call failed
+*/
+fq_err_t fq_commit (fq_t* fq, int item_len, pthread_cond_t* cond,
+		    pthread_mutex_t* lock);
+
+
 /* 
    Dequeue an item from the FQ <fq> into the buffer <buf>.  The <buf_len> 
    is a value-result argument that specifies the amount of buffer space 
@@ -116,6 +147,29 @@ fq_err_t fq_enqueue (fq_t* fq, const unsigned char* buf, int buf_len,
 fq_err_t fq_dequeue (fq_t* fq, unsigned char* buf, int* buf_len);
 
 
+/*
+   Find the item at the head of FQ <fq>, which the reader then uses in
+   place and removes with fq_release, saving the copy made by
+   fq_dequeue.  An error is returned if the queue was empty when
+   checked.  Possible return values and meanings include:
+     FQ_OK                  success; <*item> points to the item, and
+				 <*item_len> holds its length
+     FQ_BAD_PARAMETER       one or mores parameters passed were invalid
+     FQ_QUEUE_EMPTY         nothing found (queue empty)
+*/
+fq_err_t fq_peek (fq_t* fq, unsigned char** item, int* item_len);
+
+
+/*
+   Remove the item last found by fq_peek from the head of FQ <fq>,
+   giving its room back to the writer.  The item must not be used
+   afterwards.  Possible return values and meanings include:
+     FQ_OK                  success
+     FQ_BAD_PARAMETER       parameter passed was invalid
+*/
+fq_err_t fq_release (fq_t* fq);
+
+
 /*
    Destroy the FQ <fq> and free all memory associated with it.  Possible 
    return values and meanings include:
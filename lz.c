@@ -0,0 +1,394 @@
+/*									tab:8
+ *
+ * lz.c - source file for streaming LZ payload compression in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    lz.c
+ * History:
+ *		1
+ *		First written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+    The LZ module defines a streaming compressor in the LZ4 family for
+    relay payloads.  See lz.h for a description of the encoded form.
+
+    The history is kept in a linear buffer large enough for two windows.
+    When new plaintext would not fit, the most recent window is moved
+    down to the start of the buffer, and positions in the hash table are
+    adjusted to match.  Keeping the history linear lets both matching and
+    match copying run without any wraparound checks.
+*/
+
+#define LZ_MIN_MATCH   4                    /* shortest match encoded    */
+#define LZ_HASH_BITS   12                   /* log2 of hash table size   */
+#define LZ_HASH_SIZE   (1 << LZ_HASH_BITS)
+#define LZ_HIST_LEN    (2 * LZ_WINDOW)      /* bytes of history buffer   */
+#define LZ_MAX_OFFSET  (LZ_WINDOW - 1)      /* offsets fit in two bytes  */
+
+/* LZ structure definition */
+struct lz_t {
+    unsigned char* hist; /* plaintext history                        */
+    int hist_len;        /* number of valid bytes in history         */
+    int* hash;           /* last history position for each hash, or -1 */
+};
+
+
+/* Read four bytes from <p> as an integer in machine byte order. */
+static inline unsigned
+read32 (const unsigned char* p)
+{
+    unsigned v;
+
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+
+/* Hash the four bytes at <p> (Knuth's multiplicative hash). */
+static inline int
+hash4 (const unsigned char* p)
+{
+    return (int)((read32 (p) * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+
+/* Number of extension bytes needed to encode a count of <n> in a nibble. */
+static inline int
+ext_len (int n)
+{
+    return (n < 15 ? 0 : (n - 15) / 255 + 1);
+}
+
+
+/* Write the extension bytes for a count of <n> at <op>; return new <op>. */
+static inline unsigned char*
+put_ext (unsigned char* op, int n)
+{
+    if (n >= 15) {
+	for (n -= 15; n >= 255; n -= 255)
+	    *op++ = 255;
+	*op++ = n;
+    }
+    return op;
+}
+
+
+/*
+   Make room for <len> more bytes at the end of the history of <lz> by
+   discarding all but the most recent window if necessary.
+*/
+static void
+make_room (lz_t* lz, int len)
+{
+    int delta, i;
+
+    if (lz->hist_len + len <= LZ_HIST_LEN)
+	return;
+
+    delta = lz->hist_len - LZ_WINDOW;
+    memmove (lz->hist, lz->hist + delta, LZ_WINDOW);
+    lz->hist_len = LZ_WINDOW;
+    for (i = 0; i < LZ_HASH_SIZE; i++)
+	lz->hash[i] = (lz->hash[i] >= delta ? lz->hash[i] - delta : -1);
+}
+
+
+/*
+   Create a new LZ stream with an empty history.  Possible return values
+   and meanings include:
+     LZ_OK                  success; <new_lz> points to a pointer to
+				 the new stream
+     LZ_BAD_PARAMETER       parameter passed was invalid
+     LZ_OUT_OF_MEMORY       inadequate memory to create stream
+*/
+lz_err_t
+lz_create (lz_t** new_lz)
+{
+    lz_t* lz;
+
+    /* Check parameter. */
+    if (new_lz == NULL)
+	return LZ_BAD_PARAMETER;
+
+    /* Allocate necessary memory. */
+    if ((lz = malloc (sizeof (lz_t))) == NULL)
+	return LZ_OUT_OF_MEMORY;
+    if ((lz->hist = malloc (LZ_HIST_LEN)) == NULL ||
+	(lz->hash = malloc (LZ_HASH_SIZE * sizeof (int))) == NULL) {
+	if (lz->hist != NULL)
+	    free (lz->hist);
+	free (lz);
+	return LZ_OUT_OF_MEMORY;
+    }
+
+    lz_reset (lz);
+    *new_lz = lz;
+    return LZ_OK;
+}
+
+
+/*
+   Discard the history of stream <lz>, as at the start of a new connection.
+*/
+void
+lz_reset (lz_t* lz)
+{
+    int i;
+
+    lz->hist_len = 0;
+    for (i = 0; i < LZ_HASH_SIZE; i++)
+	lz->hash[i] = -1;
+}
+
+
+/*
+   Compress a prefix of the <*src_len> bytes of plaintext in <src> into
+   <dst>.  Both lengths are value-result arguments: <*src_len> returns
+   the number of plaintext bytes consumed (never more than LZ_MAX_INPUT),
+   and <*dst_len> specifies the space available in <dst> and returns the
+   number of bytes written.  The compressor consumes as much plaintext as
+   will fit in the space given.  If the output would be no shorter than
+   the plaintext consumed, the stream is left unchanged and an error is
+   returned; the caller should then send the plaintext uncompressed and
+   pass it to lz_append.  Possible return values and meanings include:
+     LZ_OK                  success
+     LZ_BAD_PARAMETER       one or mores parameters passed were invalid
+     LZ_INCOMPRESSIBLE      nothing written (no gain from compression)
+*/
+lz_err_t
+lz_compress (lz_t* lz, const unsigned char* src, int* src_len,
+	     unsigned char* dst, int* dst_len)
+{
+    unsigned char* hist;
+    unsigned char* op = dst;
+    unsigned char* oend;
+    int start, end, ip, anchor, ref, h, lit, mlen, room;
+
+    /* Check parameters. */
+    if (lz == NULL || src == NULL || src_len == NULL || *src_len < 0 ||
+	dst == NULL || dst_len == NULL || *dst_len < 0)
+	return LZ_BAD_PARAMETER;
+
+    /* Append the plaintext to the history; matching works in place. */
+    if (*src_len > LZ_MAX_INPUT)
+	*src_len = LZ_MAX_INPUT;
+    make_room (lz, *src_len);
+    hist = lz->hist;
+    start = anchor = ip = lz->hist_len;
+    end = start + *src_len;
+    oend = dst + *dst_len;
+    memcpy (hist + start, src, *src_len);
+
+    /* Greedy parse: take the first match of at least LZ_MIN_MATCH bytes
+       found through the hash table.  Stop when the next sequence would
+       not fit in the output space. */
+    while (ip + LZ_MIN_MATCH <= end) {
+	h = hash4 (hist + ip);
+	ref = lz->hash[h];
+	lz->hash[h] = ip;
+	if (ref < 0 || ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+	    read32 (hist + ref) != read32 (hist + ip)) {
+	    ip++;
+	    continue;
+	}
+	for (mlen = LZ_MIN_MATCH; ip + mlen < end &&
+	     hist[ref + mlen] == hist[ip + mlen]; mlen++);
+
+	lit = ip - anchor;
+	if (op + 3 + lit + ext_len (lit) + ext_len (mlen - LZ_MIN_MATCH) >
+	    oend)
+	    break;
+
+	*op++ = ((lit < 15 ? lit : 15) << 4) |
+		(mlen - LZ_MIN_MATCH < 15 ? mlen - LZ_MIN_MATCH : 15);
+	op = put_ext (op, lit);
+	memcpy (op, hist + anchor, lit);
+	op += lit;
+	*op++ = (ip - ref) & 0xFF;
+	*op++ = (ip - ref) >> 8;
+	op = put_ext (op, mlen - LZ_MIN_MATCH);
+
+	ip += mlen;
+	anchor = ip;
+    }
+
+    /* Finish with as many of the remaining literals as fit. */
+    lit = end - anchor;
+    room = oend - op - 1;
+    if (room > 0 && lit > 0) {
+	for (lit = (lit < room ? lit : room);
+	     lit > 0 && lit + ext_len (lit) > room; lit--);
+	if (lit > 0) {
+	    *op++ = (lit < 15 ? lit : 15) << 4;
+	    op = put_ext (op, lit);
+	    memcpy (op, hist + anchor, lit);
+	    op += lit;
+	    anchor += lit;
+	}
+    }
+
+    /* Refuse output that saves nothing; history is left unchanged (stale
+       hash entries are harmless, as every candidate match is verified). */
+    if (op - dst >= anchor - start) {
+	*dst_len = 0;
+	*src_len = 0;
+	return LZ_INCOMPRESSIBLE;
+    }
+
+    /* Keep only the plaintext actually consumed in the history. */
+    lz->hist_len = anchor;
+    *src_len = anchor - start;
+    *dst_len = op - dst;
+    return LZ_OK;
+}
+
+
+/*
+   Decompress the <src_len> bytes in <src> into <dst>.  The <dst_len> is
+   a value-result argument that specifies the space available and
+   returns the number of plaintext bytes written.  Possible return values
+   and meanings include:
+     LZ_OK                  success
+     LZ_BAD_PARAMETER       one or mores parameters passed were invalid
+     LZ_CORRUPT             input malformed or too long for <dst>; the
+				 stream can no longer be used until reset
+*/
+lz_err_t
+lz_decompress (lz_t* lz, const unsigned char* src, int src_len,
+	       unsigned char* dst, int* dst_len)
+{
+    const unsigned char* ip = src;
+    const unsigned char* iend = src + src_len;
+    unsigned char* op;
+    unsigned char* ostart;
+    unsigned char* oend;
+    int token, lit, mlen, off, b;
+
+    /* Check parameters. */
+    if (lz == NULL || src == NULL || src_len < 0 || dst == NULL ||
+	dst_len == NULL || *dst_len < 0)
+	return LZ_BAD_PARAMETER;
+
+    /* Output is produced directly into the history. */
+    make_room (lz, LZ_MAX_INPUT);
+    op = ostart = lz->hist + lz->hist_len;
+    oend = ostart + (*dst_len < LZ_MAX_INPUT ? *dst_len : LZ_MAX_INPUT);
+
+    while (ip < iend) {
+	token = *ip++;
+
+	/* Copy literals. */
+	if ((lit = token >> 4) == 15)
+	    do {
+		if (ip >= iend)
+		    return LZ_CORRUPT;
+		lit += (b = *ip++);
+	    } while (b == 255);
+	if (lit > iend - ip || lit > oend - op)
+	    return LZ_CORRUPT;
+	memcpy (op, ip, lit);
+	op += lit;
+	ip += lit;
+
+	/* The final token has no match. */
+	if (ip == iend)
+	    break;
+
+	/* Copy match from history; overlapping copies repeat bytes. */
+	if (iend - ip < 2)
+	    return LZ_CORRUPT;
+	off = ip[0] | (ip[1] << 8);
+	ip += 2;
+	if ((mlen = token & 15) == 15)
+	    do {
+		if (ip >= iend)
+		    return LZ_CORRUPT;
+		mlen += (b = *ip++);
+	    } while (b == 255);
+	mlen += LZ_MIN_MATCH;
+	if (off == 0 || off > op - lz->hist || mlen > oend - op)
+	    return LZ_CORRUPT;
+	for ( ; mlen > 0; mlen--, op++)
+	    *op = op[-off];
+    }
+
+    *dst_len = op - ostart;
+    memcpy (dst, ostart, *dst_len);
+    lz->hist_len += *dst_len;
+    return LZ_OK;
+}
+
+
+/*
+   Add <len> bytes of plaintext sent or received uncompressed in <buf>
+   to the history of stream <lz>.  Possible return values and meanings
+   include:
+     LZ_OK                  success
+     LZ_BAD_PARAMETER       one or mores parameters passed were invalid
+*/
+lz_err_t
+lz_append (lz_t* lz, const unsigned char* buf, int len)
+{
+    /* Check parameters. */
+    if (lz == NULL || buf == NULL || len < 0 || len > LZ_MAX_INPUT)
+	return LZ_BAD_PARAMETER;
+
+    make_room (lz, len);
+    memcpy (lz->hist + lz->hist_len, buf, len);
+    lz->hist_len += len;
+
+    return LZ_OK;
+}
+
+
+/*
+   Destroy the stream <lz> and free all memory associated with it.
+   Possible return values and meanings include:
+     LZ_BAD_PARAMETER       parameter passed was invalid
+     LZ_OK                  success
+*/
+lz_err_t
+lz_destroy (lz_t* lz)
+{
+    /* Check parameter. */
+    if (lz == NULL)
+	return LZ_BAD_PARAMETER;
+
+    /* Free space. */
+    free (lz->hist);
+    free (lz->hash);
+    free (lz);
+
+    return LZ_OK;
+}
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void
+lz_error (const char* msg, lz_err_t err)
+{
+    static const char* const lz_err_str[LZ_NO_SUCH_ERR] = {
+	"no error reported",
+	"bad parameter passed to LZ function",
+	"memory allocation failed",
+	"data incompressible",
+	"compressed data corrupt",
+    };
+
+    if (msg == NULL)
+	fputs ("NULL message passed to lz_error.\n", stderr);
+    else if (err < 0 || err >= LZ_NO_SUCH_ERR)
+	fprintf (stderr, "%s: invalid error code passed to lz_error.\n", msg);
+    else
+	fprintf (stderr, "%s: %s\n", msg, lz_err_str[err]);
+}
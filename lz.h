@@ -0,0 +1,135 @@
+/*									tab:8
+ *
+ * lz.h - header file for streaming LZ payload compression in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    lz.h
+ * History:
+ *		1
+ *		First written.
+ */
+
+#if !defined (LZ_H)
+#define LZ_H
+
+/*
+    The LZ module defines a streaming compressor in the LZ4 family for
+    relay payloads.  Each LZ stream keeps a history of the plaintext that
+    has passed through it, so matches may refer back into data carried by
+    earlier frames of the same connection.  The compressing and the
+    decompressing ends must therefore see exactly the same sequence of
+    calls (compressed frames through lz_compress/lz_decompress, and
+    frames sent uncompressed through lz_append), in the same order.
+
+    The encoded form is a sequence of tokens.  Each token byte holds a
+    literal count in its upper four bits and a match length (less the
+    minimum of four) in its lower four bits; a nibble value of 15 is
+    extended by following bytes, each added to the count, until a byte
+    other than 255 appears.  The literals follow the token and any
+    literal extension bytes.  A two-byte little-endian match offset and
+    any match extension bytes follow the literals, except in a final
+    token, which ends at the end of the input after its literals.
+
+    Like the FQ module, an LZ stream is not thread-safe; it is meant to
+    be owned by a single channel thread.
+*/
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define LZ_WINDOW      65536  /* limit on match distance (bytes)          */
+#define LZ_MAX_INPUT    4096  /* limit on plaintext per compressed item   */
+
+typedef struct lz_t lz_t;         /* opaque stream structure                 */
+
+typedef enum {                    /* error messages defined by LZ module     */
+    LZ_OK = 0,                    /* operation suceeded                      */
+    LZ_BAD_PARAMETER,             /* bad parameter passed to LZ routine      */
+    LZ_OUT_OF_MEMORY,             /* memory allocation failed                */
+    LZ_INCOMPRESSIBLE,            /* output would not be smaller than input  */
+    LZ_CORRUPT,                   /* compressed input is malformed           */
+    LZ_NO_SUCH_ERR                /* limit on possible error codes           */
+} lz_err_t;
+
+
+/*
+   Create a new LZ stream with an empty history.  Possible return values
+   and meanings include:
+     LZ_OK                  success; <new_lz> points to a pointer to
+				 the new stream
+     LZ_BAD_PARAMETER       parameter passed was invalid
+     LZ_OUT_OF_MEMORY       inadequate memory to create stream
+*/
+lz_err_t lz_create (lz_t** new_lz);
+
+
+/*
+   Discard the history of stream <lz>, as at the start of a new connection.
+*/
+void lz_reset (lz_t* lz);
+
+
+/*
+   Compress a prefix of the <*src_len> bytes of plaintext in <src> into
+   <dst>.  Both lengths are value-result arguments: <*src_len> returns
+   the number of plaintext bytes consumed (never more than LZ_MAX_INPUT),
+   and <*dst_len> specifies the space available in <dst> and returns the
+   number of bytes written.  The compressor consumes as much plaintext as
+   will fit in the space given.  If the output would be no shorter than
+   the plaintext consumed, the stream is left unchanged and an error is
+   returned; the caller should then send the plaintext uncompressed and
+   pass it to lz_append.  Possible return values and meanings include:
+     LZ_OK                  success
+     LZ_BAD_PARAMETER       one or mores parameters passed were invalid
+     LZ_INCOMPRESSIBLE      nothing written (no gain from compression)
+*/
+lz_err_t lz_compress (lz_t* lz, const unsigned char* src, int* src_len,
+		      unsigned char* dst, int* dst_len);
+
+
+/*
+   Decompress the <src_len> bytes in <src> into <dst>.  The <dst_len> is
+   a value-result argument that specifies the space available and
+   returns the number of plaintext bytes written.  Possible return values
+   and meanings include:
+     LZ_OK                  success
+     LZ_BAD_PARAMETER       one or mores parameters passed were invalid
+     LZ_CORRUPT             input malformed or too long for <dst>; the
+				 stream can no longer be used until reset
+*/
+lz_err_t lz_decompress (lz_t* lz, const unsigned char* src, int src_len,
+			unsigned char* dst, int* dst_len);
+
+
+/*
+   Add <len> bytes of plaintext sent or received uncompressed in <buf>
+   to the history of stream <lz>.  Possible return values and meanings
+   include:
+     LZ_OK                  success
+     LZ_BAD_PARAMETER       one or mores parameters passed were invalid
+*/
+lz_err_t lz_append (lz_t* lz, const unsigned char* buf, int len);
+
+
+/*
+   Destroy the stream <lz> and free all memory associated with it.
+   Possible return values and meanings include:
+     LZ_BAD_PARAMETER       parameter passed was invalid
+     LZ_OK                  success
+*/
+lz_err_t lz_destroy (lz_t* lz);
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void lz_error (const char* msg, lz_err_t err);
+
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* LZ_H */
@@ -0,0 +1,309 @@
+/*									tab:8
+ *
+ * pool.c - source file for pre-connected TCP pool in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    pool.c
+ * History:
+ *		1
+ *		First written.
+ */
+
+#include <pthread.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+/*
+    The POOL module keeps a number of idle TCP connections to a single
+    address open so that a new relay channel can claim an established
+    connection instead of waiting out a handshake.  See pool.h.
+
+    Idle connections are kept on a stack, so claims take the most recently
+    opened connection and the oldest ones age out at the bottom.  All
+    fields are protected by the pool lock, which is never held across a
+    connect call.
+*/
+
+
+/* POOL structure definition */
+struct pool_t {
+    struct sockaddr_in addr;  /* address of connections                   */
+    int max_size;             /* limit on connections held                */
+    int target;               /* number of connections to keep ready      */
+    int n_idle;               /* number of connections held               */
+    int* fd;                  /* stack of idle connections                */
+    time_t* born;             /* time at which each connection was opened */
+
+    /* Claims seen in each of the last POOL_DEMAND_SECONDS seconds. */
+    int demand[POOL_DEMAND_SECONDS];
+    time_t demand_time;       /* second counted in demand[0]              */
+
+    unsigned long hits;       /* claims satisfied from the pool           */
+    unsigned long misses;     /* claims that found the pool empty         */
+
+    pthread_mutex_t lock;     /* lock on all of the above                 */
+    pthread_cond_t refill;    /* wakes the refill thread                  */
+};
+
+
+/* Thread main function. */
+static void* pool_refill (void* v_pool);
+
+
+/*
+   Return non-zero if idle connection <fd> has been closed by the far
+   end or has failed.  An idle connection to a server should never have
+   anything to read, so readability also counts as failure.
+*/
+static int
+is_dead (int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return (poll (&pfd, 1, 0) != 0);
+}
+
+
+/*
+   Bring the demand history of <pool> up to time <now>, then update the
+   target number of connections from it.  Called with the lock held.
+*/
+static void
+update_demand (pool_t* pool, time_t now)
+{
+    int i, shift, peak = 1;
+
+    if ((shift = now - pool->demand_time) > 0) {
+	if (shift > POOL_DEMAND_SECONDS)
+	    shift = POOL_DEMAND_SECONDS;
+	memmove (pool->demand + shift, pool->demand,
+		 (POOL_DEMAND_SECONDS - shift) * sizeof (int));
+	memset (pool->demand, 0, shift * sizeof (int));
+	pool->demand_time = now;
+    }
+
+    for (i = 0; i < POOL_DEMAND_SECONDS; i++)
+	if (pool->demand[i] > peak)
+	    peak = pool->demand[i];
+    pool->target = (peak < pool->max_size ? peak : pool->max_size);
+}
+
+
+/*
+   Create a new pool of up to <max_size> connections to <addr> and start
+   the thread that fills it.  Possible return values and meanings include:
+     POOL_OK                success; <new_pool> points to a pointer to
+				 the new pool
+     POOL_BAD_PARAMETER     one or mores parameters passed were invalid
+     POOL_OUT_OF_MEMORY     inadequate memory to create pool
+     POOL_POSIX_FAILURE     thread or synchronization setup failed
+*/
+pool_err_t
+pool_create (pool_t** new_pool, const struct sockaddr_in* addr, int max_size)
+{
+    pool_t* pool;
+    pthread_attr_t attr;
+    pthread_t trash;
+
+    /* Check parameters. */
+    if (new_pool == NULL || addr == NULL || max_size < 1)
+	return POOL_BAD_PARAMETER;
+
+    /* Allocate necessary memory. */
+    if ((pool = calloc (1, sizeof (pool_t))) == NULL)
+	return POOL_OUT_OF_MEMORY;
+    if ((pool->fd = malloc (max_size * sizeof (int))) == NULL ||
+	(pool->born = malloc (max_size * sizeof (time_t))) == NULL) {
+	if (pool->fd != NULL)
+	    free (pool->fd);
+	free (pool);
+	return POOL_OUT_OF_MEMORY;
+    }
+
+    pool->addr = *addr;
+    pool->max_size = max_size;
+    pool->target = 1;
+    pool->demand_time = time (NULL);
+
+    /* The pool is never destroyed, so neither are the lock and the
+       thread; nothing needs undoing after a partial failure beyond
+       memory. */
+    if (pthread_mutex_init (&pool->lock, NULL) != 0 ||
+	pthread_cond_init (&pool->refill, NULL) != 0 ||
+	pthread_attr_init (&attr) != 0 ||
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED) != 0 ||
+	pthread_create (&trash, &attr, pool_refill, pool) != 0) {
+	free (pool->born);
+	free (pool->fd);
+	free (pool);
+	return POOL_POSIX_FAILURE;
+    }
+
+    *new_pool = pool;
+    return POOL_OK;
+}
+
+
+/*
+   Claim an established connection from pool <pool>, returning its file
+   descriptor in <*fd>.  The caller becomes responsible for closing it.
+   Possible return values and meanings include:
+     POOL_OK                success
+     POOL_BAD_PARAMETER     one or mores parameters passed were invalid
+     POOL_EMPTY             no connection ready; the caller must connect
+				 on its own
+*/
+pool_err_t
+pool_claim (pool_t* pool, int* fd)
+{
+    pool_err_t rv = POOL_EMPTY;
+
+    /* Check parameters. */
+    if (pool == NULL || fd == NULL)
+	return POOL_BAD_PARAMETER;
+
+    (void)pthread_mutex_lock (&pool->lock);
+    update_demand (pool, time (NULL));
+    pool->demand[0]++;
+
+    /* Take the newest connection that is still usable. */
+    while (pool->n_idle > 0) {
+	*fd = pool->fd[--pool->n_idle];
+	if (!is_dead (*fd)) {
+	    rv = POOL_OK;
+	    break;
+	}
+	close (*fd);
+    }
+    if (rv == POOL_OK)
+	pool->hits++;
+    else
+	pool->misses++;
+
+    /* Either way, the refill thread has work to do. */
+    (void)pthread_cond_signal (&pool->refill);
+    (void)pthread_mutex_unlock (&pool->lock);
+
+    return rv;
+}
+
+
+/*
+   Return counts of claims satisfied from pool <pool> (<*hits>), claims
+   that found it empty (<*misses>), and connections currently held
+   (<*idle>).  Any pointer may be NULL.
+*/
+void
+pool_stats (pool_t* pool, unsigned long* hits, unsigned long* misses,
+	    int* idle)
+{
+    (void)pthread_mutex_lock (&pool->lock);
+    if (hits != NULL)
+	*hits = pool->hits;
+    if (misses != NULL)
+	*misses = pool->misses;
+    if (idle != NULL)
+	*idle = pool->n_idle;
+    (void)pthread_mutex_unlock (&pool->lock);
+}
+
+
+/*
+   Main body of the refill thread for pool <v_pool>.  Keeps the pool at
+   its target size, opening one connection at a time without the lock
+   held, and discards connections that have died or aged out.  After a
+   failed connect, waits a second before trying again.
+*/
+static void*
+pool_refill (void* v_pool)
+{
+    pool_t* pool = v_pool;
+    struct timespec ts;
+    time_t now;
+    int fd, i, j, failed = 0;
+
+    (void)pthread_mutex_lock (&pool->lock);
+    while (1) {
+	now = time (NULL);
+	update_demand (pool, now);
+
+	/* Discard dead and stale connections, oldest first. */
+	for (i = j = 0; i < pool->n_idle; i++) {
+	    if (now - pool->born[i] > POOL_MAX_IDLE_SECONDS ||
+		is_dead (pool->fd[i]))
+		close (pool->fd[i]);
+	    else {
+		pool->fd[j] = pool->fd[i];
+		pool->born[j++] = pool->born[i];
+	    }
+	}
+	pool->n_idle = j;
+
+	/* Sleep while full, or for a second after a failure; demand
+	   and idle connections are rechecked once a second. */
+	if (failed || pool->n_idle >= pool->target) {
+	    failed = 0;
+	    ts.tv_sec = now + 1;
+	    ts.tv_nsec = 0;
+	    (void)pthread_cond_timedwait (&pool->refill, &pool->lock, &ts);
+	    continue;
+	}
+
+	/* Open one more connection. */
+	(void)pthread_mutex_unlock (&pool->lock);
+	if ((fd = socket (AF_INET, SOCK_STREAM, 0)) != -1 &&
+	    connect (fd, (struct sockaddr*)&pool->addr,
+		     sizeof (pool->addr)) == -1) {
+	    close (fd);
+	    fd = -1;
+	}
+	(void)pthread_mutex_lock (&pool->lock);
+
+	if (fd == -1)
+	    failed = 1;
+	else if (pool->n_idle < pool->max_size) {
+	    pool->fd[pool->n_idle] = fd;
+	    pool->born[pool->n_idle++] = time (NULL);
+	} else
+	    close (fd);
+    }
+
+    /* never reached */
+    return NULL;
+}
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void
+pool_error (const char* msg, pool_err_t err)
+{
+    static const char* const pool_err_str[POOL_NO_SUCH_ERR] = {
+	"no error reported",
+	"bad parameter passed to POOL function",
+	"memory allocation failed",
+	"Posix thread function failed",
+	"no pooled connection available",
+    };
+
+    if (msg == NULL)
+	fputs ("NULL message passed to pool_error.\n", stderr);
+    else if (err < 0 || err >= POOL_NO_SUCH_ERR)
+	fprintf (stderr, "%s: invalid error code passed to pool_error.\n",
+		 msg);
+    else
+	fprintf (stderr, "%s: %s\n", msg, pool_err_str[err]);
+}
@@ -0,0 +1,98 @@
+/*									tab:8
+ *
+ * pool.h - header file for pre-connected TCP pool in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    pool.h
+ * History:
+ *		1
+ *		First written.
+ */
+
+#if !defined (POOL_H)
+#define POOL_H
+
+/*
+    The POOL module keeps a number of idle TCP connections to a single
+    address open so that a new relay channel can claim an established
+    connection instead of waiting out a handshake.  A background thread
+    owned by the pool refills it after each claim.
+
+    The number of connections held follows recent demand: the pool
+    remembers the largest number of claims seen in any one second over
+    the last POOL_DEMAND_SECONDS seconds and keeps that many connections
+    ready, never fewer than one nor more than the limit given at
+    creation.  Idle connections that the far end has closed, or that
+    have been idle for more than POOL_MAX_IDLE_SECONDS, are discarded.
+
+    Claims never block and may be made by any number of threads.  A pool
+    lasts for the life of the process.
+*/
+
+#include <netinet/in.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define POOL_DEMAND_SECONDS    10  /* span of demand history (seconds)    */
+#define POOL_MAX_IDLE_SECONDS  30  /* limit on idle connection age        */
+
+typedef struct pool_t pool_t;     /* opaque pool structure                   */
+
+typedef enum {                    /* error messages defined by POOL module   */
+    POOL_OK = 0,                  /* operation suceeded                      */
+    POOL_BAD_PARAMETER,           /* bad parameter passed to POOL routine    */
+    POOL_OUT_OF_MEMORY,           /* memory allocation failed                */
+    POOL_POSIX_FAILURE,           /* Posix thread call failed                */
+    POOL_EMPTY,                   /* no idle connection available            */
+    POOL_NO_SUCH_ERR              /* limit on possible error codes           */
+} pool_err_t;
+
+
+/*
+   Create a new pool of up to <max_size> connections to <addr> and start
+   the thread that fills it.  Possible return values and meanings include:
+     POOL_OK                success; <new_pool> points to a pointer to
+				 the new pool
+     POOL_BAD_PARAMETER     one or mores parameters passed were invalid
+     POOL_OUT_OF_MEMORY     inadequate memory to create pool
+     POOL_POSIX_FAILURE     thread or synchronization setup failed
+*/
+pool_err_t pool_create (pool_t** new_pool, const struct sockaddr_in* addr,
+			int max_size);
+
+
+/*
+   Claim an established connection from pool <pool>, returning its file
+   descriptor in <*fd>.  The caller becomes responsible for closing it.
+   Possible return values and meanings include:
+     POOL_OK                success
+     POOL_BAD_PARAMETER     one or mores parameters passed were invalid
+     POOL_EMPTY             no connection ready; the caller must connect
+				 on its own
+*/
+pool_err_t pool_claim (pool_t* pool, int* fd);
+
+
+/*
+   Return counts of claims satisfied from pool <pool> (<*hits>), claims
+   that found it empty (<*misses>), and connections currently held
+   (<*idle>).  Any pointer may be NULL.
+*/
+void pool_stats (pool_t* pool, unsigned long* hits, unsigned long* misses,
+		 int* idle);
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void pool_error (const char* msg, pool_err_t err);
+
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* POOL_H */
@@ -0,0 +1,292 @@
+/*									tab:8
+ *
+ * rb.c - source file for reorder buffer abstraction in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    rb.c
+ * History:
+ *		1
+ *		First written.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rb.h"
+
+/*
+    The RB module holds out-of-order items for a sliding window receiver.
+    See rb.h.
+
+    The item with sequence number <seq> lives in slot <seq> modulo the
+    window size, and bit <seq> modulo the window size of the occupancy
+    bitmap records whether the slot is full.  Because the window is never
+    larger than half the sequence space, every sequence number within the
+    window maps to a different slot, and the slot of the base is always
+    the first one to be taken.
+*/
+
+
+/* number of slots described by each word of the occupancy bitmap */
+#define RB_WORD_BITS 64
+
+
+/* RB structure definition */
+struct rb_t {
+    int window;               /* number of slots (a power of two)         */
+    int item_len;             /* size of each slot                        */
+    unsigned int seq_mask;    /* sequence numbers are modulo seq_mask + 1 */
+    unsigned int base;        /* sequence number of next item expected    */
+    int held;                 /* number of items held                     */
+    int n_words;              /* number of words in occupancy bitmap      */
+    uint64_t* full;           /* occupancy bitmap, one bit per slot       */
+    int* len;                 /* length of item held in each slot         */
+    unsigned char* data;      /* slots for items                          */
+};
+
+
+/*
+   Return the number of consecutive full slots in RB <rb> starting with
+   slot <slot> and going no further than the end of the window.  Each word
+   of the bitmap is handled with one find-first-set on its complement.
+*/
+static int
+run_from (rb_t* rb, int slot)
+{
+    int run = 0, bit, avail, n;
+    uint64_t empty;
+
+    while (run < rb->window) {
+	/* Look at the slots left in this word, or in the window. */
+	bit = slot % RB_WORD_BITS;
+	avail = RB_WORD_BITS - bit;
+	if (avail > rb->window - slot)
+	    avail = rb->window - slot;
+	empty = ~(rb->full[slot / RB_WORD_BITS] >> bit);
+	n = (empty == 0 ? RB_WORD_BITS : __builtin_ctzll (empty));
+	if (n > avail)
+	    n = avail;
+	run += n;
+	if (n < avail)
+	    break;
+	slot = (slot + n) & (rb->window - 1);
+    }
+    return (run < rb->window ? run : rb->window);
+}
+
+
+/*
+   Create a new RB with a window of <window> items of up to <item_len>
+   bytes, for sequence numbers taken modulo <seq_mask> + 1.  Both the
+   window and the sequence space must be powers of two, and the window
+   can be at most half of the sequence space (otherwise old duplicates
+   cannot be told from new items).  The base starts at zero.  Possible
+   return values and meanings include:
+     RB_OK                  success; <new_rb> points to a pointer to
+				 the new RB
+     RB_BAD_PARAMETER       one or mores parameters passed were invalid
+     RB_OUT_OF_MEMORY       inadequate memory to create RB requested
+*/
+rb_err_t
+rb_create (rb_t** new_rb, int window, int item_len, unsigned int seq_mask)
+{
+    rb_t* rb;
+
+    /* Check parameters. */
+    if (new_rb == NULL || window < 1 || window > RB_MAX_WINDOW ||
+	(window & (window - 1)) != 0 || item_len < 1 ||
+	(seq_mask & (seq_mask + 1)) != 0 || window - 1 > seq_mask / 2)
+	return RB_BAD_PARAMETER;
+
+    /* Allocate necessary memory. */
+    if ((rb = calloc (1, sizeof (rb_t))) == NULL)
+	return RB_OUT_OF_MEMORY;
+    rb->n_words = (window + RB_WORD_BITS - 1) / RB_WORD_BITS;
+    if ((rb->full = calloc (rb->n_words, sizeof (uint64_t))) == NULL ||
+	(rb->len = malloc (window * sizeof (int))) == NULL ||
+	(rb->data = malloc (window * item_len)) == NULL) {
+	if (rb->len != NULL)
+	    free (rb->len);
+	if (rb->full != NULL)
+	    free (rb->full);
+	free (rb);
+	return RB_OUT_OF_MEMORY;
+    }
+
+    rb->window = window;
+    rb->item_len = item_len;
+    rb->seq_mask = seq_mask;
+
+    *new_rb = rb;
+    return RB_OK;
+}
+
+
+/*
+   Discard all items held in RB <rb> and set its base to <base>.
+*/
+void
+rb_reset (rb_t* rb, unsigned int base)
+{
+    memset (rb->full, 0, rb->n_words * sizeof (uint64_t));
+    rb->held = 0;
+    rb->base = (base & rb->seq_mask);
+}
+
+
+/*
+   Insert the item held in <buf> and consisting of <buf_len> bytes with
+   sequence number <seq> into RB <rb>.  Possible return values and
+   meanings include:
+     RB_OK                  success
+     RB_BAD_PARAMETER       one or mores parameters passed were invalid
+     RB_OUT_OF_WINDOW       not inserted (before the base or beyond the
+				 window)
+     RB_DUPLICATE           not inserted (an item with the same sequence
+				 number is already held)
+*/
+rb_err_t
+rb_insert (rb_t* rb, unsigned int seq, const unsigned char* buf, int buf_len)
+{
+    int slot;
+    uint64_t bit;
+
+    /* Check parameters. */
+    if (rb == NULL || buf == NULL || buf_len < 0 || buf_len > rb->item_len)
+	return RB_BAD_PARAMETER;
+
+    /* The unsigned difference also puts old sequence numbers (those
+       just before the base) far beyond the window. */
+    if (((seq - rb->base) & rb->seq_mask) >= (unsigned int)rb->window)
+	return RB_OUT_OF_WINDOW;
+
+    slot = (seq & (rb->window - 1));
+    bit = (uint64_t)1 << (slot % RB_WORD_BITS);
+    if ((rb->full[slot / RB_WORD_BITS] & bit) != 0)
+	return RB_DUPLICATE;
+
+    memcpy (rb->data + slot * rb->item_len, buf, buf_len);
+    rb->len[slot] = buf_len;
+    rb->full[slot / RB_WORD_BITS] |= bit;
+    rb->held++;
+
+    return RB_OK;
+}
+
+
+/*
+   Return the number of items in RB <rb> that are ready to be taken, that
+   is, the length of the run of items held starting at the base.
+*/
+int
+rb_ready (rb_t* rb)
+{
+    if (rb->held == 0)
+	return 0;
+    return run_from (rb, rb->base & (rb->window - 1));
+}
+
+
+/*
+   Take the item at the base of RB <rb> and advance the base by one.  On
+   success, <*item> points to the item and <*item_len> holds its length.
+   The item remains valid until the next insertion into the RB, so a run
+   of items can be taken and then used together.  Possible return values
+   and meanings include:
+     RB_OK                  success
+     RB_BAD_PARAMETER       one or mores parameters passed were invalid
+     RB_NOT_READY           nothing taken (no item at the base)
+*/
+rb_err_t
+rb_take (rb_t* rb, unsigned char** item, int* item_len)
+{
+    int slot;
+    uint64_t bit;
+
+    /* Check parameters. */
+    if (rb == NULL || item == NULL || item_len == NULL)
+	return RB_BAD_PARAMETER;
+
+    slot = (rb->base & (rb->window - 1));
+    bit = (uint64_t)1 << (slot % RB_WORD_BITS);
+    if ((rb->full[slot / RB_WORD_BITS] & bit) == 0)
+	return RB_NOT_READY;
+
+    *item = rb->data + slot * rb->item_len;
+    *item_len = rb->len[slot];
+    rb->full[slot / RB_WORD_BITS] &= ~bit;
+    rb->held--;
+    rb->base = ((rb->base + 1) & rb->seq_mask);
+
+    return RB_OK;
+}
+
+
+/*
+   Return the sequence number of the next item expected by RB <rb> (its
+   base).
+*/
+unsigned int
+rb_base (rb_t* rb)
+{
+    return rb->base;
+}
+
+
+/*
+   Return the number of items held in RB <rb>, in order or not.
+*/
+int
+rb_held (rb_t* rb)
+{
+    return rb->held;
+}
+
+
+/*
+   Destroy the RB <rb> and free all memory associated with it.  Possible
+   return values and meanings include:
+     RB_BAD_PARAMETER       parameter passed was invalid
+     RB_OK                  success
+*/
+rb_err_t
+rb_destroy (rb_t* rb)
+{
+    /* Check parameter. */
+    if (rb == NULL)
+	return RB_BAD_PARAMETER;
+
+    free (rb->data);
+    free (rb->len);
+    free (rb->full);
+    free (rb);
+
+    return RB_OK;
+}
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void
+rb_error (const char* msg, rb_err_t err)
+{
+    static const char* const rb_err_str[RB_NO_SUCH_ERR] = {
+	"no error reported",
+	"bad parameter passed to RB function",
+	"memory allocation failed",
+	"sequence number outside of window",
+	"item already held",
+	"next item expected not yet held",
+    };
+
+    if (msg == NULL)
+	fputs ("NULL message passed to rb_error.\n", stderr);
+    else if (err < 0 || err >= RB_NO_SUCH_ERR)
+	fprintf (stderr, "%s: invalid error code passed to rb_error.\n", msg);
+    else
+	fprintf (stderr, "%s: %s\n", msg, rb_err_str[err]);
+}
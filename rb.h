@@ -0,0 +1,143 @@
+/*									tab:8
+ *
+ * rb.h - header file for reorder buffer abstraction in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    rb.h
+ * History:
+ *		1
+ *		First written.
+ */
+
+#if !defined (RB_H)
+#define RB_H
+
+/*
+    The RB module defines a reorder buffer for the receive side of a
+    sliding window protocol.  An RB holds items (frames) that arrive out
+    of order, and gives them back in sequence-number order once the gaps
+    before them have been filled.
+
+    Sequence numbers are unsigned values taken modulo a power of two (the
+    sequence space), and the buffer accepts items with sequence numbers
+    from the next one expected (the base) up to the window size beyond
+    it.  Each item lives in the slot given by its sequence number modulo
+    the window size, so inserting and taking an item cost the same
+    however large the window is.  Occupancy is kept in a bitmap, and the
+    length of the run of items ready for delivery is found a word at a
+    time with find-first-set scans.
+
+    Like the FQ and LZ modules, an RB is not thread-safe; it is meant to
+    be owned by a single channel thread.
+*/
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define RB_MAX_WINDOW      65536  /* limit on window size (items)            */
+
+typedef struct rb_t rb_t;         /* opaque reorder buffer structure         */
+
+typedef enum {                    /* error messages defined by RB module     */
+    RB_OK = 0,                    /* operation suceeded                      */
+    RB_BAD_PARAMETER,             /* bad parameter passed to RB routine      */
+    RB_OUT_OF_MEMORY,             /* memory allocation failed                */
+    RB_OUT_OF_WINDOW,             /* sequence number outside of window       */
+    RB_DUPLICATE,                 /* item already held; not inserted         */
+    RB_NOT_READY,                 /* next item expected not yet held         */
+    RB_NO_SUCH_ERR                /* limit on possible error codes           */
+} rb_err_t;
+
+
+/*
+   Create a new RB with a window of <window> items of up to <item_len>
+   bytes, for sequence numbers taken modulo <seq_mask> + 1.  Both the
+   window and the sequence space must be powers of two, and the window
+   can be at most half of the sequence space (otherwise old duplicates
+   cannot be told from new items).  The base starts at zero.  Possible
+   return values and meanings include:
+     RB_OK                  success; <new_rb> points to a pointer to
+				 the new RB
+     RB_BAD_PARAMETER       one or mores parameters passed were invalid
+     RB_OUT_OF_MEMORY       inadequate memory to create RB requested
+*/
+rb_err_t rb_create (rb_t** new_rb, int window, int item_len,
+		    unsigned int seq_mask);
+
+
+/*
+   Discard all items held in RB <rb> and set its base to <base>.
+*/
+void rb_reset (rb_t* rb, unsigned int base);
+
+
+/*
+   Insert the item held in <buf> and consisting of <buf_len> bytes with
+   sequence number <seq> into RB <rb>.  Possible return values and
+   meanings include:
+     RB_OK                  success
+     RB_BAD_PARAMETER       one or mores parameters passed were invalid
+     RB_OUT_OF_WINDOW       not inserted (before the base or beyond the
+				 window)
+     RB_DUPLICATE           not inserted (an item with the same sequence
+				 number is already held)
+*/
+rb_err_t rb_insert (rb_t* rb, unsigned int seq, const unsigned char* buf,
+		    int buf_len);
+
+
+/*
+   Return the number of items in RB <rb> that are ready to be taken, that
+   is, the length of the run of items held starting at the base.
+*/
+int rb_ready (rb_t* rb);
+
+
+/*
+   Take the item at the base of RB <rb> and advance the base by one.  On
+   success, <*item> points to the item and <*item_len> holds its length.
+   The item remains valid until the next insertion into the RB, so a run
+   of items can be taken and then used together.  Possible return values
+   and meanings include:
+     RB_OK                  success
+     RB_BAD_PARAMETER       one or mores parameters passed were invalid
+     RB_NOT_READY           nothing taken (no item at the base)
+*/
+rb_err_t rb_take (rb_t* rb, unsigned char** item, int* item_len);
+
+
+/*
+   Return the sequence number of the next item expected by RB <rb> (its
+   base).
+*/
+unsigned int rb_base (rb_t* rb);
+
+
+/*
+   Return the number of items held in RB <rb>, in order or not.
+*/
+int rb_held (rb_t* rb);
+
+
+/*
+   Destroy the RB <rb> and free all memory associated with it.  Possible
+   return values and meanings include:
+     RB_BAD_PARAMETER       parameter passed was invalid
+     RB_OK                  success
+*/
+rb_err_t rb_destroy (rb_t* rb);
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void rb_error (const char* msg, rb_err_t err);
+
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* RB_H */
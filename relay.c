@@ -35,91 +35,398 @@
  *		First written.
  */
 
+#define _GNU_SOURCE   /* for CPU affinity */
 #include <pthread.h>
 
+#include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <poll.h>
-#include <semaphore.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <linux/sock_diag.h>
+#include <linux/sockios.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/stropts.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 #include <string.h>
 
+#include "bq.h"
+#include "ck.h"
 #include "fq.h"
+#include "lz.h"
+#include "pool.h"
+#include "rb.h"
+#include "shm.h"
+#include "tw.h"
+#include "ur.h"
 #include "relay.h"
 #include "mp3.h"
-#include "crc.c"
-
-#define SWP_BUFFER_SIZE 32  // Sliding Window Protocol buffer size
 
 udp_channel_t* udpchans [2*MAX_CHANNELS];
 
 /* A few useful wrapper functions for Posix calls.  They kill the process
    when an error occurs.   */
 static void condition_signal (pthread_cond_t* cond);
-static int condition_timedwait (pthread_cond_t* cond, pthread_mutex_t* lock);
 static void condition_wait (pthread_cond_t* cond, pthread_mutex_t* lock);
 static void get_lock (pthread_mutex_t* lock);
 static void release_lock (pthread_mutex_t* lock);
-
-/* An empty signal handler that allows us to interrupt the poll call in the
-   TCP helper thread.  */
-static void sig_empty (int ignore);
+static void set_timer (tw_timer_t* timer, unsigned long long delay_ns);
 
 /* Syntax printing routine. */
 static void usage (const char* exec_name);
 
 /* A few utility functions. */
+static void accept_uring (ur_t** ring, const int* lfds);
+static void admit (int cli_fd, int k, const struct sockaddr_in* cli_addr);
+static int admit_drain (unsigned long long now);
+static void admit_report (unsigned long long now);
+static void admit_shed (int cli_fd);
+static void arm_timer (channel_t* ct, timer_id_t id,
+		       unsigned long long delay_ns);
+static void assign_channel (channel_t* ct, int cli_fd, unsigned short port,
+			    int traffic_class);
+static void cancel_timer (channel_t* ct, timer_id_t id);
+static channel_t* chan_alloc (void);
+static void chan_free (channel_t* ct);
+static int class_of (unsigned short port, struct in_addr addr);
+static int class_ready (class_t* cls, unsigned long long* wake_ns);
+static int connect_done (channel_t* ct, int ready);
+static int cpu_node (int cpu);
+static int cpus_for (cpu_role_t role, int index, cpu_set_t* set);
+static void create_thread (pthread_attr_t* attr, pthread_t* id,
+			   void* (*body) (void*), void* arg, cpu_role_t role,
+			   int index);
 static int create_udp_socket (int port, struct sockaddr_in* peer_addr);
 static void deactivate_channel (channel_t* ct, channel_state_t flag);
 static void init_channels (pthread_attr_t* attr, int base_port,
 			   struct sockaddr_in* peer_addr);
-static int my_write (int fd, const void* buf, size_t n);
+static void kick_helper (channel_t* ct);
+static int lz_fill_frame (lz_chan_t* zip, const unsigned char* src,
+			  int* avail, unsigned char* packet, int room,
+			  int* flags);
+static int lz_open_frame (lz_chan_t* zip, unsigned char* packet,
+			  unsigned char* plain, unsigned char** data);
+static void lz_report (channel_t* ct, int dir);
+static void lz_start (lz_chan_t* zip);
+static void make_nonblocking (int fd);
+static unsigned long long now_ns (void);
 static void open_and_activate_channel (channel_t* ct);
+static void out_append (channel_t* ct, const unsigned char* buf, int len);
+static int parse_affinity (char* spec);
+static int parse_class (char* spec);
+static int parse_cpus (char* value, cpu_set_t* set);
+static int parse_number (const char* value, long min, long max, long* n);
+static void pin_thread (cpu_role_t role, int index);
+static int pkt_check (unsigned char* frame, const unsigned char* packet,
+		      int len);
+static unsigned long long pkt_epoch (const unsigned char* frame, int* len,
+				     unsigned long long ref);
+static int pkt_seal (unsigned char* packet, const unsigned char* frame,
+		     unsigned long long epoch);
+static int recv_window (channel_t* ct);
+static void printlog (const char* fmt, ...);
+static int sched_dequeue (channel_t* ct, int lane, xmit_item_t** item,
+			  int* len);
+static void sched_report (channel_t* ct, int lane);
+static void sched_send (int fd, channel_t* ct, int lane, xmit_item_t* item,
+			int len);
+static void sched_start (sched_stats_t* stats);
+static void send_ack (channel_t* ct, unsigned int NFE, int fin,
+		      unsigned long long epoch, int flags);
+static void set_epoch (channel_t* ct, unsigned long long epoch);
+static int tcp_deliver (channel_t* ct, struct iovec* iov, int n_iov);
+static void timer_expire (tw_timer_t* timer, void* arg);
+static void tune_ack (swp_tune_t* tune, int acked, unsigned long long rtt_ns,
+		      int limit);
+static unsigned long long tune_pto (swp_tune_t* tune);
+static void tune_report (channel_t* ct);
+static void tune_start (swp_tune_t* tune, int limit);
+static void tx_flush (int wait);
 static int set_up_target_socket (short int target_port);
+static void set_busy_poll (int fd);
+static void sndbuf_report (channel_t* ct);
+static void spin_end (spin_t* spin);
+static int spin_on (spin_t* spin);
+static void spin_wait (spin_t* spin, pthread_cond_t* cond,
+		       pthread_mutex_t* lock);
+static int udp_demux (const unsigned char* packet, int len);
 static void udp_init (udp_channel_t* uct, int filedes);
+static int udp_meminfo (int fd, unsigned long* queued, unsigned long* drops);
+static void udp_monitor (int fd);
+static int udp_recv (int fd, unsigned char* packet, int wait);
+static void udp_set_buffers (int fd, int rcvbuf, int sndbuf);
 static void wake_threads (channel_t* ct, channel_state_t flag);
+static int xmit_frame (channel_t* ct, int lane, const unsigned char* packet);
 
 /* Thread main functions. */
+static void* tcp_acceptor (void* v_index);
 static void* tcp_helper (void* v_ct);
 static void* tcp_receiver (void* v_ct);
 static void* tcp_sender (void* v_ct);
 static void* udp_receiver (void* v_uct);
+static void* udp_sender (void* v_uct);
+static void* timer_driver (void* ignore);
 
 
 /* mode of operation: either MODE_TCP_TARGET or MODE_TCP_FORWARD */
 relay_mode_t mode;
 
-/* semaphore counting unbound (inactive) channels in target mode */
-sem_t channel_semaphore;            
+/* connections accepted at the relay target and waiting for a channel,
+   oldest first, in a ring of <admit_size> entries (-n option), each for
+   at most <admit_wait_ns> (-d option); the queue and its statistics are
+   shared by the acceptor threads under admit_lock, and channel threads
+   write <admit_fd> when they free a channel */
+admit_t* admit_queue;
+int admit_size = ADMIT_QUEUE_LEN;
+int admit_head = 0;
+int admit_count = 0;
+unsigned long long admit_wait_ns = ADMIT_WAIT_MS * 1000000ULL;
+admit_stats_t admit_stats;
+pthread_mutex_t admit_lock;
+int admit_fd;
 
 /* channel table */
 channel_t chan_tab[MAX_CHANNELS];
 
+/* lookup tables for udp_receiver (see udp_demux) */
+demux_t demux;
+
+/* condition on which udp_sender sleeps when all transmit lanes are empty */
+pthread_cond_t sched_cond;
+pthread_mutex_t sched_lock;
+
+/* shared UDP socket statistics and buffer sizes */
+udp_stats_t udp_stats;
+
+/* timer wheel holding the timers of all channels, and the pacing timer
+   that wakes udp_sender when a throttled class may send again (due is
+   set under sched_lock) */
+tw_t* timers;
+tw_timer_t pace_timer;
+int pace_due = 0;
+
+/* traffic classes (-c option); class 0 is the default */
+class_t classes[MAX_CLASSES] = {{0, 0, 0, 1, 0, 0, 0.0, 0, 0}};
+int n_classes = 1;
+
 /* forwarding address in forward mode */
 struct sockaddr_in fwd_addr;
 
+/* compress data read from TCP connections (-z option) */
+int compress_payload = 0;
+
+/* pre-connected TCP connections to the forwarding target in forward
+   mode, and the limit on their number (-p option; 0 for no pool) */
+pool_t* fwd_pool = NULL;
+int fwd_pool_size = 0;
+
+/* times taken to connect to the forwarding target (see connect_done) */
+connect_stats_t connect_stats;
+
+/* size of the buffer in which each channel reads ahead from TCP
+   (-b option) */
+int send_buffer_size = SEND_BUFFER_SIZE;
+
+/* limit on frames in flight for channels whose traffic class sets none
+   (-w option), and whether to tune windows to the path (-W option) */
+int max_window = INITIAL_WINDOW;
+int tune_windows = 0;
+
+/* smoothed RTT of the last stream sent to have measured one, for the
+   tail-loss probes of streams that have not (see tune_pto) */
+unsigned long long path_rtt_ns = 0;
+
+/* use io_uring for UDP sends and TCP accepts (-u option) */
+int use_uring = 0;
+
+/* TCP ports on which the relay target listens, the listening socket of
+   each acceptor thread for each port (the -t option sets the number of
+   acceptors), and the length of their listen queues (-q option) */
+unsigned short lports[MAX_CLASSES];
+int n_lports = 0;
+int lfds[MAX_ACCEPTORS][MAX_CLASSES];
+int n_acceptors = 1;
+int listen_backlog = SERVER_QUEUE;
+
+/* inactive channels at the relay target, stacked through their
+   next_free fields: the low 32 bits hold the number of the channel on
+   top plus one (0 if none), and the high 32 bits count the channels
+   taken, so that a thread whose view of the top is out of date cannot
+   succeed in taking it (see chan_alloc) */
+unsigned long long chan_free_list = 0;
+
+/* io_uring through which udp_sender sends (NULL if none), whose
+   registered buffer holds TX_RING_SLOTS transmit items; the free slots
+   are stacked in <tx_free>, and <tx_queued> counts frames not yet
+   submitted */
+ur_t* tx_ring = NULL;
+xmit_item_t* tx_slots;
+int tx_free[TX_RING_SLOTS];
+int n_tx_free = 0;
+int tx_queued = 0;
+
+/* shared-memory link that carries frames in place of the UDP socket
+   when both relays run on this host (-m option; NULL if none) */
+int use_shm = 0;
+shm_t* shm_link = NULL;
+
+/* checksum put on frames sent (-k option), and whether the peer has sent
+   frames with CRC-32C (set by udp_receiver, and read by the senders with
+   relaxed atomics); CRC-32C is used if either end asks for it */
+checksum_t checksum = CHECKSUM_CRC8;
+int peer_crc32c = 0;
+
+/* whether to send session IDs with frames (-S option), and whether the
+   peer has sent them (set like peer_crc32c); they are sent if either
+   end asks for them */
+int use_sessions = 0;
+int peer_sessions = 0;
+
+/* longest that threads spin looking for work before they block (-s
+   option; 0 never to spin), in microseconds and nanoseconds */
+int spin_us = 0;
+unsigned long long spin_ns = 0;
+
+/* CPUs to which threads of each role are pinned (-a option; an empty
+   set leaves them unpinned) */
+cpu_set_t role_cpus[NUM_CPU_ROLES];
+
 
 int
 main (int argc, char** argv)
 {
-    int fd = -1, cli_fd, i;
-    socklen_t addr_size;
+    int a, i, k, opt;
     struct sockaddr_in peer_addr;
     pthread_attr_t attr;
+    pthread_t trash;
     unsigned short tcp_port, base_port;
-    struct sockaddr_in cli_addr;
     struct hostent* he;
+    pool_err_t rv;
 
     /* Allow MP3 adversary code to extract its parameters from command line. */
     mp3_init (&argc, &argv);
+    ck_init ();
+
+    /* Relay options precede the positional arguments. */
+    while ((opt = getopt (argc, argv, "+a:b:c:d:k:mn:p:q:s:St:uw:Wz")) != -1) {
+	switch (opt) {
+	    case 'a':
+		if (parse_affinity (optarg) == -1) {
+		    fprintf (stderr, "bad CPU affinity \"%s\"\n", optarg);
+		    usage (argv[0]);
+		    return EXIT_PARSE_OPTS;
+		}
+		break;
+	    case 'b':
+		send_buffer_size = atoi (optarg);
+		if (send_buffer_size < LZ_MAX_INPUT ||
+		    send_buffer_size > BQ_MAX_SIZE) {
+		    fprintf (stderr, "send buffer must hold %d to %d bytes\n",
+			     LZ_MAX_INPUT, BQ_MAX_SIZE);
+		    usage (argv[0]);
+		    return EXIT_PARSE_OPTS;
+		}
+		break;
+	    case 'c':
+		if (parse_class (optarg) == -1) {
+		    fprintf (stderr, "bad traffic class \"%s\"\n", optarg);
+		    usage (argv[0]);
+		    return EXIT_PARSE_OPTS;
+		}
+		break;
+	    case 'd':
+		if ((i = atoi (optarg)) < 1) {
+		    fputs ("admission wait must be at least 1 ms\n", stderr);
+		    usage (argv[0]);
+		    return EXIT_PARSE_OPTS;
+		}
+		admit_wait_ns = i * 1000000ULL;
+		break;
+	    case 'k':
+		if (strcmp (optarg, "crc8") == 0)
+		    checksum = CHECKSUM_CRC8;
+		else if (strcmp (optarg, "crc32c") == 0)
+		    checksum = CHECKSUM_CRC32C;
+		else {
+		    fprintf (stderr, "bad checksum \"%s\"\n", optarg);
+		    usage (argv[0]);
+		    return EXIT_PARSE_OPTS;
+		}
+		break;
+	    case 'm': use_shm = 1; break;
+	    case 'n':
+		if ((admit_size = atoi (optarg)) < 0) {
+		    fputs ("admission queue cannot be negative\n", stderr);
+		    usage (argv[0]);
+		    return EXIT_PARSE_OPTS;
+		}
+		break;
+	    case 'p': fwd_pool_size = atoi (optarg); break;
+	    case 'q':
+		if ((listen_backlog = atoi (optarg)) < 1) {
+		    fputs ("listen queue must hold at least 1 connection\n",
+			   stderr);
+		    usage (argv[0]);
+		    return EXIT_PARSE_OPTS;
+		}
+		break;
+	    case 's':
+		spin_us = atoi (optarg);
+		if (spin_us < 1 || spin_us > SPIN_MAX_US) {
+		    fprintf (stderr, "spin must be 1 to %d microseconds\n",
+			     SPIN_MAX_US);
+		    usage (argv[0]);
+		    return EXIT_PARSE_OPTS;
+		}
+		spin_ns = spin_us * 1000ULL;
+		break;
+	    case 'S': use_sessions = 1; break;
+	    case 't':
+		n_acceptors = atoi (optarg);
+		if (n_acceptors < 1 || n_acceptors > MAX_ACCEPTORS) {
+		    fprintf (stderr, "acceptors must number 1 to %d\n",
+			     MAX_ACCEPTORS);
+		    usage (argv[0]);
+		    return EXIT_PARSE_OPTS;
+		}
+		break;
+	    case 'u': use_uring = 1; break;
+	    case 'w':
+		max_window = atoi (optarg);
+		if (max_window < INITIAL_WINDOW || max_window > MAX_WINDOW) {
+		    fprintf (stderr, "window must be %d to %d frames\n",
+			     INITIAL_WINDOW, MAX_WINDOW);
+		    usage (argv[0]);
+		    return EXIT_PARSE_OPTS;
+		}
+		break;
+	    case 'W': tune_windows = 1; break;
+	    case 'z': compress_payload = 1; break;
+	    default:  usage (argv[0]); return EXIT_PARSE_OPTS;
+	}
+    }
+    argv[optind - 1] = argv[0];
+    argv += optind - 1;
+    argc -= optind - 1;
+
+    /* Class windows default to, and may not exceed, the -w limit. */
+    for (i = 0; i < n_classes; i++)
+	if (classes[i].window == 0 || classes[i].window > max_window)
+	    classes[i].window = max_window;
 
     /* Remaining arguments must be the executable name, peer domain name,
        base UDP port, "target" or forwarding target domain name, and an 
@@ -145,7 +452,19 @@ main (int argc, char** argv)
     if (strcmp (argv[3], "target") == 0) {
 	mode = MODE_TCP_TARGET;
 	tcp_port = (argc == 5 ? atoi (argv[4]) : RELAY_SERVER_PORT);
-	fd = set_up_target_socket (tcp_port);
+
+	/* Listen on the relay port and on any other port named by a
+	   traffic class.  Each acceptor thread has its own socket for
+	   each port, among which the kernel spreads new connections. */
+	lports[n_lports++] = tcp_port;
+	for (i = 1; i < n_classes; i++) {
+	    for (k = 0; k < n_lports && lports[k] != classes[i].port; k++);
+	    if (classes[i].port != 0 && k == n_lports)
+		lports[n_lports++] = classes[i].port;
+	}
+	for (a = 0; a < n_acceptors; a++)
+	    for (k = 0; k < n_lports; k++)
+		lfds[a][k] = set_up_target_socket (lports[k]);
     } else {
 	mode = MODE_TCP_FORWARD;
 	tcp_port = (argc == 5 ? atoi (argv[4]) : WEB_SERVER_PORT);
@@ -158,18 +477,18 @@ main (int argc, char** argv)
 	fwd_addr.sin_family = AF_INET;
 	fwd_addr.sin_addr = *(struct in_addr*)he->h_addr;
 	fwd_addr.sin_port = htons (tcp_port);
+
+	/* Start filling the connection pool, if any. */
+	if (fwd_pool_size > 0 &&
+	    (rv = pool_create (&fwd_pool, &fwd_addr, fwd_pool_size)) != POOL_OK) {
+	    pool_error ("pool_create failed", rv);
+	    return EXIT_PANIC;
+	}
     }
 
     /* Ignore broken pipes. */
     signal (SIGPIPE, SIG_IGN);
 
-    /* User signal sent internally to break tcp_helper threads out
-       of poll operation.  Results are unpredictable if such a signal
-       is sent by another process.   [ sigset is obsolete and should
-       be replaced by sigaction as described in Stevens in future.
-       It causes a warning on compilation but still works.  --BH Sept. 2009 ] */
-   sigset (SIGUSR1, sig_empty);
-
     /* Prepare to spawn threads. */
     if (pthread_attr_init (&attr) != 0 ||
         pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED) != 0) {
@@ -184,38 +503,13 @@ main (int argc, char** argv)
     if (mode == MODE_TCP_FORWARD)
 	pthread_exit (0);
 
-    while (1) {
-	/* Accept a new connection. */
-	addr_size = sizeof (struct sockaddr_in);
-	if ((cli_fd = accept (fd, (struct sockaddr*)&cli_addr,
-			      &addr_size)) == -1) {
-	    perror ("accept");
-	    return EXIT_PANIC;
-	}
-
-	/* Wait for a channel if necessary. */
-	if (sem_wait (&channel_semaphore) == -1) {
-	    perror ("sem_wait for new channel");
-	    return EXIT_PANIC;
-	}
-
-	/* Find an inactive channel (one must exist). */
-	for (i = 0; chan_tab[i].active == 1; i++);
-
-	/* Lock should not be contended, but lock guarantees proper 
-	   memory ordering between channel state update and updates
-	   of other data values (threads are always running). */
-	get_lock (&chan_tab[i].channel_lock);
-	chan_tab[i].fd = cli_fd;
-	chan_tab[i].need_help = 0;
-	chan_tab[i].has_data = 0;
-	chan_tab[i].active = 1;
-	release_lock (&chan_tab[i].channel_lock);
-	chan_tab[i].channel_state = CLOSE_CHANNEL_NONE;
-
-	/* Wake up sleeping threads. */
-	wake_threads (&chan_tab[i], CLOSE_CHANNEL_NONE);
-    }
+    /* Otherwise, it becomes the first acceptor thread. */
+    for (a = 1; a < n_acceptors; a++)
+	create_thread (&attr, &trash, tcp_acceptor, (void*)(long)a,
+		       CPU_MAIN, a);
+    pin_thread (CPU_MAIN, 0);
+    tcp_acceptor ((void*)0L);
+    return EXIT_NORMAL;
 }
 
 
@@ -235,35 +529,6 @@ condition_signal (pthread_cond_t* cond)
 }
 
 
-/*
-    Perform a timed wait of TIMEOUT_IN_SECONDS seconds on condition
-    variable <cond> using mutex <lock>.  Translate errors other than
-    ETIMEDOUT (timeout) in pthread_cond_timedwait to a printed message 
-    and process exit.  Note that a timeout in seconds is not appropriate 
-    for a sliding window protocol over a local area network, and you
-    probably want the timeout to be a parameter, not a fixed value.
-*/
-static int
-condition_timedwait (pthread_cond_t* cond, pthread_mutex_t* lock)
-{
-    struct timespec ts;
-    int rv;
-
-    if (clock_gettime (CLOCK_REALTIME, &ts) == -1) {
-	perror ("clock_gettime");
-	exit (EXIT_PANIC);
-    }
-    ts.tv_sec += TIMEOUT_IN_SECONDS;
-    if ((rv = pthread_cond_timedwait (cond, lock, &ts)) != 0) {
-	if (rv == ETIMEDOUT)
-	    return ETIMEDOUT;
-	fprintf (stderr, "condition wait failed with code %d\n", rv);
-	exit (EXIT_PANIC);
-    }
-    return 0;
-}
-
-
 /*
     Translate errors in pthread_cond_wait to a printed message and
     process exit.
@@ -312,6 +577,51 @@ release_lock (pthread_mutex_t* lock)
 }
 
 
+/*
+    Arm timer <timer> on the shared wheel to expire in <delay_ns>
+    nanoseconds.  Translate errors to a printed message and process exit.
+    Must not be called with a lock that timer_expire takes.
+*/
+static void
+set_timer (tw_timer_t* timer, unsigned long long delay_ns)
+{
+    tw_err_t rv;
+
+    if ((rv = tw_arm (timers, timer, delay_ns)) != TW_OK) {
+	tw_error ("tw_arm failed", rv);
+	exit (EXIT_PANIC);
+    }
+}
+
+
+/*
+    Cancel timer <id> of channel <ct> and forget an expiry that
+    tcp_sender has not yet seen, so that it cannot act on a timer that
+    has since been stopped.  Once tw_cancel returns, timer_expire cannot
+    set the bit again.
+*/
+static void
+cancel_timer (channel_t* ct, timer_id_t id)
+{
+    tw_cancel (timers, &ct->timer[id]);
+    get_lock (&ct->udp[0].recv_lock);
+    ct->udp[0].fired &= ~TIMER_BIT (id);
+    release_lock (&ct->udp[0].recv_lock);
+}
+
+
+/*
+    (Re)arm timer <id> of channel <ct> to expire in <delay_ns>
+    nanoseconds, dropping any expiry of its earlier run not yet seen.
+*/
+static void
+arm_timer (channel_t* ct, timer_id_t id, unsigned long long delay_ns)
+{
+    cancel_timer (ct, id);
+    set_timer (&ct->timer[id], delay_ns);
+}
+
+
 /* 
    Print a log line to stderr, preceded by a timestamp.
    Older version used cftime so I edited this.  --BH
@@ -345,224 +655,607 @@ printlog (const char *fmt, ...)
 
 
 /*
-   Empty signal handler.  Allows system calls to return -1 and to set 
-   errno to EINTR.
+    Print proper command line syntax to stderr, given executable name 
+    <exec_name>.
 */
 static void
-sig_empty (int ignore)
+usage (const char* exec_name)
 {
+    fprintf (stderr, "syntax: %s [-a <affinity>]... [-b <bytes>] [-c <class>]... [-d <ms>] "
+	     "[-k crc8|crc32c] [-m] [-n <connections>] [-p <pool size>] [-q <backlog>] [-s <us>] [-S] [-t <threads>] [-u] [-w <frames>] [-W] [-z] <peer> <base UDP port> "
+	     "target|<forward target> [<TCP port>]\n", exec_name);
+    fprintf (stderr, "   (TCP port defaults to %d for target, %d for "
+	     "forwarding target)\n", RELAY_SERVER_PORT, WEB_SERVER_PORT);
+    fputs ("   -a  pin threads to CPUs, given as main=<CPUs>,recv=<CPUs>,"
+	   "send=<CPUs>,\n       timer=<CPUs>,chan=<CPUs> (all optional), "
+	   "where <CPUs> lists\n       <n> or <n>-<m> separated by colons; "
+	   "channels take the chan\n       CPUs in turn, keeping each "
+	   "channel's threads on one NUMA node\n", stderr);
+    fprintf (stderr, "   -b  read ahead up to <bytes> from each TCP connection "
+	     "(default %d)\n", SEND_BUFFER_SIZE);
+    fputs ("   -c  add a traffic class, given as port=<TCP port>,addr=<address>"
+	   "[/<bits>],\n       weight=<DRR quanta>,rate=<bytes/s>,burst=<bytes>,"
+	   "\n       window=<frames> (all optional);\n       the first class matching a connection "
+	   "applies, and both ends\n       need the same classes in the same "
+	   "order\n", stderr);
+    fprintf (stderr, "   -d  at the target, close connections that wait "
+	     "over <ms> for a\n       channel (default %d)\n", ADMIT_WAIT_MS);
+    fprintf (stderr, "   -k  protect frames with CRC-8 (default) or CRC-32C "
+	     "(%s here);\n       either end asking for CRC-32C makes both "
+	     "use it\n", (ck_hardware () ? "SSE4.2" : "software"));
+    fputs ("   -m  carry frames to a peer relay on this host through shared "
+	   "memory\n       instead of UDP (both ends need it; the base port "
+	   "names the link)\n", stderr);
+    fprintf (stderr, "   -n  at the target, let up to <connections> wait for "
+	     "a channel,\n       closing any more at once (default %d)\n",
+	     ADMIT_QUEUE_LEN);
+    fputs ("   -p  keep up to <pool size> connections to the forwarding "
+	   "target open\n", stderr);
+    fprintf (stderr, "   -q  queue up to <backlog> connections on each "
+	     "listening socket\n       (default %d)\n", SERVER_QUEUE);
+    fprintf (stderr, "   -s  spin up to <us> microseconds (at most %d) looking "
+	     "for work\n       before blocking, and busy-poll sockets\n",
+	     SPIN_MAX_US);
+    fputs ("   -S  send 64-bit session IDs with frames, so that channels can "
+	   "be\n       reused at once; either end asking for them makes both "
+	   "send them\n", stderr);
+    fprintf (stderr, "   -t  accept TCP connections in <threads> threads "
+	     "(at most %d), each\n       with its own listening sockets\n",
+	     MAX_ACCEPTORS);
+    fputs ("   -u  send UDP frames and accept TCP connections through "
+	   "io_uring,\n       where the kernel supports it\n", stderr);
+    fprintf (stderr, "   -w  allow up to <frames> in flight per channel "
+	     "(default and least %d,\n       most %d); above %d, frames carry "
+	     "32-bit sequence numbers\n", INITIAL_WINDOW, MAX_WINDOW,
+	     SEQ10_MAX_WINDOW);
+    fputs ("   -W  tune each window to twice the measured bandwidth-delay "
+	   "product\n", stderr);
+    fputs ("   -z  compress data sent to the peer (either peer can expand "
+	   "it)\n", stderr);
 }
 
 
 /*
-    Print proper command line syntax to stderr, given executable name 
-    <exec_name>.
+   Main body of the acceptor threads of the relay target; the argument
+   is the index of the thread (the main thread is acceptor 0).  Each
+   acceptor waits for connections on its own listening sockets, accepts
+   all that are waiting, and admits each (see admit).  With io_uring, it
+   waits for the completions of a multishot accept on each socket
+   instead, and falls back to the sockets if that is not possible.  It
+   also wakes when a channel is freed, to give it to the oldest waiting
+   connection, and when that connection's wait expires.
 */
-static void
-usage (const char* exec_name)
+static void*
+tcp_acceptor (void* v_index)
 {
-    fprintf (stderr, "syntax: %s <peer> <base UDP port> target|<forward "
-	     "target> [<TCP port>]\n", exec_name);
-    fprintf (stderr, "   (TCP port defaults to %d for target, %d for "
-	     "forwarding target)\n", RELAY_SERVER_PORT, WEB_SERVER_PORT);
+    int index = (long)v_index;
+    int cli_fd, k, n_pfds, timeout, polling = 0;
+    ur_t* accept_ring = NULL;
+    struct pollfd pfds[MAX_CLASSES + 1];
+    socklen_t addr_size;
+    struct sockaddr_in cli_addr;
+    eventfd_t freed;
+    ur_err_t urv;
+
+    printlog ("INIT TCP_ACCEPTOR %d", index);
+
+    /* pfds[0] is written when a channel is freed (see deactivate_channel);
+       the rest are the listening sockets, or the ring. */
+    for (k = 0; k <= MAX_CLASSES; k++)
+	pfds[k].events = POLLIN;
+    pfds[0].fd = admit_fd;
+
+    /* With io_uring, post a multishot accept on each listening port. */
+    if (use_uring) {
+	if ((urv = ur_create (&accept_ring, MAX_CLASSES, 0)) != UR_OK) {
+	    printlog ("ACCEPT WITHOUT IO_URING (%s)", strerror (errno));
+	    accept_ring = NULL;
+	}
+	for (k = 0; accept_ring != NULL && k < n_lports; k++)
+	    if ((urv = ur_accept (accept_ring, lfds[index][k],
+				  SOCK_NONBLOCK | SOCK_CLOEXEC, k)) != UR_OK) {
+		ur_error ("ur_accept failed", urv);
+		exit (EXIT_PANIC);
+	    }
+    }
+
+    while (1) {
+	if (accept_ring != NULL) {
+	    /* Submit any accepts posted, and wait for their completions. */
+	    if ((urv = ur_submit (accept_ring, 0)) != UR_OK) {
+		ur_error ("ur_submit failed", urv);
+		exit (EXIT_PANIC);
+	    }
+	    pfds[1].fd = ur_fd (accept_ring);
+	    n_pfds = 2;
+	} else {
+	    /* Without io_uring, the acceptor takes connections until none
+	       is left, so accept must not block.  (io_uring would then
+	       fail the accepts instead of waiting for connections.) */
+	    if (!polling) {
+		for (k = 0; k < n_lports; k++) {
+		    pfds[k + 1].fd = lfds[index][k];
+		    make_nonblocking (pfds[k + 1].fd);
+		}
+		polling = 1;
+	    }
+	    n_pfds = n_lports + 1;
+	}
+
+	/* Give freed channels to waiting connections, shed those that
+	   have waited too long, and find how long we may sleep. */
+	get_lock (&admit_lock);
+	timeout = admit_drain (now_ns ());
+	release_lock (&admit_lock);
+
+	if (poll (pfds, n_pfds, timeout) == -1) {
+	    if (errno == EINTR)
+		continue;
+	    perror ("poll");
+	    exit (EXIT_PANIC);
+	}
+
+	/* Consume the notice of freed channels before looking for them,
+	   so that none freed later can go unnoticed.  Another acceptor
+	   may have consumed it already. */
+	if (pfds[0].revents != 0)
+	    (void)eventfd_read (admit_fd, &freed);
+
+	if (accept_ring != NULL) {
+	    if (pfds[1].revents != 0)
+		accept_uring (&accept_ring, lfds[index]);
+	    continue;
+	}
+
+	/* Accept every connection waiting on each port that has any.
+	   Connections come out of accept4 already non-blocking, since
+	   delivery to the client must never block tcp_receiver.  A client
+	   may give up before we get to it. */
+	for (k = 0; k < n_lports; k++) {
+	    if (pfds[k + 1].revents == 0)
+		continue;
+	    while (1) {
+		addr_size = sizeof (struct sockaddr_in);
+		if ((cli_fd = accept4 (pfds[k + 1].fd,
+				       (struct sockaddr*)&cli_addr, &addr_size,
+				       SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+		    if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == EINTR)
+			break;
+		    if (errno == ECONNABORTED || errno == EPROTO)
+			continue;
+		    perror ("accept4");
+		    exit (EXIT_PANIC);
+		}
+		admit (cli_fd, k, &cli_addr);
+	    }
+	}
+    }
 }
 
 
 /*
-   Main body of the TCP helper threads.
+   Main body of the TCP helper threads.  The helper waits for data to
+   read on behalf of tcp_sender and for room to write on behalf of
+   tcp_receiver.  It sleeps only in poll, on the TCP socket and on its
+   eventfd, which other threads write to when they make a request or
+   change the channel's state (see kick_helper).  In busy-poll mode, it
+   polls the socket without waiting until it has spun for long enough
+   (see spin_on).
 */
 static void* 
 tcp_helper (void* v_ct)
 {
     channel_t* ct = v_ct;
     udp_channel_t* uct = &ct->udp[0];
-    struct pollfd pfds[1];
-    int pval;
+    struct pollfd pfds[2];
+    int pval, need_help, need_write, timeout;
+    unsigned long long waited;
+    eventfd_t kicks;
+    spin_t spin = {0, 0, 0};
 
     printlog ("%#08X INIT TCP_HELPER", (unsigned int)ct);
 
-    pfds[0].events = POLLIN;
+    pfds[1].fd = ct->wake_fd;
+    pfds[1].events = POLLIN;
 
     while (1) {
 	/* Wait for channel to become active. */
-	get_lock (&ct->help_lock);
-	while ((ct->channel_state & CLOSE_CHANNEL_HELPER) != 0)
-	    condition_wait (&ct->help, &ct->help_lock);
-	release_lock (&ct->help_lock);
+	while ((CHANNEL_LOAD (ct->channel_state) & CLOSE_CHANNEL_HELPER) != 0) {
+	    if (poll (pfds + 1, 1, INFTIM) == -1 && errno != EINTR) {
+		perror ("poll");
+		exit (EXIT_PANIC);
+	    }
+	    (void)eventfd_read (ct->wake_fd, &kicks);
+	}
 	printlog ("%#08X ACTIVATE TCP_HELPER", (unsigned int)ct);
 
-	/* Copy new connection file descriptor into poll structure. */
-	pfds[0].fd = ct->fd;
-
 	while (1) {
 	    /* Check for another thread requesting shutdown. */
-	    if (ct->channel_state != CLOSE_CHANNEL_NONE) {
+	    if (CHANNEL_LOAD (ct->channel_state) != CLOSE_CHANNEL_NONE) {
 		deactivate_channel (ct, CLOSE_CHANNEL_HELPER);
 		printlog ("%#08X DEACTIVATE TCP_HELPER", (unsigned int)ct);
 		break;
 	    }
 
-	    /* If data requested, wait for some to arrive. */
-	    if (ct->need_help) {
-		if ((pval = poll (pfds, 1, INFTIM)) < 1) {
-		    /* A return value of 0 is impossible. */
-		    if (errno != EINTR) {
-			perror ("poll");
-			exit (EXIT_PANIC);
+	    /* Wait for data or room to write, as requested, or for a
+	       kick.  A request made after the flags are read also kicks
+	       the eventfd, so poll returns at once. */
+	    need_help = CHANNEL_LOAD (ct->need_help);
+	    need_write = CHANNEL_LOAD (ct->need_write);
+	    pfds[0].fd = (need_help || need_write ? ct->fd : -1);
+	    pfds[0].events = ((need_help ? POLLIN : 0) |
+			      (need_write ? POLLOUT : 0));
+	    timeout = ((need_help || need_write) && spin_on (&spin) ?
+		       0 : INFTIM);
+
+	    /* While connecting to the forwarding target, wake in time to
+	       give up on the connection (see connect_done). */
+	    if (CHANNEL_LOAD (ct->connecting) && timeout != 0) {
+		waited = (now_ns () - ct->connect_ns) / 1000000;
+		timeout = (waited < TIMEOUT_IN_SECONDS * 1000 ?
+			   TIMEOUT_IN_SECONDS * 1000 - waited : 0);
+	    }
+	    if ((pval = poll (pfds, 2, timeout)) < 1) {
+		/* A return value of 0 means that we are spinning, or that
+		   the connection may have taken too long. */
+		if (pval == 0) {
+		    if (CHANNEL_LOAD (ct->connecting) &&
+			connect_done (ct, 0) == -1) {
+			deactivate_channel (ct, CLOSE_CHANNEL_HELPER);
+			printlog ("%#08X DEACTIVATE TCP_HELPER",
+				  (unsigned int)ct);
+			break;
 		    }
-		    printlog ("%#08X POLL INTERRUPTED IN TCP_HELPER",
-			  (unsigned int)ct);
 		    continue;
 		}
+		if (errno != EINTR) {
+		    perror ("poll");
+		    exit (EXIT_PANIC);
+		}
+		printlog ("%#08X POLL INTERRUPTED IN TCP_HELPER",
+			  (unsigned int)ct);
+		continue;
+	    }
+	    spin_end (&spin);
+	    if (pfds[1].revents != 0)
+		(void)eventfd_read (ct->wake_fd, &kicks);
+
+	    /* The connection to the forwarding target was made or failed.
+	       A failure closes the channel. */
+	    if (CHANNEL_LOAD (ct->connecting) &&
+		(pfds[0].revents & (POLLOUT | POLLERR | POLLHUP)) != 0 &&
+		connect_done (ct, 1) == -1) {
+		deactivate_channel (ct, CLOSE_CHANNEL_HELPER);
+		printlog ("%#08X DEACTIVATE TCP_HELPER", (unsigned int)ct);
+		break;
+	    }
 
-		/* Data available from TCP--wake up the sender thread. */
-		if (pval == 1 && (pfds[0].revents & POLLIN) != 0) {
-		    get_lock (&uct->recv_lock);
-		    ct->need_help = 0;
-		    ct->has_data = 1;
-		    printlog ("%#08X WAKING TCP_SENDER FROM TCP_HELPER", 
+	    /* Data available from TCP (or an error to find)--wake up the
+	       sender thread. */
+	    if (need_help &&
+		(pfds[0].revents & (POLLIN | POLLERR | POLLHUP)) != 0) {
+		get_lock (&uct->recv_lock);
+		CHANNEL_STORE (ct->need_help, 0);
+		CHANNEL_STORE (ct->has_data, 1);
+		printlog ("%#08X WAKING TCP_SENDER FROM TCP_HELPER", 
 			  (unsigned int)ct);
-		    condition_signal (&uct->recv_cond);
-		    release_lock (&uct->recv_lock);
-		}
+		condition_signal (&uct->recv_cond);
+		release_lock (&uct->recv_lock);
 	    }
 
-	    /* Wait for request for more data or deactivation of channel. */
-	    get_lock (&ct->help_lock);
-	    while (!ct->need_help &&
-		   ct->channel_state == CLOSE_CHANNEL_NONE)
-		condition_wait (&ct->help, &ct->help_lock);
-	    release_lock (&ct->help_lock);
+	    /* Room to write (or an error to find)--wake up the
+	       receiver thread. */
+	    if (need_write &&
+		(pfds[0].revents & (POLLOUT | POLLERR | POLLHUP)) != 0) {
+		get_lock (&ct->udp[1].recv_lock);
+		CHANNEL_STORE (ct->need_write, 0);
+		CHANNEL_STORE (ct->can_write, 1);
+		condition_signal (&ct->udp[1].recv_cond);
+		release_lock (&ct->udp[1].recv_lock);
+	    }
 	}
     }
 }
 
 
 /*
-   Main body of the TCP sender threads.
+   Main body of the TCP sender threads.  The sender never has more
+   frames outstanding than the window advertised in the latest ACK from
+   the receiver (see tcp_receiver), nor than the window of its traffic
+   class or, with -W, the window tuned to the path (see tune_ack).  While
+   the window is closed and nothing is outstanding, it probes every
+   PROBE_INTERVAL_MS to learn when the window reopens.  The channel
+   gives up when the receiver is silent for TIMEOUT_IN_SECONDS with
+   frames outstanding.
+
+   The sender keeps a copy of each frame in the window.  When the newest
+   frame has gone unacknowledged for about two RTTs (see tune_pto), it
+   is sent again once as a tail-loss probe, whose ACK repairs the loss
+   of that frame or of its ACK well before the channel would give up.
 */
 static void* 
 tcp_sender (void* v_ct)
 {
     channel_t* ct = v_ct;
     udp_channel_t* uct = &ct->udp[0];
-    unsigned char packet[MAX_PKT_LEN];
-    int len, LAR = 0, SEQ = 0, seq_num, epoch;
-    int is_active = 0, tcp_closed = 0, timeout = 0;
+    unsigned char packet[MAX_RECV_LEN];
+    unsigned int LAR = 0, SEQ = 0, seq_num, tail_seq = 0;
+    int len, wnd = INITIAL_WINDOW, limit = INITIAL_WINDOW;
+    int is_active = 0, tcp_closed = 0, probe = 0, can_send;
+    int fin_sent = 0, pending, seq32 = 0, probing = 0, fired;
+    int tail_armed = 0, tail_probe = 0, tail_probed = 0;
+    unsigned long long pto, elapsed;
     fq_err_t rv;
-
-    unsigned char buffer[MAX_PKT_LEN*SWP_BUFFER_SIZE];
-    unsigned char bufferValid[SWP_BUFFER_SIZE] = {0};
     int i;
 
+    /* Each frame in the window, and the time at which it was queued, by
+       sequence number modulo <sent_mask> + 1. */
+    unsigned char* frames;
+    unsigned char* frame;
+    unsigned long long* sent_ns;
+    unsigned int sent_mask;
+
+    /* Data read from TCP wait in the send buffer until the window lets
+       frames be cut from them. */
+    bq_t* sndbuf;
+    unsigned char* src;
+    bq_err_t brv;
+
+    lz_chan_t* zip = &ct->zip[0];
+    int flags;
+    lz_err_t lrv;
+    spin_t spin = {0, 0, 0};
+
     printlog ("%#08X INIT TCP_SENDER", (unsigned int)ct);
 
+    if (compress_payload && (lrv = lz_create (&zip->lz)) != LZ_OK) {
+	lz_error ("lz_create failed in tcp_sender", lrv);
+	exit (EXIT_PANIC);
+    }
+    if ((brv = bq_create (&sndbuf, send_buffer_size, LZ_MAX_INPUT)) != BQ_OK) {
+	bq_error ("bq_create failed in tcp_sender", brv);
+	exit (EXIT_PANIC);
+    }
+    for (sent_mask = 1; sent_mask < max_window + 1; sent_mask <<= 1);
+    if ((sent_ns = malloc (sent_mask * sizeof (unsigned long long))) == NULL ||
+	(frames = malloc (sent_mask * MAX_PKT_LEN)) == NULL) {
+	perror ("malloc");
+	exit (EXIT_PANIC);
+    }
+    sent_mask--;
+
     while (1) {
 	/* Check for changes in channel state. */
 	if (!is_active) {
-	    if ((ct->channel_state & CLOSE_CHANNEL_SENDER) == 0) {
+	    if ((CHANNEL_LOAD (ct->channel_state) & CLOSE_CHANNEL_SENDER) == 0) {
 		printlog ("%#08X ACTIVATE TCP_SENDER", (unsigned int)ct);
 		is_active = 1;
-		/* Reset sequence number and LAR. */
+		/* Reset sequence number, LAR, and window.  Until the
+		   first ACK, assume the receiver can hold the initial
+		   window (no end allows less).  Windows too large for
+		   10-bit sequence numbers need the 32-bit form.  No
+		   timers are pending (see deactivate_channel). */
 		SEQ = 0;
 		LAR = PREV_SEQ_NUM (0);
-		tcp_closed = 0;
-		timeout = 0;
-
-		for (i=0; i < SWP_BUFFER_SIZE; i+=1){
-		  bufferValid[i] = 0;
-		}
-
+		wnd = INITIAL_WINDOW;
+		limit = classes[ct->traffic_class].window;
+		seq32 = (limit > SEQ10_MAX_WINDOW ? PKT_FLAG_SEQ32 : 0);
+		tune_start (&ct->tune, limit);
+		tcp_closed = fin_sent = 0;
+		probe = probing = 0;
+		tail_armed = tail_probe = tail_probed = 0;
+		ct->udp[0].fired = 0;
+		memset (&ct->rtx, 0, sizeof (ct->rtx));
+		bq_reset (sndbuf);
+		memset (&ct->sndbuf, 0, sizeof (ct->sndbuf));
+		lz_start (zip);
+		sched_start (&ct->sched[0]);
 		continue;
 	    }
-	} else if (ct->channel_state != CLOSE_CHANNEL_NONE) {
+	} else if (CHANNEL_LOAD (ct->channel_state) != CLOSE_CHANNEL_NONE) {
 	    deactivate_channel (ct, CLOSE_CHANNEL_SENDER);
 	    printlog ("%#08X DEACTIVATE TCP_SENDER", (unsigned int)ct);
 	    is_active = 0;
 	    continue;
 	}
 
-	/* Read any available data and send it out.  This code should
-	   try to drain the socket, or at least pull out more than one
-	   packet if possible.  Calling fcntl FIONREAD would let us
-	   check for additional data without the possibility of blocking;
-	   calling poll or select also works.  Instead of a reasonable
-	   approach, the code here reads a packet and waits for the
-	   code below to wake up the tcp_helper and for that thread to
-	   mark data as available.  */
-	if (is_active && ct->has_data) {
-	    ct->has_data = 0;
-
-	    /* Read data from the TCP connection.  Deactivate channel
-	       if any error occurs. */
-	    if ((len = read (ct->fd, packet + 4, MAX_PKT_LEN - 5)) < 0) {
+	/* Read whatever TCP has ready into the send buffer, whether or
+	   not the window is open, so that frames are ready to go as soon
+	   as ACKs arrive.  Deactivate channel if any error occurs. */
+	if (is_active && CHANNEL_LOAD (ct->has_data) && bq_room (sndbuf) > 0) {
+	    CHANNEL_STORE (ct->has_data, 0);
+	    if ((len = bq_read (sndbuf, ct->fd)) < 0 &&
+		errno != EAGAIN && errno != EINTR) {
 		deactivate_channel (ct, CLOSE_CHANNEL_SENDER);
 		printlog ("%#08X READ FAILED IN TCP_SENDER", (unsigned int)ct);
 		is_active = 0;
 		continue;
 	    }
-
-	    /* Check for TCP connection closure. */
 	    if (len == 0)
 		tcp_closed = 1;
-	    //printlog(" ^^^^^^^^^^ ZEROING OUT REST OF PACKET, FROM %d TO %d", len+4, MAX_PKT_LEN-1);
-	    /* Fill in the header. */
-	    for (i = len+4; i<MAX_PKT_LEN-1; i+=1) 
-	      packet[i] = 0;                       //zero out the rest
-	    PKT_MAKE_HEADER (packet, 0, tcp_closed, ct->number, SEQ, ct->epoch, len);
+	    else if (len > 0 && bq_room (sndbuf) == 0)
+		ct->sndbuf.full++;
+	    if (bq_length (sndbuf) > ct->sndbuf.peak)
+		ct->sndbuf.peak = bq_length (sndbuf);
+	}
+
+	/* Send the newest frame outstanding again as a tail-loss probe.
+	   The copy is marked so that the receiver does not count it as a
+	   frame delayed on the wire (see udp_monitor). */
+	if (is_active && tail_probe && LAR != PREV_SEQ_NUM (SEQ)) {
+	    tail_seq = PREV_SEQ_NUM (SEQ);
+	    frame = frames + (tail_seq & sent_mask) * MAX_PKT_LEN;
+	    PKT_MARK_RETRANSMIT (frame);
+	    ct->rtx.probes++;
+	    tail_probed = 1;
+	    if (xmit_frame (ct, 0, frame) != 0)
+		continue;
+	    printlog ("%#08X TCP_SENDER SENT TAIL PROBE %02X:%03X",
+		  (unsigned int)ct, PKT_EPOCH (frame), PKT_SEQ_NUM (frame));
+	}
+	tail_probe = 0;
+
+	/* The window is open if fewer frames are outstanding than both
+	   the advertised window and the tuned window allow.  A frame is
+	   pending while data are buffered, and once more after TCP
+	   closure to carry the LAST flag if no data frame did.  Note when
+	   the tuned window alone holds data back. */
+	can_send = (SEQ_DIFF (LAR, SEQ) <=
+		    (wnd < ct->tune.window ? wnd : ct->tune.window));
+	pending = (bq_length (sndbuf) > 0 || (tcp_closed && !fin_sent));
+	if (!can_send && pending && SEQ_DIFF (LAR, SEQ) <= wnd)
+	    ct->tune.limited = 1;
+
+	/* Cut the next frame from the front of the send buffer, keeping
+	   it in case it must be sent again.  The stream ends with the
+	   frame that empties the buffer after TCP closure. */
+	if (is_active && can_send && pending) {
+	    ct->sndbuf.samples++;
+	    ct->sndbuf.bytes += bq_length (sndbuf);
+	    frame = frames + (SEQ & sent_mask) * MAX_PKT_LEN;
+	    flags = 0;
+	    if (zip->lz == NULL) {
+		len = bq_peek (sndbuf, (seq32 ? PKT_MAX_DATA32 : PKT_MAX_DATA),
+			       &src);
+		memcpy (PKT_DATA (frame), src, len);
+		bq_consume (sndbuf, len);
+	    } else {
+		i = bq_peek (sndbuf, LZ_MAX_INPUT, &src);
+		len = lz_fill_frame (zip, src, &i, frame,
+				     (seq32 ? PKT_MAX_DATA32 : PKT_MAX_DATA),
+				     &flags);
+		bq_consume (sndbuf, i);
+	    }
+	    fin_sent = (tcp_closed && bq_length (sndbuf) == 0);
+
+	    /* Fill in the header.  Frames are not padded (see pkt_seal). */
+	    PKT_MAKE_HEADER (frame, 0, fin_sent, ct->number,
+			     SEQ, ct->epoch, len,
+			     flags | seq32 | PKT_FLAG_CLASS (ct->traffic_class));
+	    sent_ns[SEQ & sent_mask] = now_ns ();
+
+	    /* The first frame outstanding starts the idle timer. */
+	    if (LAR == PREV_SEQ_NUM (SEQ))
+		arm_timer (ct, TIMER_IDLE, TIMEOUT_IN_SECONDS * 1000000000ULL);
 	    SEQ = NEXT_SEQ_NUM (SEQ);
-	    /* Send the packet, ignoring errors. */
-	    (void)send (uct->fd, packet, 256, 0);
-	    printlog ("%#08X TCP_SENDER SENT PACKET %02X:%02X%s(%d bytes)",
-		  (unsigned int)ct, PKT_EPOCH (packet), PKT_SEQ_NUM (packet), 
-		  (PKT_IS_LAST (packet) ? " LAST " : " "), 256);
+
+	    /* Start the tail-loss probe timer unless it is running or a
+	       probe is outstanding.  It measures from the newest frame
+	       when it expires, so it need not be restarted for each
+	       frame. */
+	    if (!tail_armed && !tail_probed &&
+		(pto = tune_pto (&ct->tune)) != 0) {
+		arm_timer (ct, TIMER_TAIL_PROBE, pto);
+		tail_armed = 1;
+	    }
+
+	    /* Queue the packet for udp_sender, waiting for room if
+	       necessary.  Failure means that the channel is closing. */
+	    if (xmit_frame (ct, 0, frame) != 0)
+		continue;
+	    printlog ("%#08X TCP_SENDER SENT PACKET %02X:%03X%s(%d bytes)",
+		  (unsigned int)ct, PKT_EPOCH (frame), PKT_SEQ_NUM (frame), 
+		  (PKT_IS_LAST (frame) ? " LAST " : " "), PKT_FRAME_LEN (frame));
+	}
+
+	/* Ask for a window update if the window stayed closed.  The probe
+	   carries the next sequence number but does not use it up. */
+	if (probe) {
+	    probe = 0;
+	    PKT_MAKE_HEADER (packet, 0, 0, ct->number, SEQ, ct->epoch, 0,
+			     PKT_FLAG_PROBE | seq32 |
+			     PKT_FLAG_CLASS (ct->traffic_class));
+	    if (xmit_frame (ct, 0, packet) != 0)
+		continue;
+	    printlog ("%#08X TCP_SENDER SENT WINDOW PROBE %02X:%03X",
+		  (unsigned int)ct, PKT_EPOCH (packet), PKT_SEQ_NUM (packet));
 	}
 
 	/* Check for incoming ACK on queue. */
-	len = MAX_PKT_LEN;
+	len = MAX_RECV_LEN;
 	if ((rv = fq_dequeue (uct->recv, packet, &len)) != FQ_OK) {
 
-	  if (rv == FQ_QUEUE_EMPTY/* && !bufferValid[0]*/) {
+	  if (rv == FQ_QUEUE_EMPTY) {
 		/* Empty queue; may need to wake tcp_helper to make data 
-		   available. */
-		if (!tcp_closed) {
-		    get_lock (&ct->help_lock);
-		    ct->need_help = 1;
-		    condition_signal (&ct->help);
-		    release_lock (&ct->help_lock);
+		   available (unless the send buffer is full). */
+		can_send = (SEQ_DIFF (LAR, SEQ) <=
+			    (wnd < ct->tune.window ? wnd : ct->tune.window));
+		pending = (bq_length (sndbuf) > 0 || (tcp_closed && !fin_sent));
+		if (!tcp_closed && !CHANNEL_LOAD (ct->has_data) &&
+		    bq_room (sndbuf) > 0 &&
+		    !CHANNEL_LOAD (ct->need_help)) {
+		    CHANNEL_STORE (ct->need_help, 1);
+		    kick_helper (ct);
+		}
+
+		/* With the window closed and nothing outstanding, start
+		   the probe timer. */
+		if (is_active && !can_send && LAR == PREV_SEQ_NUM (SEQ) &&
+		    !probing) {
+		    arm_timer (ct, TIMER_PROBE, PROBE_INTERVAL_MS * 1000000UL);
+		    probing = 1;
 		}
 		
-		/* Wait for an ACK or other wakeup event. */
+		/* Wait for an ACK, a timer, or other wakeup event. */
 		get_lock (&uct->recv_lock);
-		len = MAX_PKT_LEN;
+		len = MAX_RECV_LEN;
 		while (((is_active && 
-			 ct->channel_state == CLOSE_CHANNEL_NONE) ||
+			 CHANNEL_LOAD (ct->channel_state) == CLOSE_CHANNEL_NONE) ||
 			(!is_active && 
-			 (ct->channel_state & CLOSE_CHANNEL_SENDER) != 0)) &&
-		       !ct->has_data &&
+			 (CHANNEL_LOAD (ct->channel_state) &
+			  CLOSE_CHANNEL_SENDER) != 0)) &&
+		       ct->udp[0].fired == 0 &&
+		       !(can_send && pending) &&
+		       !(CHANNEL_LOAD (ct->has_data) &&
+			 bq_room (sndbuf) > 0) &&
 		       (rv = fq_dequeue (uct->recv, packet, &len)) == 
 			       FQ_QUEUE_EMPTY) {
-		    if (!is_active || LAR == PREV_SEQ_NUM (SEQ))
-			condition_wait (&uct->recv_cond, &uct->recv_lock);
-		    else if (condition_timedwait (&uct->recv_cond, 
-						  &uct->recv_lock) != 0) {
-			timeout = 1;
-			break;
-		    }
-		    len = MAX_PKT_LEN;
+		    spin_wait (&spin, &uct->recv_cond, &uct->recv_lock);
+		    len = MAX_RECV_LEN;
 		}
+		spin_end (&spin);
+		fired = ct->udp[0].fired;
+		ct->udp[0].fired = 0;
 		release_lock (&uct->recv_lock);
-		if (is_active && timeout) {
+
+		/* The receiver fell silent with frames still outstanding. */
+		if (is_active && (fired & TIMER_BIT (TIMER_IDLE)) != 0 &&
+		    LAR != PREV_SEQ_NUM (SEQ)) {
 		    deactivate_channel (ct, CLOSE_CHANNEL_SENDER);
 		    printlog ("%#08X TIMEOUT IN TCP_SENDER", (unsigned int)ct);
 		    is_active = 0;
 		    continue;
 		}
+
+		/* Probe if the window is still closed. */
+		if ((fired & TIMER_BIT (TIMER_PROBE)) != 0) {
+		    probing = 0;
+		    probe = (LAR == PREV_SEQ_NUM (SEQ) && wnd == 0);
+		}
+
+		/* Probe once the newest frame outstanding has gone
+		   unacknowledged for the probe timeout, or wait for the
+		   rest of it if newer frames have been sent since the
+		   timer started. */
+		if ((fired & TIMER_BIT (TIMER_TAIL_PROBE)) != 0) {
+		    tail_armed = 0;
+		    if (is_active && LAR != PREV_SEQ_NUM (SEQ) &&
+			!tail_probed && (pto = tune_pto (&ct->tune)) != 0) {
+			elapsed = (now_ns () -
+				   sent_ns[PREV_SEQ_NUM (SEQ) & sent_mask]);
+			if (elapsed < pto) {
+			    arm_timer (ct, TIMER_TAIL_PROBE, pto - elapsed);
+			    tail_armed = 1;
+			} else
+			    tail_probe = 1;
+		    }
+		}
 	    }
 
 	    /* Still no packet?  Check for errors, or restart loop for
 	       data arrival and channel activation changes. */
-	  if (rv != FQ_OK /*&& !bufferValid[0]*/) {
+	  if (rv != FQ_OK) {
 		/* Check for failure caused by something besides an 
 		   empty queue. */
 		if (rv != FQ_QUEUE_EMPTY) {
@@ -574,55 +1267,56 @@ tcp_sender (void* v_ct)
 	    }
 	}
 
-	/*	if (bufferValid[0]){
-	  for (i=0; i<MAX_PKT_LEN; i++)
-	    packet[i] = buffer[i];
-	  len = PKT_LENGTH(packet);
-	  }*/
-		
 	/* Discard if too short (should never happen). */
 	if (len < 2) 
 	    continue;
 
 	/* We've got an ACK. */
-	printlog ("%#08X TCP_SENDER GOT ACK %02X:%02X%s(%d bytes)",
+	printlog ("%#08X TCP_SENDER GOT ACK %02X:%03X%s(%d bytes) WINDOW %d",
 	      (unsigned int)ct, PKT_EPOCH (packet), PKT_SEQ_NUM (packet), 
-	      (PKT_IS_LAST (packet) ? " LAST " : " "), len);
+	      (PKT_IS_LAST (packet) ? " LAST " : " "), len,
+	      PKT_WINDOW (packet));
 
 	/* Discard silently when inactive and when packets have bad epoch. */
-	if (!is_active || (epoch = PKT_EPOCH (packet)) != ct->epoch)
+	if (!is_active || pkt_epoch (packet, &len, ct->epoch) != ct->epoch)
 	    continue;
-	
-	/* Advance LAR by 1 to the value we are expecting to receive. */
-	LAR = NEXT_SEQ_NUM (LAR);
-
-        // Move buffers down
-
-	for (i=0; i < SWP_BUFFER_SIZE-1; i+=1){
-	  buffer[MAX_PKT_LEN*i] = buffer[MAX_PKT_LEN*(i+1)];
-	  bufferValid[i] = bufferValid[i+1];
-	}
-	bufferValid[SWP_BUFFER_SIZE-1] = 0;
 
-        /* Out of order packets can be handled more aggressively. */
-	if (((seq_num = PKT_SEQ_NUM (packet)) < LAR) || (seq_num > LAR+SWP_BUFFER_SIZE)){
-	    deactivate_channel (ct, CLOSE_CHANNEL_SENDER);
-	    printlog ("%#08X OUT OF ORDER OR DUPLICATE ACK IN TCP_SENDER",
-		  (unsigned int)ct);
-	    is_active = 0;
+	/* ACKs are cumulative: an ACK for seq_num covers all frames up to
+	   it.  Ignore ACKs for frames that were never sent (left over
+	   from the last use of the sequence numbers); repeated ACKs
+	   still update the window. */
+	seq_num = PKT_FULL_SEQ (packet, SEQ);
+	if (SEQ_BEFORE (seq_num, LAR) || !SEQ_BEFORE (seq_num, SEQ))
 	    continue;
+	wnd = PKT_WINDOW (packet);
+
+	/* An ACK that covers new frames gives an RTT sample for the
+	   newest of them, unless it was sent again as a tail-loss probe
+	   (Karn's algorithm), in which case the ACK answers the probe. */
+	if (seq_num != LAR) {
+	    tune_ack (&ct->tune, SEQ_DIFF (LAR, seq_num),
+		      (tail_probed && !SEQ_BEFORE (seq_num, tail_seq) ? 0 :
+		       now_ns () - sent_ns[seq_num & sent_mask]), limit);
+	    LAR = seq_num;
+	    if (tail_probed && !SEQ_BEFORE (LAR, tail_seq)) {
+		ct->rtx.probes_acked++;
+		tail_probed = 0;
+	    }
 	}
 
-	if ((seq_num >= LAR) || (seq_num < LAR+SWP_BUFFER_SIZE))
-	  {
-	    printlog("%#08X PUTTING A PACKET INTO SEND BUFFER SLOT %d", (unsigned int)ct, LAR-seq_num);
-	    buffer[(LAR-seq_num)*MAX_PKT_LEN] = packet;
-	    bufferValid[(LAR-seq_num)] = 1;
-	  }
+	/* Any ACK shows that the receiver is alive.  Restart the idle
+	   timer while frames remain outstanding. */
+	if (LAR == PREV_SEQ_NUM (SEQ)) {
+	    cancel_timer (ct, TIMER_IDLE);
+	    cancel_timer (ct, TIMER_TAIL_PROBE);
+	    tail_armed = 0;
+	} else
+	    arm_timer (ct, TIMER_IDLE, TIMEOUT_IN_SECONDS * 1000000000ULL);
 
 	/* Finally, if we've gotten the ACK for the last packet,
-	   we're done. */
-	if (PKT_IS_LAST (packet) && (LAR == seq_num)) {
+	   we're done.  The receiver also ends the stream early with a
+	   final ACK if it cannot deliver it (see tcp_receiver). */
+	if (PKT_IS_LAST (packet)) {
 	    deactivate_channel (ct, CLOSE_CHANNEL_SENDER);
 	    printlog ("%#08X STREAM SEND COMPLETED IN TCP_SENDER",
 		  (unsigned int)ct);
@@ -641,18 +1335,47 @@ tcp_receiver (void* v_ct)
 {
     channel_t* ct = v_ct;
     udp_channel_t* uct = &ct->udp[1];
-    unsigned char packet[MAX_PKT_LEN];
-    int len, NFE = 0, seq_num, epoch;
-    int is_active = 0;
+    unsigned char* packet;
+    unsigned int NFE = 0, seq_num, highest = PREV_SEQ_NUM (0);
+    unsigned long long epoch = 0, got;
+    int len, size;
+    int is_active = 0, held = 0;
     fq_err_t rv;
 
-    unsigned char buffer[SWP_BUFFER_SIZE*MAX_PKT_LEN];
-    unsigned char bufferValid[SWP_BUFFER_SIZE] = {0};
-    int i;
-    
+    /* Frames that arrive ahead of NFE wait in the reorder buffer, which
+       can hold the largest window allowed. */
+    rb_t* rb;
+    rb_err_t rb_rv;
+    unsigned char* frame;
+    int n_ready, fin = 0, failed, seq32 = 0;
+
+    /* The final ACK of the last stream received in full, sent again if
+       the sender resends its last frame because that ACK was lost. */
+    unsigned long long last_epoch = 0;
+    unsigned int last_NFE = 0;
+    int last_acked = 0, last_flags = 0;
+
+    /* A batch of in-order data gathered for writev (iov[0] is reserved
+       for pending output), with room to expand every frame in a batch
+       of compressed frames. */
+    struct iovec iov[DELIVER_BATCH + 1];
+    unsigned char* plain;
+    unsigned char* data;
+    int n_iov, plain_used;
+    spin_t spin = {0, 0, 0};
 
     printlog ("%#08X INIT TCP_RECEIVER", (unsigned int)ct);
 
+    if ((plain = malloc (DELIVER_BATCH * LZ_MAX_INPUT)) == NULL) {
+	perror ("malloc");
+	exit (EXIT_PANIC);
+    }
+    for (size = 1; size < max_window; size <<= 1);
+    if ((rb_rv = rb_create (&rb, size, MAX_PKT_LEN, SEQ_NUM_MASK)) != RB_OK) {
+	rb_error ("rb_create failed in tcp_receiver", rb_rv);
+	exit (EXIT_PANIC);
+    }
+
     while (1) {
 	/* Check for changes in channel state. */
 	if (!is_active) {
@@ -660,7 +1383,7 @@ tcp_receiver (void* v_ct)
 	       channels in response to accepted TCP connections.  The 
 	       forwarding end does so in response to the first packet
 	       with the current epoch number. */
-	    if ((ct->channel_state & CLOSE_CHANNEL_RECEIVER) == 0) {
+	    if ((CHANNEL_LOAD (ct->channel_state) & CLOSE_CHANNEL_RECEIVER) == 0) {
 		if (mode != MODE_TCP_TARGET) {
 		    fputs ("channel activated incorrectly in tcp_receiver\n",
 			   stderr);
@@ -668,48 +1391,91 @@ tcp_receiver (void* v_ct)
 		}
 		printlog ("%#08X ACTIVATE TCP_RECEIVER", (unsigned int)ct);
 		is_active = 1;
-		/* Reset NFE. */
+		/* Reset NFE and output. */
 		NFE = 0;
-
-		for (i=0; i < SWP_BUFFER_SIZE; i+=1){
-		  bufferValid[i] = 0;
-		}
+		fin = 0;
+		ct->out_len = 0;
+		CHANNEL_STORE (ct->need_write, 0);
+		CHANNEL_STORE (ct->can_write, 0);
+		lz_start (&ct->zip[1]);
+		sched_start (&ct->sched[1]);
+		rb_reset (rb, NFE);
+		highest = PREV_SEQ_NUM (NFE);
 		continue;
 	    }
-	} else if (ct->channel_state != CLOSE_CHANNEL_NONE) {
+	} else if (CHANNEL_LOAD (ct->channel_state) != CLOSE_CHANNEL_NONE ||
+		   CHANNEL_LOAD (ct->connect_failed)) {
+	    /* If the forwarding target could not be reached, end the
+	       stream with a final ACK, which makes the relay target close
+	       its connection rather than wait for a reply. */
+	    if (CHANNEL_LOAD (ct->connect_failed)) {
+		send_ack (ct, NFE, 1, epoch, seq32);
+		last_acked = 1;
+		last_epoch = epoch;
+		last_NFE = NFE;
+		last_flags = seq32;
+	    }
 	    deactivate_channel (ct, CLOSE_CHANNEL_RECEIVER);
 	    printlog ("%#08X DEACTIVATE TCP_RECEIVER", (unsigned int)ct);
 	    is_active = 0;
 	    continue;
 	}
 
-	/* Check for incoming message on queue. */
-	len = MAX_PKT_LEN;
-	if ((rv = fq_dequeue (uct->recv, packet, &len)) != FQ_OK) {
+	/* Once the helper finds room in the TCP socket, write out as
+	   much pending output as it will take.  The stream is done when
+	   the last of it is written after the last frame. */
+	if (is_active && CHANNEL_LOAD (ct->can_write)) {
+	    CHANNEL_STORE (ct->can_write, 0);
+	    if (tcp_deliver (ct, iov, 1) == -1) {
+		printlog ("%#08X WRITE FAILED IN TCP_RECEIVER", (unsigned int)ct);
+		deactivate_channel (ct, CLOSE_CHANNEL_RECEIVER);
+		is_active = 0;
+		continue;
+	    }
+	    if (fin && ct->out_len == 0) {
+		printlog ("%#08X RECEIVED LAST PACKET IN TCP_RECEIVER",
+			  (unsigned int)ct);
+		deactivate_channel (ct, CLOSE_CHANNEL_RECEIVER);
+		is_active = 0;
+		continue;
+	    }
+	}
+
+	/* Check for incoming message on queue.  Each frame is used where
+	   udp_receiver put it, and its room is given back once we look for
+	   the next. */
+	if (held) {
+	    if ((rv = fq_release (uct->recv)) != FQ_OK) {
+		fq_error ("fq_release failed in tcp_receiver", rv);
+		exit (EXIT_PANIC);
+	    }
+	    held = 0;
+	}
+	if ((rv = fq_peek (uct->recv, &packet, &len)) != FQ_OK) {
 
-	  if (rv == FQ_QUEUE_EMPTY/* && !bufferValid[0]*/) {
+	  if (rv == FQ_QUEUE_EMPTY) {
 		/* Empty queue: wait for a packet or other wakeup event. */
 		get_lock (&uct->recv_lock);
-		len = MAX_PKT_LEN;
 		while (((is_active && 
-			 ct->channel_state == CLOSE_CHANNEL_NONE) ||
+			 CHANNEL_LOAD (ct->channel_state) == CLOSE_CHANNEL_NONE) ||
 			(!is_active && 
-			 (ct->channel_state & CLOSE_CHANNEL_RECEIVER) != 0)) &&
-		       (rv = fq_dequeue (uct->recv, packet, &len)) == 
-			       FQ_QUEUE_EMPTY) {
-		    condition_wait (&uct->recv_cond, &uct->recv_lock);
-		    len = MAX_PKT_LEN;
-		}
+			 (CHANNEL_LOAD (ct->channel_state) &
+			  CLOSE_CHANNEL_RECEIVER) != 0)) &&
+		       !(is_active && CHANNEL_LOAD (ct->can_write)) &&
+		       (rv = fq_peek (uct->recv, &packet, &len)) == 
+			       FQ_QUEUE_EMPTY)
+		    spin_wait (&spin, &uct->recv_cond, &uct->recv_lock);
+		spin_end (&spin);
 		release_lock (&uct->recv_lock);
 	    }
 
 	    /* Still no packet?  Check for errors, or restart loop for
 	       channel activation changes. */
-	  if (rv != FQ_OK/* && !bufferValid[0]*/) {
+	  if (rv != FQ_OK) {
 		/* Check for failure caused by something besides an 
 		   empty queue. */
 		if (rv != FQ_QUEUE_EMPTY) {
-		    fq_error ("fq_dequeue failed in tcp_receiver", rv);
+		    fq_error ("fq_peek failed in tcp_receiver", rv);
 		    exit (EXIT_PANIC);
 		}
 
@@ -718,11 +1484,7 @@ tcp_receiver (void* v_ct)
 	    }
 	}
 
-	/*	if (bufferValid[0]){
-	  for (i=0; i<MAX_PKT_LEN; i++)
-	    packet[i] = buffer[i];
- 	  len = PKT_LENGTH(packet);
-	  }*/
+	held = 1;
 
 	/* Discard if too short (should never happen). */
 	if (len < 2) 
@@ -732,6 +1494,17 @@ tcp_receiver (void* v_ct)
 	printlog ("%#08X TCP_RECEIVER GOT PACKET %02X:%03X ON CHANNEL %02X %s(%d bytes)",
 		  (unsigned int)ct, PKT_EPOCH (packet), PKT_SEQ_NUM (packet), PKT_CHAN_NUM(packet),
 	      (PKT_IS_LAST (packet) ? " LAST " : " "), len);
+
+	/* A frame of the stream last received in full means that the
+	   sender never got our final ACK: send it again.  By now the
+	   channel may be closed, or open for a later epoch. */
+	got = pkt_epoch (packet, &len, ct->epoch);
+	if (last_acked && got == last_epoch &&
+	    (!is_active || got != ct->epoch)) {
+	    send_ack (ct, last_NFE, 1, last_epoch, last_flags);
+	    continue;
+	}
+
         if (mode == MODE_TCP_TARGET) {
 	    /* Discard packets received when inactive, and discard packets
 	       with the incorrect epoch number.  The response when inactive
@@ -743,17 +1516,17 @@ tcp_receiver (void* v_ct)
 	       added, it's not worth adding another synchronization round 
 	       to verify channel activation. */
 	  
-	  if (!is_active || (epoch = PKT_EPOCH (packet)) != ct->epoch)
+	  if (!is_active || (epoch = got) != ct->epoch)
 		continue;
 	} else {
 	    /* Forwarding mode: the first packet received for this epoch,
 	       and any packet received for a subsequent epoch, should
 	       create a new TCP connection (deactivate and reactivate
 	       the channel). */
-	    if ((epoch = PKT_EPOCH (packet)) != ct->epoch) {
+	    if ((epoch = got) != ct->epoch) {
 
 		/* Discard packets from earlier epochs. */
-		if (EPOCH_IS_EARLIER (epoch, ct->epoch))
+		if (EPOCH_BEFORE (epoch, ct->epoch))
 		    continue;
 
 		/* Newer epoch received.  Deactivate channel if necessary. */
@@ -762,16 +1535,17 @@ tcp_receiver (void* v_ct)
 			  (unsigned int)ct);
 		    deactivate_channel (ct, CLOSE_CHANNEL_RECEIVER);
 		    is_active = 0;
+		}
 
-		    /* Wait for deactivation to finish. */
-		    get_lock (&uct->recv_lock);
-		    while (ct->channel_state != CLOSE_CHANNEL_ALL)
-			condition_wait (&uct->recv_cond, &uct->recv_lock);
-		    release_lock (&uct->recv_lock);
+		/* Wait for any deactivation to finish, so that the epoch is
+		   not bumped after we set it (see deactivate_channel). */
+		get_lock (&uct->recv_lock);
+		while (CHANNEL_LOAD (ct->active))
+		    condition_wait (&uct->recv_cond, &uct->recv_lock);
+		release_lock (&uct->recv_lock);
 
-		    /* Update epoch number. */
-		    ct->epoch = epoch;
-		}
+		/* Update epoch number. */
+		set_epoch (ct, epoch);
 	    } 
 
 	    /* If the channel is inactive, open a TCP connection and mark
@@ -779,60 +1553,96 @@ tcp_receiver (void* v_ct)
 	    if (!is_active) {
 		printlog ("%#08X FIRST EPOCH PACKET ACTIVATION IN TCP_RECEIVER",
 		      (unsigned int)ct);
+		/* Adopt the traffic class chosen by the relay target. */
+		if ((ct->traffic_class = PKT_CLASS (packet)) >= n_classes)
+		    ct->traffic_class = 0;
+		/* Reset NFE and output. */
+		NFE = 0;
+		fin = 0;
+		ct->out_len = 0;
 		open_and_activate_channel (ct);
 		is_active = 1;
-		/* Reset NFE. */
-		NFE = 0;
+		lz_start (&ct->zip[1]);
+		sched_start (&ct->sched[1]);
+		rb_reset (rb, NFE);
+		highest = PREV_SEQ_NUM (NFE);
+
+		/* A connection that could not even be started ends the
+		   stream at once (see above). */
+		if (CHANNEL_LOAD (ct->connect_failed))
+		    continue;
 	    }
 	}
 
-	/* Is the packet the one we are expecting? */
-	if (((seq_num = PKT_SEQ_NUM (packet)) >= NFE) && (seq_num < NFE+SWP_BUFFER_SIZE)) {
-	  if (NFE == seq_num)
-	    {
-	      NFE = NEXT_SEQ_NUM (seq_num);
-	      
-	      // Move buffers down
-	      
-	      for (i=0; i < SWP_BUFFER_SIZE-1; i+=1){
-		buffer[MAX_PKT_LEN*i] = buffer[MAX_PKT_LEN*(i+1)];
-		bufferValid[i] = bufferValid[i+1];
-	      }
-	      bufferValid[SWP_BUFFER_SIZE-1] = 0;
-
-	      /* If so, write packet to TCP socket. */
-	      if (my_write (ct->fd, packet + 4, PKT_LENGTH(packet)) !=  PKT_LENGTH(packet)) {
-		/* Write failed!  Close the connection. */
-		printlog ("%#08X WRITE FAILED IN TCP_RECEIVER", (unsigned int)ct);
-		deactivate_channel (ct, CLOSE_CHANNEL_RECEIVER);
-		is_active = 0;
-		continue;
-	      }
-	    }
-	  else
-	    {
-	      printlog("%#08X PUTTING A PACKET INTO RECV BUFFER SLOT %d", (unsigned int)ct, NFE-seq_num);
-	      buffer[(NFE-seq_num)*MAX_PKT_LEN] = packet;
-	      bufferValid[(NFE-seq_num)] = 1;
+	/* Hold any frame within the window that has not been seen, then
+	   gather the run of frames now in order, expanding compressed
+	   data, and write the run to the TCP socket, one batch per call.
+	   Window probes carry no data; they only ask for an ACK. */
+	seq_num = PKT_FULL_SEQ (packet, NFE);
+	seq32 = (PKT_FLAGS (packet) & PKT_FLAG_SEQ32);
+	failed = 0;
+	if ((PKT_FLAGS (packet) & PKT_FLAG_PROBE) == 0 &&
+	    rb_insert (rb, seq_num, packet, len) == RB_OK) {
+	    if (seq_num != NFE)
+		printlog ("%#08X HOLDING FRAME %03X FOR %03X IN RECV BUFFER",
+			  (unsigned int)ct, seq_num, NFE);
+
+	    /* Count the frames skipped over, and those that fill a gap
+	       left earlier, for udp_monitor's loss estimate.  Tail-loss
+	       probes fill gaps left by losses, not by delays. */
+	    if (SEQ_BEFORE (highest, seq_num)) {
+		(void)__atomic_fetch_add (&ct->rx_missing,
+					  SEQ_DIFF (highest, seq_num) - 1,
+					  __ATOMIC_RELAXED);
+		highest = seq_num;
+	    } else if ((PKT_FLAGS (packet) & PKT_FLAG_RETRANSMIT) == 0)
+		(void)__atomic_fetch_add (&ct->rx_late, 1, __ATOMIC_RELAXED);
+
+	    n_ready = rb_ready (rb);
+	    while (!failed && n_ready > 0) {
+		n_iov = 1;
+		plain_used = 0;
+		for (; n_ready > 0 && n_iov <= DELIVER_BATCH; n_ready--) {
+		    (void)rb_take (rb, &frame, &len);
+		    if (PKT_IS_LAST (frame))
+			fin = 1;
+		    if ((len = lz_open_frame (&ct->zip[1], frame,
+					      plain + plain_used, &data)) < 0) {
+			failed = 1;
+			break;
+		    }
+		    if (data != PKT_DATA (frame))
+			plain_used += len;
+		    if (len > 0) {
+			iov[n_iov].iov_base = data;
+			iov[n_iov++].iov_len = len;
+		    }
+		}
+		if (!failed && tcp_deliver (ct, iov, n_iov) == -1)
+		    failed = 1;
 	    }
-	} else {
-	    /* Out of order packet!  Construct an ACK for the previous
-	       sequence number. */
-	  PKT_MAKE_HEADER (packet, 1, 0, ct->number, PREV_SEQ_NUM (seq_num), epoch, len);
-
+	    NFE = rb_base (rb);
+	}
+	if (failed) {
+	    /* Write failed!  Close the connection. */
+	    printlog ("%#08X WRITE FAILED IN TCP_RECEIVER", (unsigned int)ct);
+	    deactivate_channel (ct, CLOSE_CHANNEL_RECEIVER);
+	    is_active = 0;
+	    continue;
 	}
 
-	/* Send an ACK.  With our structures, we can simply return
-	   the first three bytes of the packet.  We ignore errors. */
-	PKT_MAKE_HEADER (packet, 1, 0, ct->number, seq_num, epoch, len);
-
-	(void)send (uct->fd, packet, 256, 0);
-	printlog ("%#08X TCP_RECEIVER SENT ACK %02X:%02X%s(256 bytes)",
-	      (unsigned int)ct, PKT_EPOCH (packet), PKT_SEQ_NUM (packet), 
-	      (PKT_IS_LAST (packet) ? " LAST " : " "));
+	/* Send an ACK for every frame received, including duplicates and
+	   probes, so that lost ACKs are soon repaired. */
+	send_ack (ct, NFE, fin, epoch, seq32);
+	if (fin) {
+	    last_acked = 1;
+	    last_epoch = epoch;
+	    last_NFE = NFE;
+	    last_flags = seq32;
+	}
 
-	/* Was the packet received the last? */
-	if (PKT_IS_LAST (packet) && NFE == seq_num) {
+	/* Was the last packet received and written? */
+	if (fin && ct->out_len == 0) {
 	    printlog ("%#08X RECEIVED LAST PACKET IN TCP_RECEIVER",
 		  (unsigned int)ct);
 	    deactivate_channel (ct, CLOSE_CHANNEL_RECEIVER);
@@ -844,37 +1654,661 @@ tcp_receiver (void* v_ct)
 
 
 /*
-   Main body of the UDP receiver threads.
+   Main body of the UDP receiver threads.  Datagrams are taken in
+   batches: the thread waits (or spins) for the first, then takes those
+   already waiting, up to RECV_BATCH.  Each frame is checked (see
+   udp_demux and pkt_check) and queued for its channel thread, and each
+   thread given frames is woken once per batch.
 */
 static void* 
 udp_receiver (void* v_uct)
 {
     udp_channel_t* uct = v_uct;
-    unsigned char packet[MAX_PKT_LEN];
-    int len;
+    fq_t* dst;
+    unsigned char packet[MAX_WIRE_LEN];
+    unsigned char* frame;
+    unsigned char wake[2 * MAX_CHANNELS];
+    int len, n, i;
     fq_err_t rv;
-    int trash;
-    socklen_t tlen;
+    unsigned long queued, drops;
 
     int chanNum;
+    spin_t spin = {0, 0, 0};
 
     printlog ("%#08X INIT UDP_RECEIVER", (unsigned int)uct);
 
+    memset (wake, 0, sizeof (wake));
     while (1) {
-	/* Ignore errors. */
-	tlen = sizeof (trash);
-	if ((len = mp3_recvfrom (uct->fd, packet, MAX_PKT_LEN, 0,(struct sockaddr*)&trash, &tlen)) >= 0) 
-	  {
-	    chanNum = PKT_CHAN_NUM(packet);
-	    //printlog("XXXX Received packet of length %02X, chanNum %02X, CRC %02X (actual: %02X)", len, chanNum, PKT_CRC(packet), calculate_crc8(packet,255));
-	      if ((rv = fq_enqueue (udpchans[chanNum]->recv, packet, len, &udpchans[chanNum]->recv_cond,
-				    &udpchans[chanNum]->recv_lock)) != FQ_OK &&
-		  rv != FQ_ITEM_DISCARDED) {
-		fq_error ("fq_enqueue failed in udp_receiver", rv);
-		exit (EXIT_PANIC);
+	/* Check for kernel drops and retune the socket buffers once per
+	   interval.  The socket times out to make sure that we do. */
+	if (now_ns () - udp_stats.stamp_ns >= UDP_MONITOR_MS * 1000000UL)
+	    udp_monitor (uct->fd);
+
+	/* Ignore errors.  In busy-poll mode, do not wait for a datagram
+	   until we have spun for long enough (see spin_on).  Never wait
+	   once a batch has begun. */
+	for (n = 0; n < RECV_BATCH; n++) {
+	    if ((len = udp_recv (uct->fd, packet,
+				 !(n > 0 || spin_on (&spin)))) < 0)
+		break;
+	    if (n == 0)
+		spin_end (&spin);
+
+	    /* Now and then, note how much data waits in the socket, the
+	       size of the bursts that its buffer must absorb. */
+	    if (++udp_stats.rx % UDP_SAMPLE_EVERY == 0 && uct->fd != -1 &&
+		udp_meminfo (uct->fd, &queued, &drops) == 0 &&
+		queued > udp_stats.peak_queue)
+		udp_stats.peak_queue = queued;
+
+	    /* Data frames go to the channel's receiver, ACKs to its
+	       sender (see init_channels).  The frame is checked as it is
+	       copied into the queue, and only enqueued if intact; the
+	       checksum goes no further.  Corrupted frames are dropped,
+	       and the sender will send them again.  The reader is woken
+	       at the end of the batch. */
+	    if ((chanNum = udp_demux (packet, len)) == -1)
+		continue;
+	    dst = demux.recv[chanNum];
+	    if ((rv = fq_reserve (dst, &frame)) == FQ_OK) {
+		if ((len = pkt_check (frame, packet, len)) < 0) {
+		    udp_stats.corrupt++;
+		    continue;
+		}
+		rv = fq_commit (dst, len, NULL, NULL);
+		wake[chanNum] = 1;
+	    }
+	    if (rv != FQ_OK) {
+		if (rv != FQ_ITEM_DISCARDED) {
+		    fq_error ("fq_commit failed in udp_receiver", rv);
+		    exit (EXIT_PANIC);
+		}
+		udp_stats.discards++;
+	    }
+	}
+
+	/* Signal under the lock, after the frames are queued, so that a
+	   reader about to wait cannot miss the wakeup. */
+	for (i = 0; i < 2 * MAX_CHANNELS; i++) {
+	    if (!wake[i])
+		continue;
+	    wake[i] = 0;
+	    get_lock (&udpchans[i]->recv_lock);
+	    condition_signal (&udpchans[i]->recv_cond);
+	    release_lock (&udpchans[i]->recv_lock);
+	}
+    }
+}
+
+
+/*
+   Main body of the UDP sender thread, the only thread that sends on the
+   shared UDP socket.  Frames are queued on per-channel transmit lanes by
+   xmit_frame.  ACKs have strict priority: all waiting ACKs are sent
+   before each data frame.  Data lanes share the socket by deficit round
+   robin, as in fq_codel: the lane being served sends while its deficit
+   is positive and may overdraw it, a lane that has used up its deficit
+   gets another quantum for each unit of its class weight and waits for
+   its next turn, and an empty lane gives up what remains and starts
+   afresh.  A lane whose class has exhausted its token bucket loses its
+   turn but keeps its deficit.
+*/
+static void* 
+udp_sender (void* v_uct)
+{
+    udp_channel_t* uct = v_uct;
+    xmit_item_t* item;
+    channel_t* ct;
+    class_t* cls;
+    int i, len, lane, next = 0, idle = 0;
+    unsigned long long wake_ns = 0, pace_ns = 0, now;
+    ur_err_t rv;
+    spin_t spin = {0, 0, 0};
+
+    printlog ("%#08X INIT UDP_SENDER", (unsigned int)uct);
+
+    /* Frames are sent straight from the transmit lanes, except that
+       with io_uring they are copied into slots of the ring's registered
+       buffer and sent from there.  A shared-memory link
+       copies frames into its ring without a system call, so has no use
+       for io_uring. */
+    if (use_uring && shm_link == NULL) {
+	if ((rv = ur_create (&tx_ring, TX_RING_SLOTS,
+			     TX_RING_SLOTS * sizeof (xmit_item_t))) != UR_OK) {
+	    printlog ("SEND WITHOUT IO_URING (%s)", strerror (errno));
+	    tx_ring = NULL;
+	} else {
+	    tx_slots = (xmit_item_t*)ur_buffer (tx_ring);
+	    for (i = 0; i < TX_RING_SLOTS; i++)
+		tx_free[n_tx_free++] = i;
+	}
+    }
+
+    while (1) {
+	/* Send all waiting ACKs. */
+	for (i = 0; i < MAX_CHANNELS; i++)
+	    while (sched_dequeue (&chan_tab[i], 1, &item, &len))
+		sched_send (uct->fd, &chan_tab[i], 1, item, len);
+
+	/* Serve the current data lane. */
+	ct = &chan_tab[next];
+	cls = &classes[ct->traffic_class];
+	if (ct->deficit <= 0) {
+	    ct->deficit += cls->weight * SCHED_QUANTUM;
+	    next = (next + 1) % MAX_CHANNELS;
+	    continue;
+	}
+	/* A turn is lost to the rate limit only if a frame is waiting. */
+	if (!sched_dequeue (ct, 0, &item, &len))
+	    ct->deficit = cls->weight * SCHED_QUANTUM;
+	else if (!class_ready (cls, &wake_ns))
+	    (void)__atomic_fetch_add (&ct->sched[0].throttled, 1,
+				      __ATOMIC_RELAXED);
+	else {
+	    sched_send (uct->fd, ct, 0, item, len);
+	    ct->deficit -= len;
+	    idle = 0;
+	    continue;
+	}
+	next = (next + 1) % MAX_CHANNELS;
+
+	/* Keep going until every data lane in turn has been found empty
+	   or throttled. */
+	if (++idle < MAX_CHANNELS)
+	    continue;
+
+	/* Nothing can be sent.  Check the lanes again under the lock
+	   before sleeping; an enqueue onto an empty lane signals under
+	   the same lock, so no wakeup can be lost.  ACK lanes come first,
+	   then data lanes in round-robin order.  If any class is
+	   throttled, sleep only until its bucket refills, as told by the
+	   pacing timer (<pace_ns> is the time for which it is set, or 0
+	   if it has expired).  Frames queued on the ring go out first. */
+	tx_flush (0);
+	get_lock (&sched_lock);
+	while (1) {
+	    for (i = 0, lane = 1; i < MAX_CHANNELS; i++)
+		if (sched_dequeue (&chan_tab[i], lane, &item, &len))
+		    break;
+	    if (i < MAX_CHANNELS)
+		break;
+	    wake_ns = 0;
+	    for (i = 0, lane = 0; i < MAX_CHANNELS; i++) {
+		ct = &chan_tab[(next + i) % MAX_CHANNELS];
+		if (class_ready (&classes[ct->traffic_class], &wake_ns) &&
+		    sched_dequeue (ct, lane, &item, &len))
+		    break;
+	    }
+	    if (i < MAX_CHANNELS) {
+		next = (next + i) % MAX_CHANNELS;
+		break;
+	    }
+	    if (pace_due) {
+		pace_due = 0;
+		pace_ns = 0;
+		lane = -1;
+		break;
+	    }
+	    if (wake_ns != 0 && (pace_ns == 0 || wake_ns < pace_ns)) {
+		lane = -1;
+		break;
+	    }
+	    spin_wait (&spin, &sched_cond, &sched_lock);
+	}
+	spin_end (&spin);
+	release_lock (&sched_lock);
+	idle = 0;
+
+	/* Set the pacing timer if it is not already set soon enough (not
+	   under the lock, which timer_expire takes), then look again.
+	   After a throttled class refills, just resume. */
+	if (lane == -1) {
+	    if (wake_ns != 0 && (pace_ns == 0 || wake_ns < pace_ns) &&
+		(now = now_ns ()) < wake_ns) {
+		pace_ns = wake_ns;
+		set_timer (&pace_timer, wake_ns - now);
 	    }
-	  }
+	    continue;
+	}
+
+	/* Send the frame found (without the lock, as sched_send may need
+	   to wake tcp_sender) and resume normal service. */
+	ct = (lane == 0 ? &chan_tab[next] : &chan_tab[i]);
+	sched_send (uct->fd, ct, lane, item, len);
+	if (lane == 0)
+	    ct->deficit -= len;
+    }
+
+    return NULL;
+}
+
+
+/*
+   Main body of the timer thread, which runs the timer wheel shared by
+   all channels (see timer_expire).
+*/
+static void* 
+timer_driver (void* ignore)
+{
+    tw_err_t rv;
+
+    printlog ("INIT TIMER_DRIVER");
+
+    while (1) {
+	if ((rv = tw_run (timers)) != TW_OK) {
+	    tw_error ("tw_run failed in timer_driver", rv);
+	    exit (EXIT_PANIC);
+	}
+    }
+}
+
+
+/*
+   Take the connections accepted through the io_uring <*ring> on the
+   listening sockets <lfds>, and admit each.  A multishot accept that has
+   ended is posted again.  If the kernel cannot accept through the ring,
+   destroy it and set <*ring> to NULL, so that the caller falls back to
+   the sockets.
+*/
+static void
+accept_uring (ur_t** ring, const int* lfds)
+{
+    unsigned long tag;
+    int k, res, more;
+    socklen_t addr_size;
+    struct sockaddr_in cli_addr;
+    ur_err_t rv;
+
+    while (ur_complete (*ring, &tag, &res, &more)) {
+	k = tag;
+
+	/* Kernels without multishot accept reject the request outright. */
+	if (res == -EINVAL) {
+	    printlog ("ACCEPT WITHOUT IO_URING (NO MULTISHOT)");
+	    (void)ur_destroy (*ring);
+	    *ring = NULL;
+	    return;
+	}
+	if (!more && (rv = ur_accept (*ring, lfds[k],
+				      SOCK_NONBLOCK | SOCK_CLOEXEC,
+				      k)) != UR_OK) {
+	    ur_error ("ur_accept failed", rv);
+	    exit (EXIT_PANIC);
+	}
+	/* A client may give up before we get to it, and a shortage of
+	   descriptors or buffers passes.  The accept, still posted or
+	   posted again above, goes on to the next connection. */
+	if (res == -ECONNABORTED || res == -EPROTO || res == -EMFILE ||
+	    res == -ENFILE || res == -ENOBUFS)
+	    continue;
+	if (res < 0) {
+	    errno = -res;
+	    perror ("accept");
+	    exit (EXIT_PANIC);
+	}
+
+	/* The accept does not keep the address, so ask for it.  The client
+	   may already have gone. */
+	addr_size = sizeof (struct sockaddr_in);
+	if (getpeername (res, (struct sockaddr*)&cli_addr, &addr_size) == -1) {
+	    (void)close (res);
+	    continue;
+	}
+	admit (res, k, &cli_addr);
+    }
+}
+
+
+/*
+   Admit the connection <cli_fd>, accepted on listening port <k> from
+   <cli_addr>: give it an inactive channel if one is free and no other
+   connection is waiting, or else queue it to wait for one.  If the queue
+   is full, shed the connection.
+*/
+static void
+admit (int cli_fd, int k, const struct sockaddr_in* cli_addr)
+{
+    admit_t* a;
+    channel_t* ct;
+    unsigned long long now;
+
+    set_busy_poll (cli_fd);
+
+    get_lock (&admit_lock);
+    now = now_ns ();
+    (void)admit_drain (now);
+    if (admit_count == 0 && (ct = chan_alloc ()) != NULL) {
+	admit_stats.immediate++;
+	admit_stats.hist[0]++;
+	admit_stats.changed = 1;
+	assign_channel (ct, cli_fd, lports[k],
+			class_of (lports[k], cli_addr->sin_addr));
+    } else if (admit_count < admit_size) {
+	a = &admit_queue[(admit_head + admit_count++) % admit_size];
+	a->fd = cli_fd;
+	a->port = lports[k];
+	a->traffic_class = class_of (lports[k], cli_addr->sin_addr);
+	a->queued_ns = now;
+    } else {
+	admit_stats.shed_full++;
+	admit_stats.changed = 1;
+	admit_shed (cli_fd);
+    }
+    release_lock (&admit_lock);
+}
+
+
+/*
+   Give free channels to waiting connections, oldest first, and shed
+   those that have waited longer than the -d limit.  Report admission
+   statistics if they are due.  <now> is the current time.  Return how
+   long the acceptor may wait before it must call again (in ms, or
+   INFTIM), if no channel is freed meanwhile.  Called with admit_lock
+   held.
+*/
+static int
+admit_drain (unsigned long long now)
+{
+    admit_t* a;
+    channel_t* ct;
+    unsigned long long wait_ns, next_ns = 0;
+    int b;
+
+    for (; admit_count > 0; admit_head = (admit_head + 1) % admit_size,
+	 admit_count--) {
+	a = &admit_queue[admit_head];
+	wait_ns = now - a->queued_ns;
+	if (wait_ns >= admit_wait_ns) {
+	    admit_stats.shed_late++;
+	    admit_shed (a->fd);
+	} else if ((ct = chan_alloc ()) != NULL) {
+	    admit_stats.waited++;
+	    for (b = 0; b < ADMIT_BUCKETS - 1 &&
+		 wait_ns >= (1000000ULL << (2 * b)); b++);
+	    admit_stats.hist[b]++;
+	    if (wait_ns > admit_stats.max_ns)
+		admit_stats.max_ns = wait_ns;
+	    assign_channel (ct, a->fd, a->port, a->traffic_class);
+	} else
+	    break;
+	admit_stats.changed = 1;
+    }
+
+    if (admit_stats.changed &&
+	now - admit_stats.stamp_ns >= ADMIT_REPORT_MS * 1000000UL)
+	admit_report (now);
+
+    /* Wake for the oldest connection's deadline, and for the next
+       report if there is anything to report. */
+    if (admit_count > 0)
+	next_ns = admit_queue[admit_head].queued_ns + admit_wait_ns - now;
+    if (admit_stats.changed &&
+	(next_ns == 0 ||
+	 admit_stats.stamp_ns + ADMIT_REPORT_MS * 1000000UL - now < next_ns))
+	next_ns = admit_stats.stamp_ns + ADMIT_REPORT_MS * 1000000UL - now;
+    if (next_ns == 0)
+	return INFTIM;
+    return (next_ns + 999999) / 1000000;
+}
+
+
+/*
+   Log the admission statistics gathered since the last report, at time
+   <now>, and start counting again.  Called with admit_lock held.
+*/
+static void
+admit_report (unsigned long long now)
+{
+    unsigned long* h = admit_stats.hist;
+
+    printlog ("ADMIT %lu AT ONCE, %lu AFTER WAIT (MAX %llu MS), "
+	      "SHED %lu FULL, %lu LATE", admit_stats.immediate,
+	      admit_stats.waited, admit_stats.max_ns / 1000000,
+	      admit_stats.shed_full, admit_stats.shed_late);
+    printlog ("ADMIT WAIT MS <1:%lu <4:%lu <16:%lu <64:%lu <256:%lu "
+	      "<1K:%lu <4K:%lu MORE:%lu",
+	      h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+    memset (&admit_stats, 0, sizeof (admit_stats));
+    admit_stats.stamp_ns = now;
+}
+
+
+/*
+   Shed the connection <cli_fd>: close it at once with a reset, rather
+   than leaving the client to wait for a channel that will not come.
+*/
+static void
+admit_shed (int cli_fd)
+{
+    struct linger lg = {1, 0};
+
+    (void)setsockopt (cli_fd, SOL_SOCKET, SO_LINGER, &lg, sizeof (lg));
+    (void)close (cli_fd);
+}
+
+
+/*
+   Hand the connection <cli_fd>, accepted on TCP port <port> and of
+   traffic class <traffic_class>, to the inactive channel <ct>, and wake
+   the channel's threads.
+*/
+static void
+assign_channel (channel_t* ct, int cli_fd, unsigned short port,
+		int traffic_class)
+{
+    /* Its threads have all let go of it, so nothing else writes its
+       fields until the state is published. */
+    ct->fd = cli_fd;
+    ct->traffic_class = traffic_class;
+    ct->need_help = 0;
+    ct->has_data = 0;
+    ct->need_write = 0;
+    ct->can_write = 0;
+    ct->active = 1;
+    CHANNEL_STORE (ct->channel_state, CLOSE_CHANNEL_NONE);
+    printlog ("%#08X ACCEPTED ON PORT %d IN CLASS %d",
+	      (unsigned int)ct, port, ct->traffic_class);
+
+    /* Wake up sleeping threads. */
+    wake_threads (ct, CLOSE_CHANNEL_NONE);
+}
+
+
+/*
+   Take an inactive channel from the free list at the relay target, and
+   return it, or NULL if there is none.  Acceptor threads may take
+   channels at the same time as channel threads return them.  Taking one
+   bumps the count in the head, so a thread that read the top and its
+   successor before another thread took that channel and returned it
+   cannot then take it, with a successor that is no longer right.
+*/
+static channel_t*
+chan_alloc (void)
+{
+    unsigned long long head, next;
+    channel_t* ct;
+
+    head = __atomic_load_n (&chan_free_list, __ATOMIC_ACQUIRE);
+    do {
+	if ((head & 0xFFFFFFFFULL) == 0)
+	    return NULL;
+	ct = &chan_tab[(head & 0xFFFFFFFFULL) - 1];
+	next = (((head >> 32) + 1) << 32 |
+		(unsigned int)__atomic_load_n (&ct->next_free,
+					       __ATOMIC_RELAXED));
+    } while (!__atomic_compare_exchange_n (&chan_free_list, &head, next, 1,
+					   __ATOMIC_ACQUIRE,
+					   __ATOMIC_ACQUIRE));
+    return ct;
+}
+
+
+/*
+   Return the inactive channel <ct> to the free list at the relay target.
+*/
+static void
+chan_free (channel_t* ct)
+{
+    unsigned long long head, next;
+
+    head = __atomic_load_n (&chan_free_list, __ATOMIC_RELAXED);
+    do {
+	__atomic_store_n (&ct->next_free, (int)(head & 0xFFFFFFFFULL),
+			  __ATOMIC_RELAXED);
+	next = (head & ~0xFFFFFFFFULL) | (ct->number + 1);
+    } while (!__atomic_compare_exchange_n (&chan_free_list, &head, next, 1,
+					   __ATOMIC_RELEASE,
+					   __ATOMIC_RELAXED));
+}
+
+
+/*
+   Return the traffic class of a connection accepted on TCP port <port>
+   from address <addr>: the first configured class that matches, or the
+   default class 0.
+*/
+static int
+class_of (unsigned short port, struct in_addr addr)
+{
+    int i;
+
+    for (i = 1; i < n_classes; i++)
+	if ((classes[i].port == 0 || classes[i].port == port) &&
+	    (addr.s_addr & classes[i].mask) == classes[i].addr)
+	    return i;
+    return 0;
+}
+
+
+/*
+   Return the NUMA node of CPU <cpu>, as listed under /sys, or 0 if the
+   system does not say (as on machines with a single node).
+*/
+static int
+cpu_node (int cpu)
+{
+    char path[64];
+    DIR* dir;
+    struct dirent* ent;
+    int node = 0;
+
+    sprintf (path, "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((dir = opendir (path)) == NULL)
+	return 0;
+    while ((ent = readdir (dir)) != NULL)
+	if (strncmp (ent->d_name, "node", 4) == 0) {
+	    node = atoi (ent->d_name + 4);
+	    break;
+	}
+    (void)closedir (dir);
+    return node;
+}
+
+
+/*
+   Find the CPUs given by the -a option for thread <index> of role <role>
+   and put them in <set>.  Return 0, or -1 if the role is not pinned.
+   Threads of other roles may use any CPU given for their role.  Channel
+   threads share the state and queues of their channel, and so are kept
+   together: tcp_sender and tcp_helper of channel <index> / 2 take the
+   next chan CPU in turn, and tcp_receiver (odd <index>) the chan CPU
+   after that on the same NUMA node, or the same CPU if there is no
+   other.
+*/
+static int
+cpus_for (cpu_role_t role, int index, cpu_set_t* set)
+{
+    cpu_set_t* cpus = &role_cpus[role];
+    int cpu, n, node;
+
+    if ((n = CPU_COUNT (cpus)) == 0)
+	return -1;
+    if (role != CPU_CHANNEL) {
+	*set = *cpus;
+	return 0;
+    }
+
+    n = (index / 2) % n;
+    for (cpu = 0; !CPU_ISSET (cpu, cpus) || n > 0; cpu++)
+	if (CPU_ISSET (cpu, cpus))
+	    n--;
+    if (index % 2 == 1) {
+	node = cpu_node (cpu);
+	do
+	    cpu = (cpu + 1) % CPU_SETSIZE;
+	while (!CPU_ISSET (cpu, cpus) || cpu_node (cpu) != node);
     }
+    CPU_ZERO (set);
+    CPU_SET (cpu, set);
+    return 0;
+}
+
+
+/*
+   Create a thread running <body> with argument <arg>, storing its id in
+   <*id>.  The thread is thread <index> of role <role>, and if the -a
+   option pins the role, it starts on its CPUs (see cpus_for), so that
+   the memory it allocates is placed on their NUMA node from the first.
+   Otherwise, or if those CPUs cannot be used, it is created with
+   attributes <attr>.
+*/
+static void
+create_thread (pthread_attr_t* attr, pthread_t* id, void* (*body) (void*),
+	       void* arg, cpu_role_t role, int index)
+{
+    pthread_attr_t pinned;
+    cpu_set_t set;
+    int rv;
+
+    if (cpus_for (role, index, &set) == -1)
+	rv = pthread_create (id, attr, body, arg);
+    else if ((rv = pthread_attr_init (&pinned)) == 0) {
+	if ((rv = pthread_attr_setdetachstate (&pinned,
+					       PTHREAD_CREATE_DETACHED)) == 0 &&
+	    (rv = pthread_attr_setaffinity_np (&pinned, sizeof (set),
+					       &set)) == 0)
+	    rv = pthread_create (id, &pinned, body, arg);
+	(void)pthread_attr_destroy (&pinned);
+	if (rv != 0) {
+	    printlog ("CANNOT PIN THREAD TO CPUS (%s)", strerror (rv));
+	    rv = pthread_create (id, attr, body, arg);
+	}
+    }
+    if (rv != 0) {
+	fputs ("pthread create failed\n", stderr);
+	exit (EXIT_PANIC);
+    }
+}
+
+
+/*
+   Refill the token bucket of class <cls> and return 1 if the class may
+   send.  A class may send while its bucket holds any tokens; sending
+   can overdraw the bucket by up to a frame.  If the class must wait,
+   return 0, and lower <*wake_ns> (a CLOCK_MONOTONIC time, or 0 for
+   none) to the time at which the bucket will hold tokens again.
+   Classes without a rate limit may always send.
+*/
+static int
+class_ready (class_t* cls, unsigned long long* wake_ns)
+{
+    unsigned long long now, wake;
+
+    if (cls->rate == 0)
+	return 1;
+
+    now = now_ns ();
+    cls->tokens += (now - cls->stamp_ns) * (cls->rate / 1e9);
+    if (cls->tokens > cls->burst)
+	cls->tokens = cls->burst;
+    cls->stamp_ns = now;
+    if (cls->tokens > 0)
+	return 1;
+
+    wake = now + (unsigned long long)(-cls->tokens * (1e9 / cls->rate)) + 1;
+    if (*wake_ns == 0 || wake < *wake_ns)
+	*wake_ns = wake;
+    return 0;
 }
 
 
@@ -886,8 +2320,9 @@ udp_receiver (void* v_uct)
 static int
 create_udp_socket (int port, struct sockaddr_in* peer_addr)
 {
-    int fd, bsize;
+    int fd;
     struct sockaddr_in bind_addr;
+    struct timeval tv;
 
     /* Create socket. */
     if ((fd = socket (AF_INET, SOCK_DGRAM, 0)) == -1) {
@@ -895,15 +2330,22 @@ create_udp_socket (int port, struct sockaddr_in* peer_addr)
 	exit (EXIT_PANIC);
     }
 
-    /* Increase default send and receive buffer sizes. */
-    bsize = 40000;
-    if (setsockopt (fd, SOL_SOCKET, SO_SNDBUF, (char*)&bsize, 
-                    sizeof (bsize)) == -1 ||
-        setsockopt (fd, SOL_SOCKET, SO_RCVBUF, (char*)&bsize,
-                    sizeof (bsize)) == -1) {
-        perror ("setsockopt");
-        return EXIT_PANIC;
+    /* Increase default send and receive buffer sizes.  All channels
+       share the socket, and udp_sender can empty every transmit lane
+       in one burst, so the buffers start out holding a full lane per
+       channel; udp_monitor grows them with the traffic. */
+    udp_set_buffers (fd, UDP_BUFFER_SIZE, UDP_BUFFER_SIZE);
+    set_busy_poll (fd);
+
+    /* Wake udp_receiver at least once per check interval, even when no
+       datagrams arrive. */
+    tv.tv_sec = UDP_MONITOR_MS / 1000;
+    tv.tv_usec = (UDP_MONITOR_MS % 1000) * 1000;
+    if (setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) == -1) {
+	perror ("setsockopt");
+	exit (EXIT_PANIC);
     }
+    udp_stats.stamp_ns = now_ns ();
 
     /* Bind to the appropriate port number under the server's default 
        IP address. */
@@ -934,42 +2376,69 @@ create_udp_socket (int port, struct sockaddr_in* peer_addr)
    TCP connection until reactivated.  The last channel thread to call 
    this function also closes the TCP socket and increments the epoch
    number for the channel, ensuring that further packets from the other
-   side of the relay are ignored (we ignore wraparound; it can't be
-   solved per se, and 256 epochs should be adequate for our purposes).
-   If this thread is the first to deactivate, it also wakes the other
-   threads from sleep.
+   side of the relay are ignored.  The epoch is kept in 64 bits, but the
+   header carries only its low 8 bits, which are read as the epoch
+   nearest the channel's own (see EPOCH_EXTEND).  A frame more than 128
+   epochs old could thus pass for a new one, so with -S each frame also
+   carries the full epoch as a session ID.  If this thread is the first
+   to deactivate, it also wakes the other threads from sleep.
 */
 static void
 deactivate_channel (channel_t* ct, channel_state_t flag)
 {
+    channel_state_t old;
     int was_first;
 
-    /* Changes to channel state must be mutually exclusive. */
-    get_lock (&ct->channel_lock);
-    was_first = (ct->channel_state == CLOSE_CHANNEL_NONE);
-    ct->channel_state |= flag;
+    /* Stop the timers of the direction shutting down, and report its
+       compression and transmit statistics.  Once cancelled, timers
+       stay quiet until the thread is activated again. */
+    if (flag == CLOSE_CHANNEL_SENDER) {
+	cancel_timer (ct, TIMER_PROBE);
+	cancel_timer (ct, TIMER_IDLE);
+	cancel_timer (ct, TIMER_TAIL_PROBE);
+	if (ct->tune.samples != 0)
+	    __atomic_store_n (&path_rtt_ns, ct->tune.srtt_ns,
+			      __ATOMIC_RELAXED);
+	lz_report (ct, 0);
+	sched_report (ct, 0);
+	sndbuf_report (ct);
+	tune_report (ct);
+    } else if (flag == CLOSE_CHANNEL_RECEIVER) {
+	lz_report (ct, 1);
+	sched_report (ct, 1);
+    }
+
+    /* Note that this thread has let go, learning which threads had
+       already done so.  The release makes everything this thread did
+       with the connection visible to the last one, which closes it. */
+    old = __atomic_fetch_or (&ct->channel_state, flag, __ATOMIC_ACQ_REL);
+    was_first = (old == CLOSE_CHANNEL_NONE);
 
     /* Have all threads deactivated? */
-    if (ct->channel_state == CLOSE_CHANNEL_ALL) {
+    if ((old | flag) == CLOSE_CHANNEL_ALL) {
 
-	/* If so, close the TCP connection and bump up the epoch number. */
+	/* If so, close the TCP connection and bump up the epoch number,
+	   and only then mark the channel free for reuse. */
 	close (ct->fd);
-	ct->epoch++;
+	set_epoch (ct, ct->epoch + 1);
+	CHANNEL_STORE (ct->active, 0);
 
-	/* If acting as the relay target, let the main thread know that
-	   another channel is inactive. */
+	/* If acting as the relay target, return the channel to the free
+	   list and let the acceptors know that another is inactive.  If
+	   forwarding, tcp_receiver may be waiting to adopt a new epoch. */
 	if (mode == MODE_TCP_TARGET) {
-	    ct->active = 0;
-	    if (sem_post (&channel_semaphore) == -1) {
-		perror ("sem_post");
+	    chan_free (ct);
+	    if (eventfd_write (admit_fd, 1) == -1) {
+		perror ("eventfd_write");
 		exit (EXIT_PANIC);
 	    }
+	} else if (flag != CLOSE_CHANNEL_RECEIVER) {
+	    get_lock (&ct->udp[1].recv_lock);
+	    condition_signal (&ct->udp[1].recv_cond);
+	    release_lock (&ct->udp[1].recv_lock);
 	}
     }
 
-    /* All done changing channel state. */
-    release_lock (&ct->channel_lock);
-
     /* Wake up other (possibly sleeping) threads. */
     if (was_first)
 	wake_threads (ct, flag);
@@ -987,32 +2456,120 @@ static void
 init_channels (pthread_attr_t* attr, int base_port,
 	       struct sockaddr_in* peer_addr)
 {
-    int i;
+    int i, k, pinned;
     pthread_t trash;
+    fq_err_t rv;
+    tw_err_t trv;
+    cpu_set_t home, cpus, other;
+    unsigned long long first_epoch = 0;
+    struct timespec ts;
+    char link_name[32];
+    shm_err_t srv;
+
+    /* The target end of the relay keeps its inactive channels on a free
+       list, and connections accepted while none is free wait in the
+       admission queue.  The acceptor threads, which accept new TCP
+       connections and assign them to channels, are told through an
+       eventfd when a channel is freed. */
+    if (mode == MODE_TCP_TARGET) {
+	if ((admit_queue = malloc ((admit_size + 1) * sizeof (admit_t))) ==
+	    NULL) {
+	    fputs ("out of memory for admission queue\n", stderr);
+	    exit (EXIT_PANIC);
+	}
+	if (pthread_mutex_init (&admit_lock, NULL) != 0) {
+	    fputs ("pthread mutex init failed\n", stderr);
+	    exit (EXIT_PANIC);
+	}
+	if ((admit_fd = eventfd (0, EFD_NONBLOCK)) == -1) {
+	    perror ("eventfd");
+	    exit (EXIT_PANIC);
+	}
+	admit_stats.stamp_ns = now_ns ();
+
+	/* With session IDs, start the epochs at the time of day in
+	   microseconds, so that a forwarder that outlives a restart of this
+	   end sees every new connection as later than the old ones. */
+	if (use_sessions) {
+	    if (clock_gettime (CLOCK_REALTIME, &ts) == -1) {
+		perror ("clock_gettime");
+		exit (EXIT_PANIC);
+	    }
+	    first_epoch = ((unsigned long long)ts.tv_sec * 1000000 +
+			   ts.tv_nsec / 1000);
+	}
+    }
+
+    /* Transmit lanes of all channels share one udp_sender thread. */
+    if (pthread_mutex_init (&sched_lock, NULL) != 0 ||
+	pthread_cond_init (&sched_cond, NULL) != 0) {
+	fputs ("pthread mutex or cond init failed\n", stderr);
+	exit (EXIT_PANIC);
+    }
 
-    /* The target end of the relay uses a channel semaphore to indicate
-       the availability of inactive channels to the main thread, which
-       accepts new TCP connections and assigns them to channels. */
-    if (mode == MODE_TCP_TARGET &&
-	sem_init (&channel_semaphore, 0, MAX_CHANNELS) == -1) {
-	perror ("sem_init");
+    /* So do the timers of all channels, on one wheel. */
+    if ((trv = tw_create (&timers, TIMER_TICK_MS * 1000000UL)) != TW_OK) {
+	tw_error ("tw_create failed", trv);
 	exit (EXIT_PANIC);
     }
+    tw_timer_init (&pace_timer, timer_expire, NULL);
 
     //We will only need one file descriptor open.  We are multiplexing on one port.
     peer_addr->sin_port = htons (base_port);
-    int filedes = create_udp_socket (base_port, peer_addr);
+    int filedes = -1;
+
+    /* A shared-memory link replaces the socket.  Both ends name it by
+       the base port, and the first to start waits here for the other. */
+    if (use_shm) {
+	snprintf (link_name, sizeof (link_name), "mp3-relay-%d", base_port);
+	printlog ("WAITING FOR PEER ON SHARED-MEMORY LINK %s", link_name);
+	if ((srv = shm_create (&shm_link, link_name, SHM_RING_LEN,
+			       MAX_WIRE_LEN)) != SHM_OK) {
+	    shm_error ("shm_create failed", srv);
+	    exit (EXIT_PANIC);
+	}
+	udp_stats.stamp_ns = now_ns ();
+    } else
+	filedes = create_udp_socket (base_port, peer_addr);
+
+    /* With channel threads pinned, each channel's queues are created
+       from the CPUs of its threads, so that their memory is placed on
+       the same NUMA node (the FQ module touches it at creation). */
+    pinned = (CPU_COUNT (&role_cpus[CPU_CHANNEL]) != 0 &&
+	      pthread_getaffinity_np (pthread_self (), sizeof (home),
+				      &home) == 0);
 
     for (i = 0; i < MAX_CHANNELS; i++) {
-	chan_tab[i].epoch           = 0;
+	if (pinned) {
+	    (void)cpus_for (CPU_CHANNEL, 2 * i, &cpus);
+	    (void)cpus_for (CPU_CHANNEL, 2 * i + 1, &other);
+	    CPU_OR (&cpus, &cpus, &other);
+	    if (pthread_setaffinity_np (pthread_self (), sizeof (cpus),
+					&cpus) != 0)
+		printlog ("CANNOT PLACE CHANNEL %d QUEUES", i);
+	}
+
 	chan_tab[i].fd              = -1;
 	chan_tab[i].active          = 0;
 	chan_tab[i].need_help       = 0;
+	chan_tab[i].need_write      = 0;
+	chan_tab[i].can_write       = 0;
+	chan_tab[i].out             = NULL;
+	chan_tab[i].out_len         = 0;
+	chan_tab[i].out_size        = 0;
 	chan_tab[i].channel_state   = CLOSE_CHANNEL_ALL;
-	if (pthread_mutex_init (&chan_tab[i].channel_lock, NULL) != 0 ||
-	    pthread_mutex_init (&chan_tab[i].help_lock, NULL) != 0 ||
-	    pthread_cond_init (&chan_tab[i].help, NULL) != 0) {
-	    fputs ("pthread mutex or cond init failed\n", stderr);
+	chan_tab[i].number          = i;
+	chan_tab[i].deficit         = SCHED_QUANTUM;
+	chan_tab[i].xmit_full       = 0;
+	chan_tab[i].rx_missing      = 0;
+	chan_tab[i].rx_late         = 0;
+	set_epoch (&chan_tab[i], first_epoch);
+	if (mode == MODE_TCP_TARGET)
+	    chan_free (&chan_tab[i]);
+	for (k = 0; k < NUM_TIMERS; k++)
+	    tw_timer_init (&chan_tab[i].timer[k], timer_expire, &chan_tab[i]);
+	if ((chan_tab[i].wake_fd = eventfd (0, EFD_NONBLOCK)) == -1) {
+	    perror ("eventfd");
 	    exit (EXIT_PANIC);
 	}
 
@@ -1022,90 +2579,864 @@ init_channels (pthread_attr_t* attr, int base_port,
 
 	udpchans[2*i] = &chan_tab[i].udp[1];
 	udpchans[2*i+1] = &chan_tab[i].udp[0];
-
-	if (pthread_create (&chan_tab[i].helper_id, attr, tcp_helper,&chan_tab[i]) != 0 ||
-	    pthread_create (&trash, attr, tcp_receiver,	&chan_tab[i]) != 0 ||
-	    pthread_create (&trash, attr, tcp_sender, &chan_tab[i]) != 0 ){
-	  fputs ("pthread create failed\n", stderr);
-	  exit (EXIT_PANIC);
-	    }
-    }
-    if (pthread_create (&trash, attr, udp_receiver, &chan_tab[0].udp[0]) != 0) {
-      	    fputs ("pthread create failed\n", stderr);
+	demux.recv[2*i] = chan_tab[i].udp[1].recv;
+	demux.recv[2*i+1] = chan_tab[i].udp[0].recv;
+
+	if ((rv = fq_create (&chan_tab[i].xmit[0], XMIT_QUEUE_LEN,
+			     sizeof (xmit_item_t))) != FQ_OK ||
+	    (rv = fq_create (&chan_tab[i].xmit[1], ACK_QUEUE_LEN,
+			     sizeof (xmit_item_t))) != FQ_OK) {
+	    fq_error ("fq_create failed", rv);
 	    exit (EXIT_PANIC);
+	}
+
+	create_thread (attr, &trash, tcp_helper, &chan_tab[i],
+		       CPU_CHANNEL, 2 * i);
+	create_thread (attr, &trash, tcp_receiver, &chan_tab[i],
+		       CPU_CHANNEL, 2 * i + 1);
+	create_thread (attr, &trash, tcp_sender, &chan_tab[i],
+		       CPU_CHANNEL, 2 * i);
     }
+    if (pinned)
+	(void)pthread_setaffinity_np (pthread_self (), sizeof (home), &home);
+
+    create_thread (attr, &trash, udp_receiver, &chan_tab[0].udp[0],
+		   CPU_UDP_RECEIVER, 0);
+    create_thread (attr, &trash, udp_sender, &chan_tab[0].udp[0],
+		   CPU_UDP_SENDER, 0);
+    create_thread (attr, &trash, timer_driver, NULL, CPU_TIMER, 0);
 
 }
 
 
 /*
-   Write <n> bytes from <buf> to file descriptor <fd>.  Block until 
-   <n> bytes are received or read returns 0 or an error besides
-   interruption by a signal.
+   Wake the tcp_helper thread of channel <ct> to look at its requests
+   and the channel state again.  The helper sleeps only in poll, which
+   returns once the eventfd is written.
 */
-static int 
-my_write (int fd, const void* buf, size_t n)
+static void
+kick_helper (channel_t* ct)
 {
-    size_t written = 0;
-    ssize_t once;
-
-    while (written < n) {
-	if ((once = write (fd, buf + written, n - written)) == -1) {
-	    /* Try again if interrupted. */
-	    if (once == EINTR)
-		continue;
-	    /* Otherwise, fail. */
-	    return -1;
-	}
-	written += once;
+    if (eventfd_write (ct->wake_fd, 1) == -1) {
+	perror ("eventfd_write");
+	exit (EXIT_PANIC);
     }
-
-    return n;
 }
 
 
 /*
-   Open a TCP connection to the forwarding target and active the
-   channel <ct>, waking the TCP helper and sender threads to recognize
-   channel activation.
+   Fill the data portion of <packet>, up to <room> bytes, from the
+   <*avail> bytes of plaintext staged at <src>, compressing with the LZ stream in <zip> unless recent
+   data have proven incompressible.  Set <*flags> to the packet flags
+   describing the data, and return the number of data bytes in the packet.
+   The <*avail> returns the amount of plaintext consumed.  Incompressible
+   plaintext is sent as is (but still enters the stream history); after
+   several such frames in a row, compression is bypassed for a period that
+   doubles each time it ends with another failure.
 */
-static void
-open_and_activate_channel (channel_t* ct)
+static int
+lz_fill_frame (lz_chan_t* zip, const unsigned char* src, int* avail,
+	       unsigned char* packet, int room, int* flags)
 {
-    int fd;
+    int src_len = *avail, dst_len = room, tried = 0;
+    unsigned long long start = now_ns ();
+    lz_err_t rv = LZ_INCOMPRESSIBLE;
 
-    /* Open a TCP connection to the forwarding target (fwd_addr).
-       Print error messages, but ignore errors. */
-    if ((fd = socket (AF_INET, SOCK_STREAM, 0)) == -1)
-        perror ("socket");
-    else if (connect (fd, (struct sockaddr*)&fwd_addr,
-	     sizeof (fwd_addr)) == -1) {
-	perror ("connect to forwarding address");
-	close (fd);
-	fd = -1;
-    }
-
-    /* Lock should not be contended (this routine should not be called
-       unless all TCP threads associated with a channel are known to
-       consider the channel inactive, but the lock guarantees that new 
-       file descriptor value is visible to other threads before the 
-       change in channel state becomes visible, and is not an unreasonable
-       practice for the channel_state (only access it under a lock, even
-       if you know the access is uncontended). */
-    ct->fd = fd;
-    get_lock (&ct->channel_lock);
-    ct->channel_state = CLOSE_CHANNEL_NONE;
-    release_lock (&ct->channel_lock);
-
-    /* No need to notify tcp_receiver (all threads not mentioned in 
-       argument are awoken): it alone calls this function. */
-    wake_threads (ct, CLOSE_CHANNEL_RECEIVER);
-}
+    if (src_len == 0) {
+	*flags = 0;
+	return 0;
+    }
 
+    if (zip->skip > 0)
+	zip->skip--;
+    else {
+	tried = 1;
+	rv = lz_compress (zip->lz, src, &src_len, PKT_DATA (packet), &dst_len);
+    }
 
-/*
-   Create and bind the target TCP socket for the relay at port
-   <target_port>, then put it in the passive state.  Ignore leftover
+    if (rv == LZ_OK) {
+	zip->misses = 0;
+	zip->backoff = LZ_BYPASS_MIN;
+	zip->lz_frames++;
+	*flags = PKT_FLAG_LZ;
+    } else {
+	if (rv != LZ_INCOMPRESSIBLE) {
+	    lz_error ("lz_compress failed in tcp_sender", rv);
+	    exit (EXIT_PANIC);
+	}
+	if (tried && ++zip->misses >= LZ_BYPASS_MISSES) {
+	    zip->misses = 0;
+	    zip->skip = zip->backoff;
+	    if (zip->backoff < LZ_BYPASS_MAX)
+		zip->backoff *= 2;
+	}
+	src_len = dst_len = (*avail < room ? *avail : room);
+	memcpy (PKT_DATA (packet), src, src_len);
+	(void)lz_append (zip->lz, src, src_len);
+	zip->raw_frames++;
+	*flags = PKT_FLAG_LZ_RAW;
+    }
+
+    zip->codec_ns += now_ns () - start;
+    zip->plain_bytes += src_len;
+    zip->wire_bytes += dst_len;
+    *avail = src_len;
+    return dst_len;
+}
+
+
+/*
+   Find the plaintext carried by the data frame <packet>, expanding it
+   into <plain> (LZ_MAX_INPUT bytes) through the LZ stream in <zip> if
+   the frame was compressed.  The stream is created on first use.  Point
+   <*data> at the plaintext and return its length, or return -1 if the
+   frame is malformed.
+*/
+static int
+lz_open_frame (lz_chan_t* zip, unsigned char* packet, unsigned char* plain,
+	       unsigned char** data)
+{
+    int len = PKT_LENGTH (packet), flags = PKT_FLAGS (packet), plain_len;
+    unsigned long long start;
+    lz_err_t rv;
+
+    *data = PKT_DATA (packet);
+    if (len > PKT_DATA_ROOM (packet))
+	return -1;
+    if ((flags & (PKT_FLAG_LZ | PKT_FLAG_LZ_RAW)) == 0)
+	return len;
+
+    if (zip->lz == NULL && (rv = lz_create (&zip->lz)) != LZ_OK) {
+	lz_error ("lz_create failed in tcp_receiver", rv);
+	exit (EXIT_PANIC);
+    }
+
+    start = now_ns ();
+    zip->wire_bytes += len;
+    if ((flags & PKT_FLAG_LZ) != 0) {
+	*data = plain;
+	plain_len = LZ_MAX_INPUT;
+	rv = lz_decompress (zip->lz, PKT_DATA (packet), len, plain, &plain_len);
+	len = plain_len;
+	zip->lz_frames++;
+    } else {
+	rv = lz_append (zip->lz, PKT_DATA (packet), len);
+	zip->raw_frames++;
+    }
+    zip->codec_ns += now_ns () - start;
+    if (rv != LZ_OK)
+	return -1;
+    zip->plain_bytes += len;
+    return len;
+}
+
+
+/*
+   Log the compression statistics for direction <dir> (as in the udp
+   array) of channel <ct>, if any data passed through a compressor.
+*/
+static void
+lz_report (channel_t* ct, int dir)
+{
+    lz_chan_t* zip = &ct->zip[dir];
+
+    if (zip->lz_frames == 0 && zip->raw_frames == 0)
+	return;
+    printlog ("%#08X LZ %s %lu -> %lu BYTES (%.2f:1), %lu LZ/%lu RAW, %llu US",
+	      (unsigned int)ct, (dir == 0 ? "TX" : "RX"), zip->plain_bytes,
+	      zip->wire_bytes, (double)zip->plain_bytes / zip->wire_bytes,
+	      zip->lz_frames, zip->raw_frames, zip->codec_ns / 1000);
+}
+
+
+/*
+   Prepare the compression state <zip> for a new connection: clear the
+   statistics and the bypass state, and empty the stream history.
+*/
+static void
+lz_start (lz_chan_t* zip)
+{
+    zip->misses = zip->skip = 0;
+    zip->backoff = LZ_BYPASS_MIN;
+    zip->plain_bytes = zip->wire_bytes = 0;
+    zip->lz_frames = zip->raw_frames = 0;
+    zip->codec_ns = 0;
+    if (zip->lz != NULL)
+	lz_reset (zip->lz);
+}
+
+
+/*
+   Put the file descriptor <fd> into non-blocking mode.
+*/
+static void
+make_nonblocking (int fd)
+{
+    int flags;
+
+    if ((flags = fcntl (fd, F_GETFL)) == -1 ||
+	fcntl (fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+	perror ("fcntl");
+	exit (EXIT_PANIC);
+    }
+}
+
+
+/*
+   Return the current time in nanoseconds from CLOCK_MONOTONIC.
+*/
+static unsigned long long
+now_ns (void)
+{
+    struct timespec ts;
+
+    if (clock_gettime (CLOCK_MONOTONIC, &ts) == -1) {
+	perror ("clock_gettime");
+	exit (EXIT_PANIC);
+    }
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+   Finish the connection of channel <ct> to the forwarding target, begun
+   by open_and_activate_channel, once tcp_helper sees it writable or in
+   error (<ready> set), or finds it still in progress after it has taken
+   TIMEOUT_IN_SECONDS (<ready> clear), in which case it fails.  Count it
+   and log how long it took, and return 0 if it was made or -1 if it
+   failed.  Return 1 for a connection still in progress and not yet
+   overdue, leaving it be.
+*/
+static int
+connect_done (channel_t* ct, int ready)
+{
+    unsigned long long ns = now_ns () - ct->connect_ns, total, max;
+    unsigned long n;
+    int err = ETIMEDOUT;
+    socklen_t len = sizeof (err);
+
+    if (!ready && ns < TIMEOUT_IN_SECONDS * 1000000000ULL)
+	return 1;
+    CHANNEL_STORE (ct->connecting, 0);
+    if (ready && getsockopt (ct->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+	err = errno;
+    if (err != 0) {
+	CHANNEL_STORE (ct->connect_failed, 1);
+	(void)__atomic_fetch_add (&connect_stats.failures, 1,
+				  __ATOMIC_RELAXED);
+	printlog ("%#08X CONNECT FAILED AFTER %llu US: %s",
+		  (unsigned int)ct, ns / 1000, strerror (err));
+	return -1;
+    }
+    n = __atomic_add_fetch (&connect_stats.connects, 1, __ATOMIC_RELAXED);
+    total = __atomic_add_fetch (&connect_stats.total_ns, ns,
+				__ATOMIC_RELAXED);
+    max = __atomic_load_n (&connect_stats.max_ns, __ATOMIC_RELAXED);
+    while (ns > max &&
+	   !__atomic_compare_exchange_n (&connect_stats.max_ns, &max, ns, 1,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    printlog ("%#08X CONNECTED IN %llu US (MEAN %llu, MAX %llu)",
+	      (unsigned int)ct, ns / 1000, total / n / 1000,
+	      (ns > max ? ns : max) / 1000);
+    return 0;
+}
+
+
+/*
+   Open a TCP connection to the forwarding target and activate the
+   channel <ct>, waking the TCP helper and sender threads to recognize
+   channel activation.  The connection is made without blocking: the
+   channel is active at once, and until tcp_helper sees the connection
+   complete (see connect_done), tcp_receiver keeps the data it would
+   write as pending output, to be written in one call once connected.
+   Frames are acknowledged meanwhile, within the window that output
+   leaves (see recv_window).
+*/
+static void
+open_and_activate_channel (channel_t* ct)
+{
+    int fd;
+    unsigned long hits, misses;
+
+    /* Claim a connection from the pool if one is ready. */
+    ct->connecting = ct->connect_failed = 0;
+    if (fwd_pool != NULL && pool_claim (fwd_pool, &fd) == POOL_OK)
+	;
+    /* Otherwise start a TCP connection to the forwarding target
+       (fwd_addr).  Print error messages, but ignore errors. */
+    else if ((fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+        perror ("socket");
+    else {
+	/* A connection made at once is finished by tcp_helper too, so
+	   that every connection is timed in the same way. */
+	ct->connect_ns = now_ns ();
+	if (connect (fd, (struct sockaddr*)&fwd_addr,
+		     sizeof (fwd_addr)) == 0 || errno == EINPROGRESS)
+	    ct->connecting = 1;
+	else {
+	    (void)__atomic_fetch_add (&connect_stats.failures, 1,
+				      __ATOMIC_RELAXED);
+	    perror ("connect to forwarding address");
+	    close (fd);
+	    fd = -1;
+	}
+    }
+    if (fd != -1) {
+	make_nonblocking (fd);
+	set_busy_poll (fd);
+    } else
+	ct->connect_failed = 1;
+    if (fwd_pool != NULL) {
+	pool_stats (fwd_pool, &hits, &misses, NULL);
+	printlog ("%#08X CONNECTION POOL %lu HITS, %lu MISSES", (unsigned int)ct,
+		  hits, misses);
+    }
+
+    /* This routine is not called unless all TCP threads associated with
+       the channel consider it inactive, so nothing else writes its
+       fields until the state is published.  Publishing the state with
+       a release makes the new file descriptor visible to other threads
+       before the change in channel state.  While connecting, tcp_helper
+       is asked at once to watch for the socket becoming writable. */
+    ct->fd = fd;
+    ct->need_help = 0;
+    ct->has_data = 0;
+    ct->need_write = ct->connecting;
+    ct->can_write = 0;
+    ct->active = 1;
+    CHANNEL_STORE (ct->channel_state, CLOSE_CHANNEL_NONE);
+
+    /* No need to notify tcp_receiver (all threads not mentioned in 
+       argument are awoken): it alone calls this function. */
+    wake_threads (ct, CLOSE_CHANNEL_RECEIVER);
+}
+
+
+/*
+   Append <len> bytes from <buf> to the pending output of channel <ct>,
+   growing the buffer as necessary.
+*/
+static void
+out_append (channel_t* ct, const unsigned char* buf, int len)
+{
+    unsigned char* out;
+    int size = (ct->out_size == 0 ? LZ_MAX_INPUT : ct->out_size);
+
+    while (size < ct->out_len + len)
+	size *= 2;
+    if (size != ct->out_size) {
+	if ((out = realloc (ct->out, size)) == NULL) {
+	    perror ("realloc");
+	    exit (EXIT_PANIC);
+	}
+	ct->out = out;
+	ct->out_size = size;
+    }
+    memcpy (ct->out + ct->out_len, buf, len);
+    ct->out_len += len;
+}
+
+
+/*
+   Parse the CPU affinity specification <spec> of a -a option, which
+   gives the CPUs for threads of one or more roles.  Return 0 on
+   success, or -1 if the specification is not valid.
+*/
+static int
+parse_affinity (char* spec)
+{
+    static char* const keys[] = {
+	"main", "recv", "send", "timer", "chan", NULL
+    };
+    char* value;
+    int role;
+
+    while (*spec != '\0') {
+	if ((role = getsubopt (&spec, keys, &value)) == -1 || value == NULL ||
+	    parse_cpus (value, &role_cpus[role]) == -1)
+	    return -1;
+    }
+    return 0;
+}
+
+
+/*
+   Parse the traffic class <spec>, a comma-separated list of the options
+   port=<TCP port>, addr=<address>[/<prefix bits>], weight=<DRR quanta>,
+   rate=<bytes per second>, burst=<bytes> and window=<frames>, and add
+   the class to the class table.  Omitted options leave the class
+   matching any port or address, with a weight of one, no rate limit and
+   the window set by -w; the burst defaults to a tenth of a second at the
+   rate given.  Return 0 on success, or -1 if the specification is
+   malformed or the table is full.
+*/
+static int
+parse_class (char* spec)
+{
+    static char* const keys[] = {
+	"port", "addr", "weight", "rate", "burst", "window", NULL
+    };
+    class_t* cls = &classes[n_classes];
+    char* value, * slash;
+    struct in_addr addr;
+    long n;
+    int bits;
+
+    if (n_classes == MAX_CLASSES)
+	return -1;
+    cls->weight = 1;
+
+    while (*spec != '\0') {
+	switch (getsubopt (&spec, keys, &value)) {
+	    case 0:
+		if (parse_number (value, 1, 65535, &n) == -1)
+		    return -1;
+		cls->port = n;
+		break;
+	    case 1:
+		if (value == NULL)
+		    return -1;
+		bits = 32;
+		if ((slash = strchr (value, '/')) != NULL) {
+		    *slash = '\0';
+		    if (parse_number (slash + 1, 0, 32, &n) == -1)
+			return -1;
+		    bits = n;
+		}
+		if (inet_aton (value, &addr) == 0)
+		    return -1;
+		cls->mask = (bits == 0 ? 0 : htonl (0xFFFFFFFFUL << (32 - bits)));
+		cls->addr = addr.s_addr & cls->mask;
+		break;
+	    case 2:
+		if (parse_number (value, 1, INT_MAX / SCHED_QUANTUM, &n) == -1)
+		    return -1;
+		cls->weight = n;
+		break;
+	    case 3:
+		if (parse_number (value, 1, LONG_MAX, &n) == -1)
+		    return -1;
+		cls->rate = n;
+		break;
+	    case 4:
+		if (parse_number (value, 1, LONG_MAX, &n) == -1)
+		    return -1;
+		cls->burst = n;
+		break;
+	    case 5:
+		if (parse_number (value, INITIAL_WINDOW, MAX_WINDOW, &n) == -1)
+		    return -1;
+		cls->window = n;
+		break;
+	    default:
+		return -1;
+	}
+    }
+
+    /* Start with a full bucket. */
+    if (cls->burst == 0)
+	cls->burst = cls->rate / 10;
+    if (cls->burst < CLASS_MIN_BURST)
+	cls->burst = CLASS_MIN_BURST;
+    cls->tokens = cls->burst;
+    cls->stamp_ns = now_ns ();
+
+    n_classes++;
+    return 0;
+}
+
+
+/*
+   Parse the CPU list <value>, CPU numbers or ranges (<n>-<m>) separated
+   by colons, into the CPU set <set>.  Return 0 on success, or -1 if
+   <value> is not valid.
+*/
+static int
+parse_cpus (char* value, cpu_set_t* set)
+{
+    char* end;
+    long first, last;
+
+    CPU_ZERO (set);
+    do {
+	first = last = strtol (value, &end, 10);
+	if (*end == '-')
+	    last = strtol (end + 1, &end, 10);
+	if (end == value || (*end != '\0' && *end != ':') || first < 0 ||
+	    last < first || last >= CPU_SETSIZE)
+	    return -1;
+	for (; first <= last; first++)
+	    CPU_SET (first, set);
+	value = end + 1;
+    } while (*end == ':');
+    return 0;
+}
+
+
+/*
+   Parse <value> as a decimal number from <min> to <max> into <*n>.
+   Return 0 on success, or -1 if <value> is missing, has anything after
+   the number, or is out of range.
+*/
+static int
+parse_number (const char* value, long min, long max, long* n)
+{
+    char* end;
+
+    if (value == NULL)
+	return -1;
+    errno = 0;
+    *n = strtol (value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE || *n < min ||
+	*n > max)
+	return -1;
+    return 0;
+}
+
+
+/*
+   Pin the calling thread, of role <role>, to its CPUs (see cpus_for), if
+   the -a option gives any.  Failures are logged and otherwise ignored.
+*/
+static void
+pin_thread (cpu_role_t role, int index)
+{
+    cpu_set_t set;
+    int rv;
+
+    if (cpus_for (role, index, &set) == 0 &&
+	(rv = pthread_setaffinity_np (pthread_self (), sizeof (set),
+				      &set)) != 0)
+	printlog ("CANNOT PIN THREAD TO CPUS (%s)", strerror (rv));
+}
+
+
+/*
+   Copy the <len>-byte datagram received in <packet>, which udp_demux
+   has found well formed, to <frame>, which has room for MAX_RECV_LEN
+   bytes, checking its checksum on the way.  The header gives the length
+   of the frame, and the datagram's length beyond that shows whether it
+   has a session ID and whether its checksum is CRC-8 or CRC-32C (see
+   pkt_seal).  The session ID stays with the frame.  Note a peer that
+   uses CRC-32C or session IDs.  Return the length of the frame and its
+   session ID, without the checksum, or -1 if the frame is damaged.
+*/
+static int
+pkt_check (unsigned char* frame, const unsigned char* packet, int len)
+{
+    int frame_len = PKT_FRAME_LEN (packet);
+    int session = (len - frame_len > 4);
+    const unsigned char* crc;
+
+    if (session)
+	frame_len += PKT_SESSION_LEN;
+    crc = packet + frame_len;
+    if (len == frame_len + 1) {
+	if (ck_copy_crc8 (frame, packet, frame_len) != crc[0])
+	    return -1;
+    } else if (ck_copy_crc32c (frame, packet, frame_len) != PKT_BE32 (crc))
+	return -1;
+    else if (!__atomic_load_n (&peer_crc32c, __ATOMIC_RELAXED)) {
+	__atomic_store_n (&peer_crc32c, 1, __ATOMIC_RELAXED);
+	printlog ("PEER USES CRC-32C");
+    }
+    if (session && !__atomic_load_n (&peer_sessions, __ATOMIC_RELAXED)) {
+	__atomic_store_n (&peer_sessions, 1, __ATOMIC_RELAXED);
+	printlog ("PEER USES SESSION IDS");
+    }
+    return frame_len;
+}
+
+
+/*
+   Return the full epoch of <frame>, <*len> bytes as queued by
+   udp_receiver: its session ID if it has one, or else the epoch nearest
+   <ref> that ends in its EPOCH.  Take any session ID off <*len>, leaving
+   the length of the frame as sent.
+*/
+static unsigned long long
+pkt_epoch (const unsigned char* frame, int* len, unsigned long long ref)
+{
+    if (PKT_HAS_SESSION (frame, *len)) {
+	*len -= PKT_SESSION_LEN;
+	return PKT_SESSION (frame);
+    }
+    return EPOCH_EXTEND (ref, PKT_EPOCH (frame));
+}
+
+
+/*
+   Copy <frame>, of epoch <epoch>, into <packet>, which has room for
+   MAX_WIRE_LEN bytes, adding its checksum on the way, and return the
+   length of the datagram to send.  Only the header, data and SEQ are
+   sent (PKT_FRAME_LEN), so frames need no padding.  If either end has
+   asked for session IDs, the epoch follows as one.  The checksum is
+   CRC-32C if either end has asked for it, or else CRC-8.
+*/
+static int
+pkt_seal (unsigned char* packet, const unsigned char* frame,
+	  unsigned long long epoch)
+{
+    int len = PKT_FRAME_LEN (frame);
+    int crc8 = (checksum == CHECKSUM_CRC8 &&
+		!__atomic_load_n (&peer_crc32c, __ATOMIC_RELAXED));
+    unsigned char* crc;
+    unsigned int sum;
+    int i;
+
+    sum = (crc8 ? ck_copy_crc8 (packet, frame, len) :
+	   ck_copy_crc32c (packet, frame, len));
+
+    /* A session ID follows the frame, and the checksum is extended to
+       cover it. */
+    if (use_sessions || __atomic_load_n (&peer_sessions, __ATOMIC_RELAXED)) {
+	for (i = PKT_SESSION_LEN; i-- > 0; epoch >>= 8)
+	    packet[len + i] = (epoch & 0xFF);
+	sum = (crc8 ? ck_extend_crc8 (sum, packet + len, PKT_SESSION_LEN) :
+	       ck_extend_crc32c (sum, packet + len, PKT_SESSION_LEN));
+	len += PKT_SESSION_LEN;
+    }
+
+    crc = packet + len;
+    if (crc8) {
+	crc[0] = sum;
+	return len + 1;
+    }
+    crc[0] = (sum >> 24);
+    crc[1] = ((sum >> 16) & 0xFF);
+    crc[2] = ((sum >> 8) & 0xFF);
+    crc[3] = (sum & 0xFF);
+    return len + 4;
+}
+
+
+/*
+   Return the receive window to advertise for channel <ct>, in frames
+   beyond the next frame expected: the window of its traffic class, but
+   no more than the TCP socket can accept without adding to the pending
+   output.  TCP space is the send buffer size less the data not yet
+   acknowledged by the client (SIOCOUTQ) and the output pending, counted
+   in frames of the average plaintext carried so far (a full frame of
+   data until a frame is expanded).
+*/
+static int
+recv_window (channel_t* ct)
+{
+    lz_chan_t* zip = &ct->zip[1];
+    int wnd = classes[ct->traffic_class].window, queued, size;
+    int per_frame = PKT_MAX_DATA;
+    socklen_t size_len = sizeof (size);
+
+    if (ioctl (ct->fd, SIOCOUTQ, &queued) == -1 ||
+	getsockopt (ct->fd, SOL_SOCKET, SO_SNDBUF, &size, &size_len) == -1)
+	return wnd;
+    if (zip->lz_frames + zip->raw_frames > 0 &&
+	zip->plain_bytes > zip->lz_frames + zip->raw_frames)
+	per_frame = zip->plain_bytes / (zip->lz_frames + zip->raw_frames);
+    queued += ct->out_len;
+    if (queued >= size)
+	return 0;
+    if ((size - queued) / per_frame < wnd)
+	wnd = (size - queued) / per_frame;
+    return wnd;
+}
+
+
+/*
+   Find the next frame in transmit lane <lane> of channel <ct>, setting
+   <*item> to point to it in place and returning its length in <*len>.
+   Return 1 if a frame was found, or 0 if the lane was empty.  The frame
+   stays in the lane until sched_send has sent it.
+*/
+static int
+sched_dequeue (channel_t* ct, int lane, xmit_item_t** item, int* len)
+{
+    fq_err_t rv;
+
+    if ((rv = fq_peek (ct->xmit[lane], (unsigned char**)item, len)) ==
+	FQ_QUEUE_EMPTY)
+	return 0;
+    if (rv != FQ_OK) {
+	fq_error ("fq_peek failed in udp_sender", rv);
+	exit (EXIT_PANIC);
+    }
+    *len -= offsetof (xmit_item_t, packet);
+    return 1;
+}
+
+
+/*
+   Log the transmit statistics for lane <lane> (0 for data, 1 for ACKs)
+   of channel <ct>, if the lane carried or dropped any frames.
+*/
+static void
+sched_report (channel_t* ct, int lane)
+{
+    sched_stats_t* stats = &ct->sched[lane];
+    unsigned long frames, drops;
+    unsigned long long delay;
+
+    frames = __atomic_load_n (&stats->frames, __ATOMIC_RELAXED);
+    drops = __atomic_load_n (&stats->drops, __ATOMIC_RELAXED);
+    if (frames == 0 && drops == 0)
+	return;
+    delay = __atomic_load_n (&stats->delay_ns, __ATOMIC_RELAXED);
+    printlog ("%#08X SCHED %s/%d %lu FRAMES, QUEUED %llu/%llu US AVG/MAX, "
+	      "%lu DROPS, %lu THROTTLED", (unsigned int)ct,
+	      (lane == 0 ? "DATA" : "ACK"), ct->traffic_class, frames,
+	      (frames == 0 ? 0 : delay / frames / 1000),
+	      __atomic_load_n (&stats->max_ns, __ATOMIC_RELAXED) / 1000, drops,
+	      __atomic_load_n (&stats->throttled, __ATOMIC_RELAXED));
+}
+
+
+/*
+   Send the <len>-byte datagram in <item>, taken from lane <lane> of
+   channel <ct> by sched_dequeue, on UDP socket <fd>, ignoring errors,
+   account for the time it spent queued, and remove it from the lane.
+   With io_uring, the frame is copied into a free slot of the ring,
+   waiting for a send to complete if there is none, and queued there to
+   go out with the next batch (see tx_flush).  With a shared-memory
+   link, the frame goes into its ring instead, and a full ring counts as
+   a failed send.  Data frames are charged to the token bucket of the
+   channel's class.  If tcp_sender is waiting for room in the data lane,
+   wake it.  Must not be called with sched_lock held.
+*/
+static void
+sched_send (int fd, channel_t* ct, int lane, xmit_item_t* item, int len)
+{
+    sched_stats_t* stats = &ct->sched[lane];
+    unsigned long long delay, max;
+    ur_err_t rv;
+    fq_err_t frv;
+    int slot;
+
+    if (tx_ring != NULL) {
+	if (n_tx_free == 0)
+	    tx_flush (1);
+	slot = tx_free[--n_tx_free];
+	memcpy (tx_slots[slot].packet, item->packet, len);
+	if ((rv = ur_write_fixed (tx_ring, fd, tx_slots[slot].packet, len,
+				  slot)) != UR_OK) {
+	    ur_error ("ur_write_fixed failed in udp_sender", rv);
+	    exit (EXIT_PANIC);
+	}
+	if (++tx_queued >= TX_RING_BATCH || n_tx_free == 0)
+	    tx_flush (0);
+    } else if (shm_link != NULL ?
+	       shm_send (shm_link, item->packet, len) != SHM_OK :
+	       send (fd, item->packet, len, 0) == -1)
+	(void)__atomic_fetch_add (&udp_stats.tx_errors, 1, __ATOMIC_RELAXED);
+    else
+	(void)__atomic_fetch_add (&udp_stats.tx, 1, __ATOMIC_RELAXED);
+
+    /* The statistics are cleared by the channel's threads (see
+       sched_start), so even the maximum needs an atomic update. */
+    delay = now_ns () - item->queued_ns;
+    (void)__atomic_fetch_add (&stats->frames, 1, __ATOMIC_RELAXED);
+    (void)__atomic_fetch_add (&stats->delay_ns, delay, __ATOMIC_RELAXED);
+    max = __atomic_load_n (&stats->max_ns, __ATOMIC_RELAXED);
+    while (delay > max &&
+	   !__atomic_compare_exchange_n (&stats->max_ns, &max, delay, 1,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if ((frv = fq_release (ct->xmit[lane])) != FQ_OK) {
+	fq_error ("fq_release failed in udp_sender", frv);
+	exit (EXIT_PANIC);
+    }
+
+    /* The flag is set under the lock before tcp_sender retries its
+       enqueue, so checking it under the lock avoids a lost wakeup. */
+    if (lane == 0) {
+	if (classes[ct->traffic_class].rate != 0)
+	    classes[ct->traffic_class].tokens -= len;
+	get_lock (&ct->udp[0].recv_lock);
+	if (ct->xmit_full)
+	    condition_signal (&ct->udp[0].recv_cond);
+	release_lock (&ct->udp[0].recv_lock);
+    }
+}
+
+
+/*
+   Clear the transmit statistics <stats> for a new connection.  Frames
+   of the previous connection that udp_sender sends meanwhile may be
+   counted toward the new one.
+*/
+static void
+sched_start (sched_stats_t* stats)
+{
+    __atomic_store_n (&stats->frames, 0, __ATOMIC_RELAXED);
+    __atomic_store_n (&stats->delay_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n (&stats->max_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n (&stats->drops, 0, __ATOMIC_RELAXED);
+    __atomic_store_n (&stats->throttled, 0, __ATOMIC_RELAXED);
+}
+
+
+/*
+   Send an ACK on channel <ct> for every frame before <NFE>, with the
+   LAST flag if <fin> is set, for epoch <epoch> and with flags <flags>.
+   ACKs are cumulative (they name the last frame written to TCP) and
+   advertise the receive window.  The LAST flag is set once the whole
+   stream has been written, so the sender can recognize the end.  We
+   ignore errors, including a full ACK lane.
+*/
+static void
+send_ack (channel_t* ct, unsigned int NFE, int fin, unsigned long long epoch,
+	  int flags)
+{
+    unsigned char packet[MAX_PKT_LEN];
+
+    PKT_SET_WINDOW (packet, recv_window (ct));
+    PKT_MAKE_HEADER (packet, 1, fin, ct->number, PREV_SEQ_NUM (NFE),
+		     epoch, 2, flags);
+
+    (void)xmit_frame (ct, 1, packet);
+    printlog ("%#08X TCP_RECEIVER SENT ACK %02X:%03X%s(%d bytes) WINDOW %d",
+	      (unsigned int)ct, PKT_EPOCH (packet), PKT_SEQ_NUM (packet), 
+	      (PKT_IS_LAST (packet) ? " LAST " : " "), PKT_FRAME_LEN (packet),
+	      PKT_WINDOW (packet));
+}
+
+
+/*
+   Set the epoch of channel <ct> to <epoch>, and copy it into the demux
+   table for udp_receiver.
+*/
+static void
+set_epoch (channel_t* ct, unsigned long long epoch)
+{
+    ct->epoch = epoch;
+    __atomic_store_n (&demux.epoch[ct->number], epoch, __ATOMIC_RELAXED);
+}
+
+
+/*
+   In busy-poll mode, have blocking reads and polls of socket <fd> poll
+   the device queue for up to the spin time before sleeping, where the
+   kernel supports it.  Raising SO_BUSY_POLL above the system default
+   needs CAP_NET_ADMIN; failures are logged once and otherwise ignored,
+   as spinning in the relay itself does not depend on them.
+*/
+static void
+set_busy_poll (int fd)
+{
+#if defined (SO_BUSY_POLL)
+    static int warned = 0;
+
+    if (spin_us != 0 &&
+	setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL, &spin_us,
+		    sizeof (spin_us)) == -1 && !warned) {
+	warned = 1;
+	printlog ("NO SO_BUSY_POLL (%s)", strerror (errno));
+    }
+#endif
+}
+
+
+/*
+   Create and bind the target TCP socket for the relay at port
+   <target_port>, then put it in the passive state.  Ignore leftover
    connections from any previous bindings.  Return the file descriptor 
    for the socket.
 */
@@ -1128,6 +3459,14 @@ set_up_target_socket (short int target_port)
 	exit (EXIT_PANIC);
     }
 
+    /* Let each acceptor thread bind a socket of its own to the port. */
+    if (n_acceptors > 1 &&
+	setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (char*)&yes,
+		    sizeof (yes)) == -1) {
+        perror ("setsockopt SO_REUSEPORT");
+	exit (EXIT_PANIC);
+    }
+
     /* Bind to the appropriate port number under the server's default 
        IP address. */
     bind_addr.sin_family = AF_INET;
@@ -1139,7 +3478,7 @@ set_up_target_socket (short int target_port)
     }
 
     /* Place socket in passive state. */
-    if (listen (fd, SERVER_QUEUE) == -1) {
+    if (listen (fd, listen_backlog) == -1) {
 	perror ("listen");
 	exit (EXIT_PANIC);
     }
@@ -1148,6 +3487,353 @@ set_up_target_socket (short int target_port)
 }
 
 
+/*
+   Log the occupancy of the send buffer of channel <ct> over the stream
+   just sent: the average (sampled as each frame was cut) and the peak
+   number of bytes held, and how often reading stopped with the buffer
+   full.  A buffer that is often full with the window open is too small.
+*/
+static void
+sndbuf_report (channel_t* ct)
+{
+    sndbuf_stats_t* stats = &ct->sndbuf;
+
+    if (stats->samples == 0)
+	return;
+    printlog ("%#08X SNDBUF %lu/%lu BYTES AVG/PEAK OF %d, %lu FULL",
+	      (unsigned int)ct, stats->bytes / stats->samples, stats->peak,
+	      send_buffer_size, stats->full);
+}
+
+
+/*
+   End a wait using busy-poll state <spin>, the thread having found work,
+   and adapt the spin limit: double it if the work turned up within the
+   -s time (while spinning or soon after), or halve it after a longer
+   wait (see spin_t).
+*/
+static void
+spin_end (spin_t* spin)
+{
+    if (spin->start == 0)
+	return;
+    if (now_ns () - spin->start <= spin_ns) {
+	if ((spin->limit *= 2) > spin_ns)
+	    spin->limit = spin_ns;
+    } else if ((spin->limit /= 2) < SPIN_MIN_NS)
+	spin->limit = SPIN_MIN_NS;
+    spin->start = 0;
+    spin->blocked = 0;
+}
+
+
+/*
+   Note that a thread using busy-poll state <spin> has found nothing to
+   do.  Return 1 if it should look again without blocking, or 0 if it
+   has spun for as long as its limit allows (or if not in busy-poll
+   mode), and should block until woken.  Once the thread has blocked,
+   it does not spin again until spin_end.
+*/
+static int
+spin_on (spin_t* spin)
+{
+    unsigned long long now;
+
+    if (spin_ns == 0 || spin->blocked)
+	return 0;
+    now = now_ns ();
+    if (spin->start == 0) {
+	spin->start = now;
+	if (spin->limit == 0)
+	    spin->limit = spin_ns;
+    } else if (now - spin->start >= spin->limit) {
+	spin->blocked = 1;
+	return 0;
+    }
+    return 1;
+}
+
+
+/*
+   Wait on condition <cond> with <lock> held, as condition_wait does,
+   but spin first in busy-poll mode: drop the lock for a moment and
+   return, so that the caller checks its condition again.  Callers
+   must loop on their condition, and call spin_end once it holds.
+*/
+static void
+spin_wait (spin_t* spin, pthread_cond_t* cond, pthread_mutex_t* lock)
+{
+    if (spin_on (spin)) {
+	release_lock (lock);
+	CPU_RELAX ();
+	get_lock (lock);
+    } else
+	condition_wait (cond, lock);
+}
+
+
+/*
+   Write the data in <iov>[1] through <iov>[<n_iov> - 1] to the TCP
+   connection of channel <ct> with one writev call, after any output
+   still pending (this routine fills in <iov>[0] for it).  Whatever the
+   non-blocking socket does not take is kept as pending output, and the
+   helper is asked to report when there is room to write.  While that
+   request is outstanding, data are added to the pending output without
+   trying the socket.  Return 0 on success, or -1 if the write failed.
+*/
+static int
+tcp_deliver (channel_t* ct, struct iovec* iov, int n_iov)
+{
+    ssize_t done = 0;
+    int i;
+
+    iov[0].iov_base = ct->out;
+    iov[0].iov_len = ct->out_len;
+    if (!CHANNEL_LOAD (ct->need_write) && (n_iov > 1 || ct->out_len > 0)) {
+	while ((done = writev (ct->fd, iov, n_iov)) == -1 && errno == EINTR);
+	if (done == -1) {
+	    if (errno != EAGAIN)
+		return -1;
+	    done = 0;
+	}
+    }
+
+    /* Keep whatever was not written, in order. */
+    if (done < ct->out_len) {
+	memmove (ct->out, ct->out + done, ct->out_len - done);
+	ct->out_len -= done;
+	done = 0;
+    } else {
+	done -= ct->out_len;
+	ct->out_len = 0;
+    }
+    for (i = 1; i < n_iov; i++) {
+	if (done >= (ssize_t)iov[i].iov_len) {
+	    done -= iov[i].iov_len;
+	    continue;
+	}
+	out_append (ct, (unsigned char*)iov[i].iov_base + done,
+		    iov[i].iov_len - done);
+	done = 0;
+    }
+
+    /* Ask the helper to watch for room to write, interrupting its
+       poll if necessary. */
+    if (ct->out_len > 0 && !CHANNEL_LOAD (ct->need_write)) {
+	CHANNEL_STORE (ct->need_write, 1);
+	kick_helper (ct);
+    }
+    return 0;
+}
+
+
+/*
+   Called by the timer thread when timer <timer> expires, with the
+   channel that owns it as <arg>, or NULL for the pacing timer.  Note
+   the expiry for the thread concerned and wake it: udp_sender for the
+   pacing timer, and tcp_sender for the others.  The thread acts on it
+   once awake, since the wheel is locked here.
+*/
+static void
+timer_expire (tw_timer_t* timer, void* arg)
+{
+    channel_t* ct = arg;
+    udp_channel_t* uct;
+
+    if (ct == NULL) {
+	get_lock (&sched_lock);
+	pace_due = 1;
+	condition_signal (&sched_cond);
+	release_lock (&sched_lock);
+	return;
+    }
+    uct = &ct->udp[0];
+    get_lock (&uct->recv_lock);
+    uct->fired |= TIMER_BIT (timer - ct->timer);
+    condition_signal (&uct->recv_cond);
+    release_lock (&uct->recv_lock);
+}
+
+
+/*
+   Account for an ACK that covered <acked> more frames of the stream
+   tracked by <tune>, the newest of which took <rtt_ns> to be
+   acknowledged (0 if the time is unknown because it was sent again).
+   RTT samples are smoothed as in TCP (RFC 6298).  With
+   -W, once per smoothed RTT the window is set to twice the bandwidth-
+   delay product, estimated as the frames delivered per nanosecond over
+   the interval times the least RTT seen, within INITIAL_WINDOW and
+   <limit>.  An interval in which the window held nothing back measures
+   the application rather than the path, so it can only raise the window.
+*/
+static void
+tune_ack (swp_tune_t* tune, int acked, unsigned long long rtt_ns, int limit)
+{
+    unsigned long long now = now_ns (), err;
+    double bdp;
+
+    if (rtt_ns != 0 && tune->samples++ == 0) {
+	tune->srtt_ns = rtt_ns;
+	tune->rttvar_ns = rtt_ns / 2;
+	tune->min_rtt_ns = rtt_ns;
+	tune->stamp_ns = now;
+    } else if (rtt_ns != 0) {
+	err = (rtt_ns > tune->srtt_ns ? rtt_ns - tune->srtt_ns :
+	       tune->srtt_ns - rtt_ns);
+	tune->rttvar_ns = (3 * tune->rttvar_ns + err) / 4;
+	tune->srtt_ns = (7 * tune->srtt_ns + rtt_ns) / 8;
+	if (rtt_ns < tune->min_rtt_ns)
+	    tune->min_rtt_ns = rtt_ns;
+    }
+    tune->delivered += acked;
+
+    if (!tune_windows || tune->samples == 0 ||
+	now - tune->stamp_ns < tune->srtt_ns || now == tune->stamp_ns)
+	return;
+    bdp = (double)tune->delivered * tune->min_rtt_ns / (now - tune->stamp_ns);
+    if (tune->limited || 2 * bdp > tune->window) {
+	if (2 * bdp >= limit)
+	    tune->window = limit;
+	else if (2 * bdp <= INITIAL_WINDOW)
+	    tune->window = INITIAL_WINDOW;
+	else
+	    tune->window = 2 * bdp;
+    }
+    tune->stamp_ns = now;
+    tune->delivered = 0;
+    tune->limited = 0;
+}
+
+
+/*
+   Log the tail-loss probes sent for the stream just sent on channel
+   <ct> and how many were answered, then the round-trip times measured
+   and the window in use at the end.
+*/
+static void
+tune_report (channel_t* ct)
+{
+    swp_tune_t* tune = &ct->tune;
+
+    if (ct->rtx.probes != 0)
+	printlog ("%#08X SENT %lu TAIL PROBES: %lu ANSWERED BEFORE TIMEOUT",
+		  (unsigned int)ct, ct->rtx.probes, ct->rtx.probes_acked);
+    if (tune->samples == 0)
+	return;
+    printlog ("%#08X RTT %llu/%llu US SMOOTHED/MIN, WINDOW %d",
+	      (unsigned int)ct, tune->srtt_ns / 1000, tune->min_rtt_ns / 1000,
+	      tune->window);
+}
+
+
+/*
+   Return the tail-loss probe timeout for the stream tracked by <tune>,
+   in nanoseconds, or 0 if a probe would not come before the channel
+   gives up.  As in RACK-TLP (RFC 8985), it is twice the smoothed RTT,
+   and at least TLP_MIN_MS.  A stream that has no RTT sample yet uses
+   that of the last stream to have one: every channel takes the same
+   path to the peer.
+*/
+static unsigned long long
+tune_pto (swp_tune_t* tune)
+{
+    unsigned long long pto;
+
+    pto = (tune->samples != 0 ? tune->srtt_ns :
+	   __atomic_load_n (&path_rtt_ns, __ATOMIC_RELAXED));
+    if (pto == 0)
+	return 0;
+    pto *= 2;
+    if (pto < TLP_MIN_MS * 1000000ULL)
+	pto = TLP_MIN_MS * 1000000ULL;
+    return (pto < TIMEOUT_IN_SECONDS * 1000000000ULL ? pto : 0);
+}
+
+
+/*
+   Reset the RTT and window tuning state <tune> for a new stream on a
+   channel allowed <limit> frames in flight.  Tuned windows start small
+   and grow with the measured path; otherwise the limit applies.
+*/
+static void
+tune_start (swp_tune_t* tune, int limit)
+{
+    memset (tune, 0, sizeof (*tune));
+    tune->window = (tune_windows ? INITIAL_WINDOW : limit);
+}
+
+
+/*
+   Submit the frames queued on the io_uring of udp_sender, wait until at
+   least <wait> sends have completed, and collect every completed send,
+   counting it and freeing its slot.  Does nothing without io_uring.
+*/
+static void
+tx_flush (int wait)
+{
+    unsigned long tag;
+    int res, more;
+    ur_err_t rv;
+
+    if (tx_ring == NULL)
+	return;
+    while ((rv = ur_submit (tx_ring, wait)) != UR_OK)
+	if (rv != UR_SYSCALL_FAILED || errno != EINTR) {
+	    ur_error ("ur_submit failed in udp_sender", rv);
+	    exit (EXIT_PANIC);
+	}
+    tx_queued = 0;
+    while (ur_complete (tx_ring, &tag, &res, &more)) {
+	if (res < 0)
+	    (void)__atomic_fetch_add (&udp_stats.tx_errors, 1,
+				      __ATOMIC_RELAXED);
+	else
+	    (void)__atomic_fetch_add (&udp_stats.tx, 1, __ATOMIC_RELAXED);
+	tx_free[n_tx_free++] = tag;
+    }
+}
+
+
+/*
+   Check the header of the <len>-byte datagram <packet>, and return the
+   index in udpchans of the thread that it is for, or -1 if it should be
+   dropped, counting the reason.  A malformed datagram is too short for
+   its header, or its length does not match the header with either
+   checksum, with or without a session ID, or its session does not end
+   in its EPOCH.  A frame of a past epoch would only be discarded by its
+   channel thread (see tcp_receiver and tcp_sender), so it is dropped
+   here without waking the thread, unless it is a data frame of the
+   epoch just ended, which tcp_receiver may need to answer.  The epoch is read from the demux
+   table, without the channel lock; it only grows, so a stale value
+   merely lets an old frame through to be discarded later.
+*/
+static int
+udp_demux (const unsigned char* packet, int len)
+{
+    int extra;
+    unsigned long long epoch, ref;
+
+    if (len <= PKT_HDR_LEN || PKT_CHAN_NUM (packet) >= MAX_CHANNELS ||
+	PKT_LENGTH (packet) > PKT_DATA_ROOM (packet) ||
+	((extra = len - PKT_FRAME_LEN (packet)) != 1 && extra != 4 &&
+	 extra != PKT_SESSION_LEN + 1 && extra != PKT_SESSION_LEN + 4) ||
+	(extra > 4 && (PKT_SESSION (packet) & 0xFF) != PKT_EPOCH (packet))) {
+	udp_stats.malformed++;
+	return -1;
+    }
+    ref = __atomic_load_n (&demux.epoch[PKT_CHAN_NUM (packet)],
+			   __ATOMIC_RELAXED);
+    epoch = (extra > 4 ? PKT_SESSION (packet) :
+	     EPOCH_EXTEND (ref, PKT_EPOCH (packet)));
+    if (EPOCH_BEFORE (epoch, ref) &&
+	(PKT_IS_ACK (packet) || epoch != ref - 1)) {
+	udp_stats.stale++;
+	return -1;
+    }
+    return 2 * PKT_CHAN_NUM (packet) + (PKT_IS_ACK (packet) != 0);
+}
+
+
 /*
    Initialize the unidirectional UDP channel <uct>.  The UDP socket is
    bound to port <port> and connected to <peer_addr>.
@@ -1158,18 +3844,238 @@ udp_init (udp_channel_t* uct, int filedes)
     fq_err_t rv;
 
     uct->fd = filedes;
+    uct->fired = 0;
     if (pthread_mutex_init (&uct->recv_lock, NULL) != 0 ||
         pthread_cond_init (&uct->recv_cond, NULL) != 0) {
 	fputs ("pthread mutex or cond init failed\n", stderr);
 	exit (EXIT_PANIC);
     }
-    if ((rv = fq_create (&uct->recv, 32, MAX_PKT_LEN)) != FQ_OK) {
+    if ((rv = fq_create (&uct->recv, RECV_QUEUE_LEN, MAX_RECV_LEN)) != FQ_OK) {
         fq_error ("fq_create failed", rv);
         exit (EXIT_PANIC);
     }
 }
 
 
+/*
+   Find the number of bytes queued for reading in UDP socket <fd>
+   (<*queued>) and the number of datagrams the kernel has dropped for
+   want of room in its receive buffer (<*drops>).  SO_MEMINFO gives
+   both; kernels without it list them for each socket, by inode, in
+   /proc/net/udp.  Return 0 on success, or -1 if neither source works.
+*/
+static int
+udp_meminfo (int fd, unsigned long* queued, unsigned long* drops)
+{
+#if defined (SO_MEMINFO)
+    unsigned int mem[SK_MEMINFO_VARS];
+    socklen_t mem_len = sizeof (mem);
+#endif
+    struct stat st;
+    char line[256];
+    unsigned long rx_queue, inode, n_drops;
+    FILE* f;
+    int rv = -1;
+
+#if defined (SO_MEMINFO)
+    if (getsockopt (fd, SOL_SOCKET, SO_MEMINFO, mem, &mem_len) == 0 &&
+	mem_len > SK_MEMINFO_DROPS * sizeof (unsigned int)) {
+	*queued = mem[SK_MEMINFO_RMEM_ALLOC];
+	*drops = mem[SK_MEMINFO_DROPS];
+	return 0;
+    }
+#endif
+
+    if (fstat (fd, &st) == -1 || (f = fopen ("/proc/net/udp", "r")) == NULL)
+	return -1;
+    while (rv == -1 && fgets (line, sizeof (line), f) != NULL) {
+	if (sscanf (line, " %*d: %*x:%*x %*x:%*x %*x %*x:%lx %*x:%*x %*x "
+		    "%*u %*u %lu %*d %*x %lu", &rx_queue, &inode,
+		    &n_drops) == 3 && inode == st.st_ino) {
+	    *queued = rx_queue;
+	    *drops = n_drops;
+	    rv = 0;
+	}
+    }
+    fclose (f);
+    return rv;
+}
+
+
+/*
+   Check the shared UDP socket <fd> for losses since the last check and
+   retune its buffers.  Called by udp_receiver once per UDP_MONITOR_MS.
+
+   Losses are reported by cause.  Kernel drops (receive buffer overflow)
+   and discards (a channel's receive queue full) are local overload.
+   Frames that channels found missing and that did not turn up late are
+   counted as lost on the wire, less the kernel drops and frames that
+   failed their checksum or were malformed, which also leave gaps; ACKs
+   lost on the wire leave no gaps and are not counted.  Corrupt frames
+   are reported on their own, with the malformed ones among them also
+   counted apart.  Frames of past epochs are not losses, and get a line
+   of their own.
+
+   Each buffer is set to hold UDP_BUFFER_MS of the traffic seen in the
+   interval (at UDP_TRUESIZE per datagram) and twice the most data seen
+   queued for reading, but never shrinks.  A kernel drop or failed send
+   doubles the buffer concerned.  Sizes range from UDP_BUFFER_SIZE to
+   UDP_BUFFER_MAX.
+
+   With a shared-memory link, <fd> is -1.  There are no kernel drops and
+   no buffers to size; a frame that finds the peer's ring full counts
+   as a failed send.
+*/
+static void
+udp_monitor (int fd)
+{
+    unsigned long long now = now_ns (), elapsed, want;
+    unsigned long queued, drops, d_drops;
+    unsigned long missing = 0, late = 0, d_missing, wire, d_discards;
+    unsigned long rx, tx, sent, failed, errors;
+    unsigned long d_corrupt, d_malformed, d_stale;
+    int i, rcvbuf, sndbuf;
+
+    elapsed = now - udp_stats.stamp_ns;
+    udp_stats.stamp_ns = now;
+
+    queued = 0;
+    if (fd == -1 || udp_meminfo (fd, &queued, &drops) == -1)
+	drops = udp_stats.drops;
+    d_drops = drops - udp_stats.drops;
+    udp_stats.drops = drops;
+    if (queued > udp_stats.peak_queue)
+	udp_stats.peak_queue = queued;
+
+    /* Counters written by other threads are read atomically. */
+    for (i = 0; i < MAX_CHANNELS; i++) {
+	missing += __atomic_load_n (&chan_tab[i].rx_missing, __ATOMIC_RELAXED);
+	late += __atomic_load_n (&chan_tab[i].rx_late, __ATOMIC_RELAXED);
+    }
+    d_corrupt = udp_stats.corrupt - udp_stats.corrupt_last;
+    udp_stats.corrupt_last = udp_stats.corrupt;
+    d_malformed = udp_stats.malformed - udp_stats.malformed_last;
+    udp_stats.malformed_last = udp_stats.malformed;
+    d_stale = udp_stats.stale - udp_stats.stale_last;
+    udp_stats.stale_last = udp_stats.stale;
+    d_corrupt += d_malformed;
+    d_missing = missing - udp_stats.missing;
+    if (d_missing > late - udp_stats.late + d_drops + d_corrupt)
+	wire = d_missing - (late - udp_stats.late) - d_drops - d_corrupt;
+    else
+	wire = 0;
+    udp_stats.missing = missing;
+    udp_stats.late = late;
+    d_discards = udp_stats.discards - udp_stats.discards_last;
+    udp_stats.discards_last = udp_stats.discards;
+
+    /* Size the buffers for the traffic of the interval. */
+    sent = __atomic_load_n (&udp_stats.tx, __ATOMIC_RELAXED);
+    failed = __atomic_load_n (&udp_stats.tx_errors, __ATOMIC_RELAXED);
+    rx = (udp_stats.rx - udp_stats.rx_last) * 1000 / UDP_MONITOR_MS;
+    tx = (sent - udp_stats.tx_last) * 1000 / UDP_MONITOR_MS;
+    if (elapsed > UDP_MONITOR_MS * 1000000UL) {
+	/* A late check spreads the traffic over a longer interval. */
+	rx = rx * UDP_MONITOR_MS / (elapsed / 1000000UL);
+	tx = tx * UDP_MONITOR_MS / (elapsed / 1000000UL);
+    }
+    errors = failed - udp_stats.errors_last;
+    udp_stats.rx_last = udp_stats.rx;
+    udp_stats.tx_last = sent;
+    udp_stats.errors_last = failed;
+
+    /* The sizes wanted are worked out in 64 bits, since a high rate
+       overflows 32, and capped before they are narrowed. */
+    want = (unsigned long long)rx * UDP_TRUESIZE * UDP_BUFFER_MS / 1000;
+    if (2ULL * udp_stats.peak_queue > want)
+	want = 2ULL * udp_stats.peak_queue;
+    if (d_drops > 0 && 2ULL * udp_stats.rcvbuf > want)
+	want = 2ULL * udp_stats.rcvbuf;
+    rcvbuf = (want > UDP_BUFFER_MAX ? UDP_BUFFER_MAX : (int)want);
+    if (rcvbuf < udp_stats.rcvbuf)
+	rcvbuf = udp_stats.rcvbuf;
+    want = (unsigned long long)tx * UDP_TRUESIZE * UDP_BUFFER_MS / 1000;
+    if (errors > 0 && 2ULL * udp_stats.sndbuf > want)
+	want = 2ULL * udp_stats.sndbuf;
+    sndbuf = (want > UDP_BUFFER_MAX ? UDP_BUFFER_MAX : (int)want);
+    if (sndbuf < udp_stats.sndbuf)
+	sndbuf = udp_stats.sndbuf;
+    udp_stats.peak_queue = 0;
+
+    if (d_drops > 0 || d_discards > 0 || wire > 0 || errors > 0 ||
+	d_corrupt > 0)
+	printlog ("UDP LOSS %lu KERNEL, %lu QUEUE, %lu WIRE, %lu SEND, "
+		  "%lu CORRUPT (%lu MALFORMED)", d_drops, d_discards, wire,
+		  errors, d_corrupt, d_malformed);
+    if (d_stale > 0)
+	printlog ("UDP DROPPED %lu FRAMES OF PAST EPOCHS", d_stale);
+    if (fd != -1 && (rcvbuf > udp_stats.rcvbuf || sndbuf > udp_stats.sndbuf)) {
+	udp_set_buffers (fd, rcvbuf, sndbuf);
+	printlog ("UDP BUFFERS %d/%d RCV/SND AT %lu/%lu DGRAMS/S",
+		  udp_stats.rcvbuf, udp_stats.sndbuf, rx, tx);
+    }
+}
+
+
+/*
+   Take the next frame for udp_receiver into <packet> (MAX_WIRE_LEN
+   bytes), from the shared-memory link if there is one, or else from
+   UDP socket <fd>.  If <wait> is set, wait for it, but no longer than
+   UDP_MONITOR_MS (the socket times out, see create_udp_socket).
+   Return its length, or -1 if there was none.
+*/
+static int
+udp_recv (int fd, unsigned char* packet, int wait)
+{
+    int len = MAX_WIRE_LEN, trash;
+    socklen_t tlen = sizeof (trash);
+
+    /* The link skips the MP3 adversary: frames are neither lost nor
+       corrupted on the way, except when a ring overflows. */
+    if (shm_link != NULL)
+	return (shm_recv (shm_link, packet, &len,
+			  (wait ? UDP_MONITOR_MS : 0)) == SHM_OK ? len : -1);
+
+    return mp3_recvfrom (fd, packet, MAX_WIRE_LEN, (wait ? 0 : MSG_DONTWAIT),
+			 (struct sockaddr*)&trash, &tlen);
+}
+
+
+/*
+   Set the receive and send buffers of UDP socket <fd> to <rcvbuf> and
+   <sndbuf> bytes, within UDP_BUFFER_SIZE and UDP_BUFFER_MAX.  The FORCE
+   options exceed the system limits but need privilege; without it, the
+   kernel clamps the sizes to its limits.  The sizes asked for are kept
+   in udp_stats.
+*/
+static void
+udp_set_buffers (int fd, int rcvbuf, int sndbuf)
+{
+    if (rcvbuf < UDP_BUFFER_SIZE)
+	rcvbuf = UDP_BUFFER_SIZE;
+    if (rcvbuf > UDP_BUFFER_MAX)
+	rcvbuf = UDP_BUFFER_MAX;
+    if (sndbuf < UDP_BUFFER_SIZE)
+	sndbuf = UDP_BUFFER_SIZE;
+    if (sndbuf > UDP_BUFFER_MAX)
+	sndbuf = UDP_BUFFER_MAX;
+
+    if ((setsockopt (fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+		     sizeof (rcvbuf)) == -1 &&
+	 setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+		     sizeof (rcvbuf)) == -1) ||
+	(setsockopt (fd, SOL_SOCKET, SO_SNDBUFFORCE, &sndbuf,
+		     sizeof (sndbuf)) == -1 &&
+	 setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+		     sizeof (sndbuf)) == -1)) {
+	perror ("setsockopt");
+	exit (EXIT_PANIC);
+    }
+    udp_stats.rcvbuf = rcvbuf;
+    udp_stats.sndbuf = sndbuf;
+}
+
+
 /*
    Wake up all TCP threads associated with channel <ct> and not 
    specified to ignore by the <ignore flag>.  Typically called
@@ -1180,13 +4086,8 @@ static void
 wake_threads (channel_t* ct, channel_state_t ignore)
 {
     /* Wake up tcp_helper. */
-    if (ignore != CLOSE_CHANNEL_HELPER) {
-	get_lock (&ct->help_lock);
-	condition_signal (&ct->help);
-	release_lock (&ct->help_lock);
-	/* Must also send signal in case tcp_helper is in poll. */
-	pthread_kill (ct->helper_id, SIGUSR1);
-    }
+    if (ignore != CLOSE_CHANNEL_HELPER)
+	kick_helper (ct);
 
     /* Wake up tcp_receiver. */
     if (ignore != CLOSE_CHANNEL_RECEIVER) {
@@ -1203,3 +4104,54 @@ wake_threads (channel_t* ct, channel_state_t ignore)
     }
 }
 
+
+/*
+   Queue the frame <packet> on transmit lane <lane> (0 for data, 1 for
+   ACKs) of channel <ct> for the udp_sender thread, sealing it with its
+   checksum straight into the room reserved for it in the lane.  When
+   the data lane is full, tcp_sender waits for room as long as the
+   channel stays active; ACKs are simply dropped.  Return 0 if the frame
+   was queued, or -1 otherwise.  The frame's full epoch is the one
+   nearest the channel's that ends in its EPOCH: the channel's own,
+   except for the ACK of a stream that has just ended (see tcp_receiver).
+*/
+static int
+xmit_frame (channel_t* ct, int lane, const unsigned char* packet)
+{
+    udp_channel_t* uct = &ct->udp[0];
+    xmit_item_t* item;
+    fq_err_t rv;
+    int len;
+
+    rv = fq_reserve (ct->xmit[lane], (unsigned char**)&item);
+    if (rv == FQ_ITEM_DISCARDED && lane == 0) {
+	/* Wait for udp_sender to take a frame (see sched_send). */
+	get_lock (&uct->recv_lock);
+	ct->xmit_full = 1;
+	while (CHANNEL_LOAD (ct->channel_state) == CLOSE_CHANNEL_NONE &&
+	       (rv = fq_reserve (ct->xmit[lane], (unsigned char**)&item)) ==
+		       FQ_ITEM_DISCARDED)
+	    condition_wait (&uct->recv_cond, &uct->recv_lock);
+	ct->xmit_full = 0;
+	release_lock (&uct->recv_lock);
+    }
+
+    if (rv == FQ_OK) {
+	item->queued_ns = now_ns ();
+	len = (pkt_seal (item->packet, packet,
+			 EPOCH_EXTEND (ct->epoch, PKT_EPOCH (packet))) +
+	       offsetof (xmit_item_t, packet));
+	if ((rv = fq_commit (ct->xmit[lane], len, &sched_cond,
+			     &sched_lock)) != FQ_OK) {
+	    fq_error ("fq_commit failed in xmit_frame", rv);
+	    exit (EXIT_PANIC);
+	}
+	return 0;
+    }
+    if (rv != FQ_ITEM_DISCARDED) {
+	fq_error ("fq_reserve failed in xmit_frame", rv);
+	exit (EXIT_PANIC);
+    }
+    (void)__atomic_fetch_add (&ct->sched[lane].drops, 1, __ATOMIC_RELAXED);
+    return -1;
+}
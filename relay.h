@@ -46,21 +46,93 @@ extern "C" {
 enum {EXIT_NORMAL, EXIT_ABNORMAL, EXIT_PARSE_OPTS, EXIT_PANIC};
 
 #define MAX_PKT_LEN    256  /* limit on UDP packet length                */
+#define MAX_RECV_LEN   (MAX_PKT_LEN + 8)  /* frame with its session ID   */
+#define MAX_WIRE_LEN   (MAX_RECV_LEN + 3) /* with a CRC-32C trailer too  */
 #define MAX_CHANNELS   16   /* number of UDP channels supported in relay */
 
 #define RELAY_SERVER_PORT  4321   /* default relay target port             */
 #define WEB_SERVER_PORT    80     /* default forwarding target port (HTTP) */
-#define SERVER_QUEUE       10     /* target TCP listen queue parameter     */
+#define SERVER_QUEUE       1024   /* default target TCP listen queue
+				     (-q option)                          */
+#define MAX_ACCEPTORS      8      /* limit on accepting threads at the
+				     target (-t option)                   */
+#define ADMIT_QUEUE_LEN    64     /* default connections waiting for a
+				     channel at the target (-n option)    */
+#define ADMIT_WAIT_MS      10000  /* default limit on a connection's wait
+				     for a channel (ms; -d option)        */
+#define ADMIT_BUCKETS      8      /* admission wait histogram buckets     */
+#define ADMIT_REPORT_MS    1000   /* admission statistics interval (ms)   */
 #define TIMEOUT_IN_SECONDS 5      /* timeout for reference implementation  */
 
+#define LZ_BYPASS_MISSES   4      /* incompressible frames before bypass   */
+#define LZ_BYPASS_MIN      8      /* first bypass period (frames)          */
+#define LZ_BYPASS_MAX      256    /* limit on bypass period (frames)       */
+
+#define XMIT_QUEUE_LEN     32     /* data frames queued per channel        */
+#define ACK_QUEUE_LEN      64     /* ACKs queued per channel               */
+#define SCHED_QUANTUM      MAX_PKT_LEN  /* DRR quantum (bytes)             */
+#define MAX_CLASSES        8      /* traffic classes, including default    */
+#define CLASS_MIN_BURST    (4 * MAX_PKT_LEN)  /* least token bucket depth  */
+
+#define PROBE_INTERVAL_MS  200    /* window probe interval (milliseconds)  */
+#define TIMER_TICK_MS      1      /* resolution of channel timers (ms)     */
+#define TLP_MIN_MS         10     /* least tail-loss probe timeout (ms)    */
+
+#define INITIAL_WINDOW     32     /* frames sent before the first ACK, and
+				     least window allowed (frames)        */
+#define MAX_WINDOW         16384  /* limit on window (frames; -w option)   */
+#define SEQ10_MAX_WINDOW   512    /* largest window for which 10-bit
+				     sequence numbers are unambiguous     */
+#define DELIVER_BATCH      32     /* frames gathered for one writev        */
+#define RECV_QUEUE_LEN     256    /* frames queued from UDP per channel    */
+#define RECV_BATCH         32     /* datagrams taken by udp_receiver
+				     between wakeups                      */
+
+#define SEND_BUFFER_SIZE   (256 << 10)  /* default TCP read-ahead per
+					   channel (bytes; -b option)     */
+
+#define UDP_TRUESIZE       1024   /* socket memory charged per datagram    */
+#define UDP_BUFFER_SIZE    (MAX_CHANNELS * XMIT_QUEUE_LEN * UDP_TRUESIZE)
+				  /* least UDP socket send/receive buffer
+				     (bytes)                              */
+#define UDP_BUFFER_MAX     (16 << 20)  /* limit on tuned UDP buffers   */
+#define UDP_BUFFER_MS      100    /* traffic a UDP buffer should hold (ms) */
+#define UDP_MONITOR_MS     1000   /* UDP drop check and tuning interval    */
+#define UDP_SAMPLE_EVERY   64     /* datagrams between queue samples       */
+
+#define TX_RING_SLOTS      64     /* frames udp_sender may have in flight
+				     on its io_uring (power of two)       */
+#define TX_RING_BATCH      16     /* frames queued per io_uring submission */
+
+#define SHM_RING_LEN       4096   /* frames queued each way on a shared-
+				     memory link (power of two; -m option) */
+
+#define SPIN_MAX_US        1000000  /* limit on busy-poll spin (-s option) */
+#define SPIN_MIN_NS        1000   /* least spin after idle periods (ns)    */
+
+/* pause between checks while spinning */
+#if defined (__i386__) || defined (__x86_64__)
+#define CPU_RELAX() __builtin_ia32_pause ()
+#else
+#define CPU_RELAX() sched_yield ()
+#endif
+
 #define INFTIM -1   /*  BH  I added this Sept. 2009 */ 
 
+/* size of a cache line, the unit in which threads on different CPUs
+   share memory; data written by different threads should not share one */
+#define CACHE_LINE 64
+
+
+/* frame checksums (-k option); see pkt_seal */
+typedef enum {CHECKSUM_CRC8, CHECKSUM_CRC32C} checksum_t;
 
 /* possible modes for relay (both sides use the same code) */
 typedef enum {MODE_TCP_TARGET, MODE_TCP_FORWARD} relay_mode_t;
 
 /* flags used to synchronize channel activation and deactivation between
-   threads operating on the same channel */
+   threads operating on the same channel; each thread sets its flag once
+   it lets go of the connection */
 typedef enum {
     CLOSE_CHANNEL_NONE     = 0,
     CLOSE_CHANNEL_HELPER   = 1,
@@ -69,6 +141,15 @@ typedef enum {
     CLOSE_CHANNEL_ALL      = 7
 } channel_state_t;
 
+/* The channel state, the active flag, the helper's request and answer
+   flags and the connection flags are shared without locks, or read
+   outside the lock that guards them.  Stores are releases and loads
+   are acquires, so a thread that sees a new value also sees the writes
+   made before it, such as the file descriptor of a newly activated
+   channel. */
+#define CHANNEL_LOAD(field)    __atomic_load_n (&(field), __ATOMIC_ACQUIRE)
+#define CHANNEL_STORE(field,v) __atomic_store_n (&(field), (v), __ATOMIC_RELEASE)
+
 
 /* unidirectional UDP channel data (each TCP connection uses two) */
 typedef struct udp_channel_t udp_channel_t;
@@ -77,33 +158,307 @@ struct udp_channel_t {
     fq_t* recv;
     pthread_mutex_t recv_lock;
     pthread_cond_t recv_cond;
+    int fired;                 /* timers expired for tcp_sender, in
+				  udp[0] (see timer_id_t; under
+				  recv_lock)                              */
+} __attribute__ ((aligned (CACHE_LINE)));
+
+
+/* Index consulted by udp_receiver for every datagram (see udp_demux),
+   kept apart from the channel table so that a batch of datagrams reads
+   a few lines that no other thread writes often.  <epoch> copies each
+   channel's epoch, and <recv> the receive queue of each unidirectional
+   channel, in the order of udpchans. */
+typedef struct demux_t demux_t;
+struct demux_t {
+    unsigned long long epoch[MAX_CHANNELS];
+    fq_t* recv[2 * MAX_CHANNELS];
+} __attribute__ ((aligned (CACHE_LINE)));
+
+
+/* per-direction payload compression state and statistics for a channel */
+typedef struct lz_chan_t lz_chan_t;
+struct lz_chan_t {
+    lz_t* lz;                  /* LZ stream, or NULL if not compressing */
+    int misses;                /* consecutive incompressible frames     */
+    int skip;                  /* frames left to send without trying    */
+    int backoff;               /* length of next bypass period (frames) */
+    unsigned long plain_bytes; /* payload bytes before compression      */
+    unsigned long wire_bytes;  /* payload bytes carried in frames       */
+    unsigned long lz_frames;   /* frames carried compressed             */
+    unsigned long raw_frames;  /* frames carried uncompressed           */
+    unsigned long long codec_ns; /* time spent in LZ routines           */
+} __attribute__ ((aligned (CACHE_LINE)));
+
+
+/* A traffic class: connections accepted on port <port> (if non-zero)
+   from an address matching <addr> under <mask> belong to the class.
+   Class 0 is the default.  Data lanes of the class receive <weight> DRR
+   quanta per turn, and if <rate> is non-zero, the class as a whole is
+   limited to <rate> bytes per second by a token bucket of depth <burst>.
+   The bucket state is owned by the udp_sender thread. */
+typedef struct class_t class_t;
+struct class_t {
+    unsigned short port;     /* TCP listen port, or 0 for any          */
+    unsigned long addr;      /* client address (network order)         */
+    unsigned long mask;      /* significant bits of <addr>             */
+    int weight;              /* DRR quanta per turn                    */
+    unsigned long rate;      /* limit on data rate (bytes/s), or 0     */
+    unsigned long burst;     /* token bucket depth (bytes)             */
+    double tokens;           /* tokens in bucket (may go negative)     */
+    unsigned long long stamp_ns; /* time of last bucket refill         */
+    int window;              /* limit on frames in flight              */
+};
+
+
+/* a frame waiting in a transmit queue, with the time it was queued */
+typedef struct xmit_item_t xmit_item_t;
+struct xmit_item_t {
+    unsigned long long queued_ns;
+    unsigned char packet[MAX_WIRE_LEN];
+};
+
+
+/* per-lane transmit scheduler statistics for a channel; udp_sender
+   counts frames sent while the channel's threads count drops and clear
+   and report the lane, so all are read and written atomically */
+typedef struct sched_stats_t sched_stats_t;
+struct sched_stats_t {
+    unsigned long frames;      /* frames sent                        */
+    unsigned long long delay_ns; /* total time frames spent queued   */
+    unsigned long long max_ns; /* longest time a frame spent queued  */
+    unsigned long drops;       /* frames discarded with lane full    */
+    unsigned long throttled;   /* turns lost to the class rate limit */
+};
+
+
+/* send buffer occupancy statistics for a channel, sampled as each data
+   frame is cut */
+typedef struct sndbuf_stats_t sndbuf_stats_t;
+struct sndbuf_stats_t {
+    unsigned long samples;     /* frames cut                          */
+    unsigned long bytes;       /* total bytes held at those times     */
+    unsigned long peak;        /* most bytes held                     */
+    unsigned long full;        /* reads that left the buffer full     */
+};
+
+
+/* round-trip time and window tuning state for the sending direction of
+   a channel, owned by tcp_sender */
+typedef struct swp_tune_t swp_tune_t;
+struct swp_tune_t {
+    unsigned long samples;     /* RTT samples taken                      */
+    unsigned long long srtt_ns; /* smoothed RTT                          */
+    unsigned long long rttvar_ns; /* RTT variation                       */
+    unsigned long long min_rtt_ns; /* least RTT seen                     */
+    unsigned long long stamp_ns; /* start of current delivery interval   */
+    unsigned long delivered;   /* frames acknowledged in the interval    */
+    int limited;               /* window held back data in the interval  */
+    int window;                /* limit on frames in flight              */
+};
+
+
+/* tail-loss probe statistics for the sending direction of a channel */
+typedef struct rtx_stats_t rtx_stats_t;
+struct rtx_stats_t {
+    unsigned long probes;      /* tail-loss probes sent                  */
+    unsigned long probes_acked; /* probes answered before a timeout      */
+};
+
+
+/* timers kept for each channel on the shared timer wheel, all of which
+   belong to tcp_sender */
+typedef enum {
+    TIMER_PROBE,               /* window closed long enough to probe     */
+    TIMER_IDLE,                /* receiver silent with frames outstanding */
+    TIMER_TAIL_PROBE,          /* newest frame unacknowledged long enough
+				  to probe                                */
+    NUM_TIMERS
+} timer_id_t;
+#define TIMER_BIT(t) (1 << (t))
+
+
+/* a connection accepted at the relay target and waiting for a channel */
+typedef struct admit_t admit_t;
+struct admit_t {
+    int fd;                    /* the connection                         */
+    unsigned short port;       /* TCP port on which it was accepted      */
+    int traffic_class;         /* its traffic class (see class_of)       */
+    unsigned long long queued_ns; /* time it was accepted                */
+};
+
+
+/* admission statistics of the relay target since the last report,
+   shared by the acceptor threads under admit_lock.  Waits for a channel,
+   including those of connections given one at once, are counted in
+   hist[i] if shorter than 4^i ms, and in the last bucket if longer
+   still. */
+typedef struct admit_stats_t admit_stats_t;
+struct admit_stats_t {
+    unsigned long immediate;   /* connections given a channel at once    */
+    unsigned long waited;      /* connections given one after waiting    */
+    unsigned long shed_full;   /* connections closed with the queue full */
+    unsigned long shed_late;   /* connections closed after waiting too
+				  long                                   */
+    unsigned long long max_ns; /* longest wait for a channel             */
+    unsigned long hist[ADMIT_BUCKETS];
+    unsigned long long stamp_ns; /* time of last report                  */
+    int changed;               /* anything counted since then            */
+};
+
+
+/* connections made to the forwarding target, counted by the tcp_helper
+   threads, which see them complete, with atomic operations */
+typedef struct connect_stats_t connect_stats_t;
+struct connect_stats_t {
+    unsigned long connects;    /* connections established                */
+    unsigned long failures;    /* connections that failed                */
+    unsigned long long total_ns; /* time taken by those established      */
+    unsigned long long max_ns; /* longest time taken                     */
+};
+
+
+/* threads pinned to CPUs by the -a option, by role */
+typedef enum {
+    CPU_MAIN,                  /* main thread and other acceptors        */
+    CPU_UDP_RECEIVER,          /* udp_receiver                           */
+    CPU_UDP_SENDER,            /* udp_sender                             */
+    CPU_TIMER,                 /* timer_driver                           */
+    CPU_CHANNEL,               /* channel threads, spread over the CPUs  */
+    NUM_CPU_ROLES
+} cpu_role_t;
+
+
+/* busy-poll state of a thread (-s option): a thread that finds nothing
+   to do spins for up to <limit> before it blocks.  The limit doubles
+   (up to the -s time) each time work turns up within the -s time, and
+   halves (down to SPIN_MIN_NS) each time the thread waits longer. */
+typedef struct spin_t spin_t;
+struct spin_t {
+    unsigned long long start;  /* time spinning began (0 if not)         */
+    unsigned long long limit;  /* longest to spin before blocking (ns)   */
+    int blocked;               /* gave up spinning since <start>         */
+};
+
+
+/* statistics and buffer sizes of the shared UDP socket; the counters of
+   datagrams sent belong to udp_sender, all else to udp_receiver */
+typedef struct udp_stats_t udp_stats_t;
+struct udp_stats_t {
+    unsigned long rx;          /* datagrams received                     */
+    unsigned long tx;          /* datagrams sent                         */
+    unsigned long tx_errors;   /* sends that failed                      */
+    unsigned long discards;    /* datagrams discarded with the channel's
+				  receive queue full                     */
+    unsigned long rx_last;     /* datagrams received at last check       */
+    unsigned long tx_last;     /* datagrams sent at last check           */
+    unsigned long errors_last; /* failed sends at last check             */
+    unsigned long drops;       /* kernel receive drops at last check     */
+    unsigned long discards_last; /* queue discards at last check        */
+    unsigned long corrupt;     /* datagrams failing their checksum       */
+    unsigned long corrupt_last; /* failed checksums at last check        */
+    unsigned long malformed;   /* datagrams with impossible headers      */
+    unsigned long malformed_last; /* malformed datagrams at last check  */
+    unsigned long stale;       /* frames of past epochs                  */
+    unsigned long stale_last;  /* stale frames at last check             */
+    unsigned long missing;     /* frames missing at last check (sum over
+				  channels)                              */
+    unsigned long late;        /* frames arriving late at last check     */
+    unsigned long peak_queue;  /* most bytes queued in the socket in the
+				  current interval                       */
+    unsigned long long stamp_ns; /* time of last check                   */
+    int rcvbuf;                /* receive buffer size set (bytes)        */
+    int sndbuf;                /* send buffer size set (bytes)           */
 };
 
 
 /* TCP relay channel data */
 typedef struct channel_t channel_t;
 struct channel_t {
-    int epoch;  /* epoch number for channel; avoids confusion between
-		   reuses (same effect as TCP's WAIT_STATE, but not timed) */
+    /* Fields set when the channel is activated or released, and read by
+       every thread that serves it. */
+    unsigned long long epoch;  /* epoch number for channel; avoids
+		   confusion between reuses (same effect as TCP's
+		   WAIT_STATE, but not timed).  Frames carry its low byte,
+		   and with session IDs all of it. */
     int fd;     /* file descriptor for TCP connection */
-    int active; /* used to signal channel activation between main thread
-		   and tcp threads in relay target mode. */
-
-    pthread_t helper_id;   /* thread id for tcp_helper thread; needed to
-			      send signal to break out of poll call */
-
+    int active; /* set while the channel is in use; cleared only once
+		   the connection is closed and the epoch advanced, after
+		   which the channel may be activated again */
     channel_state_t channel_state;  /* deactivation synchronization state */
-    pthread_mutex_t channel_lock;   /* lock on channel_state variable     */
+    int wake_fd;               /* eventfd that wakes tcp_helper, which
+				  polls it with the TCP socket            */
+    int number;
+    int next_free;             /* next inactive channel on the free list
+				  at the target, plus one (0 for none)    */
+
+    /* Transmit lanes drained by the udp_sender thread: xmit[0] holds data
+       frames from tcp_sender, xmit[1] ACKs from tcp_receiver.  The traffic
+       class is set when the channel is activated, from the accepted
+       connection at the relay target and from the first data frame at
+       the forwarding end. */
+    fq_t* xmit[2];
+    int traffic_class;
 
-    int need_help;             /* condition: helper should read from TCP */
-    int has_data;              /* condition: data available on TCP       */
-    pthread_cond_t help;       /* helper condition variable              */
-    pthread_mutex_t help_lock; /* helper condition variable lock         */
+    /* Requests to tcp_helper and its answers, passed back and forth
+       between the helper and the other two channel threads. */
+    int need_help              /* condition: helper should read from TCP */
+	__attribute__ ((aligned (CACHE_LINE)));
+    int has_data;              /* condition: data available on TCP (under
+				  udp[0].recv_lock)                       */
+    int need_write;            /* condition: helper should await room to
+				  write to TCP                            */
+    int can_write;             /* condition: room to write to TCP (under
+				  udp[1].recv_lock)                       */
+    int connecting;            /* connection to the forwarding target in
+				  progress, until tcp_helper sees it
+				  complete                                */
+    unsigned long long connect_ns; /* time at which it began             */
+    int connect_failed;        /* set if it could not be started, or by
+				  tcp_helper if it failed, before closing
+				  the channel                             */
 
-    /* UDP channel 0 supports TCP send, UDP channel 1 supports TCP receive. */
+    /* UDP channel 0 supports TCP send, UDP channel 1 supports TCP receive.
+       Each begins a cache line of its own, as does each of the two
+       directions below. */
     udp_channel_t udp[2];
 
-    int number;
+    /* Compression follows the same convention: zip[0] compresses data
+       read from TCP, zip[1] expands data before it is written to TCP. */
+    lz_chan_t zip[2];
+
+    /* State of the sending direction, owned by tcp_sender.  xmit_full
+       (under udp[0].recv_lock) marks tcp_sender waiting for room in
+       xmit[0].  The send buffer statistics describe the occupancy of
+       the buffer in which tcp_sender holds data read ahead from TCP. */
+    swp_tune_t tune                  /* round-trip times measured from
+					ACKs, and the window they suggest */
+	__attribute__ ((aligned (CACHE_LINE)));
+    rtx_stats_t rtx;                 /* tail-loss probes and answers     */
+    sndbuf_stats_t sndbuf;
+    int xmit_full;
+
+    /* State of the receiving direction, owned by tcp_receiver: data
+       delivered in order but not yet taken by the (non-blocking) TCP
+       socket, frames skipped over by later frames, and first
+       transmissions that then filled such gaps. */
+    unsigned char* out
+	__attribute__ ((aligned (CACHE_LINE)));
+    int out_len;
+    int out_size;
+    unsigned long rx_missing;
+    unsigned long rx_late;
+
+    /* Transmit scheduler state, owned by udp_sender. */
+    int deficit
+	__attribute__ ((aligned (CACHE_LINE)));
+    sched_stats_t sched[2];
+
+    /* Timers of tcp_sender (see timer_id_t), linked into the shared
+       timer wheel.  An expired timer sets its bit in udp[0].fired and
+       wakes the thread. */
+    tw_timer_t timer[NUM_TIMERS]
+	__attribute__ ((aligned (CACHE_LINE)));
 };
 
 
@@ -117,32 +472,148 @@ xx ---------------------------------------------------------
    You'll need to add things like CRC and channel number and will
    probably want to expand the space of sequence numbers.
 
-   -------------------------------------------------------------------------------------------------------
-   | LAST(1b)/CHANNEL(4b)/ACK(1b)/SEQ_NUM(10b) | EPOCH(1B) | LENGTH(1B) | up to 251B of data | CRC-8(1B) |
-   -------------------------------------------------------------------------------------------------------
+   -------------------------------------------------------------------------------------------------------------------
+   | LAST(1b)/CHANNEL(4b)/ACK(1b)/SEQ_NUM(10b) | EPOCH(1B) | LENGTH(1B) | FLAGS(1B) | up to 250B of data | CRC-8(1B) |
+   -------------------------------------------------------------------------------------------------------------------
+
+   FLAGS describe the encoding of the data.  PKT_FLAG_LZ marks data
+   compressed by the sender's LZ stream for the channel, and
+   PKT_FLAG_LZ_RAW marks plaintext that is nonetheless part of that
+   stream (it was incompressible) and must be added to the receiver's
+   history.  Data with neither flag is plain and outside of any stream.
+   FLAGS also carry the traffic class of the channel (see class_t) so
+   that the forwarding end schedules its replies in the same class.
+   PKT_FLAG_PROBE marks a window probe, which carries no data and does
+   not use up its sequence number; the receiver just answers with an ACK.
+   PKT_FLAG_RETRANSMIT marks a frame sent again as a tail-loss probe.
+
+   Sequence numbers are 32 bits.  SEQ_NUM carries the low 10 bits, which
+   identify a frame as long as the window is at most SEQ10_MAX_WINDOW
+   frames: the receiver (or, for ACKs, the sender) takes the full number
+   closest to the one it expects.  With larger windows the sender sets
+   PKT_FLAG_SEQ32 and carries all 32 bits just after the data, leaving
+   246B for data; ACKs answer in the form of the frame acknowledged.
+
+   ----------------------------------------------------------------------------
+   | header (5B, FLAGS has PKT_FLAG_SEQ32) | up to 246B of data | SEQ(4B) | CRC-8(1B) |
+   ----------------------------------------------------------------------------
+
+   Frames are not padded: the checksum follows the data (and SEQ), and
+   covers the bytes before it, PKT_FRAME_LEN of them.  A frame is sent
+   with CRC-8 as above, or with CRC-32C (in network byte order) in place
+   of the CRC-8, making the datagram 3 bytes longer.  Receivers tell the
+   two apart by comparing the datagram length with PKT_FRAME_LEN, and
+   drop frames that fail their checksum.  Frames are held and queued
+   without their checksums.
+
+   -----------------------------------------------
+   | header, data and SEQ as above | CRC-32C(4B) |
+   -----------------------------------------------
+
+   EPOCH is the low byte of the channel's epoch, which advances each
+   time the channel is reused, and is compared modulo 256 with the
+   epoch expected.  A channel that is reused 128 times while a frame
+   is delayed would take that frame for a current one.  With session
+   IDs (-S option, or once the peer has sent them), frames carry all
+   64 bits of the epoch as a SESSION, in network byte order, between
+   the frame and its checksum, and epochs are compared in full.  A
+   receiver tells that a session is there from the datagram's length,
+   as for the checksum, and udp_receiver queues the frame with its
+   session, MAX_RECV_LEN bytes at most.
+
+   -----------------------------------------------------------------
+   | header, data and SEQ as above | SESSION(8B) | CRC-8 or CRC-32C |
+   -----------------------------------------------------------------
+
+   ACKs are cumulative: SEQ_NUM names the last frame written to TCP.
+   Their first two data bytes advertise the receive window, the number
+   of frames beyond that one which the sender may have outstanding.
+   An ACK may cover two in-order frames, but frames out of order,
+   duplicates and probes are acknowledged at once.
+*/
+#define PKT_HDR_LEN    5
+#define PKT_MAX_DATA   (MAX_PKT_LEN - PKT_HDR_LEN - 1)
+#define PKT_MAX_DATA32 (PKT_MAX_DATA - 4)
+#define PKT_SEQ32_OFS(p) (PKT_HDR_LEN + PKT_LENGTH (p))
+#define PKT_SESSION_LEN  8
+
+#define PKT_FLAG_LZ     0x01
+#define PKT_FLAG_LZ_RAW 0x02
+#define PKT_FLAG_CLASS(c) (((c) & 0x07) << 2)
+#define PKT_FLAG_PROBE  0x20
+#define PKT_FLAG_SEQ32  0x40
+#define PKT_FLAG_RETRANSMIT 0x80
 
-3*/
 #define PKT_IS_ACK(p)  ((p)[0] & 0x04)
 #define PKT_IS_LAST(p) ((p)[0] & 0x80)
-#define PKT_CHAN_NUM(p) ((int)((p)[0] & 0x7C))
+#define PKT_CHAN_NUM(p) ((int)(((p)[0] >> 3) & 0x0F))
 #define PKT_SEQ_NUM(p) ((int)(((p)[0] & 0x03) << 8)|((p)[1]))
 #define PKT_EPOCH(p)   ((int)((p)[2]))
 #define PKT_LENGTH(p)  ((int)((p)[3]))
+#define PKT_FLAGS(p)   ((int)((p)[4]))
+#define PKT_CLASS(p)   ((int)(((p)[4] >> 2) & 0x07))
+#define PKT_WINDOW(p)  ((int)(((p)[PKT_HDR_LEN] << 8) | (p)[PKT_HDR_LEN + 1]))
+#define PKT_SET_WINDOW(p,w)                      \
+{                                                \
+    (p)[PKT_HDR_LEN] = (((w) >> 8) & 0xFF);      \
+    (p)[PKT_HDR_LEN + 1] = ((w) & 0xFF);         \
+}
+#define PKT_DATA(p)    ((p) + PKT_HDR_LEN)
+#define PKT_DATA_ROOM(p) \
+	((PKT_FLAGS (p) & PKT_FLAG_SEQ32) ? PKT_MAX_DATA32 : PKT_MAX_DATA)
+/* the 32 bits in network byte order at <q> */
+#define PKT_BE32(q)                               \
+	(((unsigned int)(q)[0] << 24) | ((unsigned int)(q)[1] << 16) | \
+	 ((unsigned int)(q)[2] << 8) | (unsigned int)(q)[3])
+#define PKT_SEQ32(p)   PKT_BE32 ((p) + PKT_SEQ32_OFS (p))
+/* bytes in frame <p> before its checksum */
+#define PKT_FRAME_LEN(p) \
+	(PKT_SEQ32_OFS (p) + ((PKT_FLAGS (p) & PKT_FLAG_SEQ32) ? 4 : 0))
+/* whether <p>, <len> bytes as queued by udp_receiver, has its session */
+#define PKT_HAS_SESSION(p,len) ((len) == PKT_FRAME_LEN (p) + PKT_SESSION_LEN)
+#define PKT_SESSION(p)                            \
+	(((unsigned long long)PKT_BE32 ((p) + PKT_FRAME_LEN (p)) << 32) | \
+	 PKT_BE32 ((p) + PKT_FRAME_LEN (p) + 4))
+/* full sequence number of <p>, resolving 10 bits against <ref> */
+#define PKT_FULL_SEQ(p,ref) \
+	((PKT_FLAGS (p) & PKT_FLAG_SEQ32) ? PKT_SEQ32 (p) : \
+	 SEQ_EXTEND ((ref), PKT_SEQ_NUM (p)))
 /* The braces make the macro into a single compound command. */
-#define PKT_MAKE_HEADER(p,isAck,isLast,channel,seqNum,epoch,length)	\
+#define PKT_MAKE_HEADER(p,isAck,isLast,channel,seqNum,epoch,length,flags) \
 {                                                \
-    (p)[0] = (((isLast & 1) << 7) | ((isAck & 1) << 2) | ((channel & 0x0F) << 3) | (seqNum & 0x0300)); \
+    (p)[0] = (((isLast & 1) << 7) | ((isAck & 1) << 2) | ((channel & 0x0F) << 3) | ((seqNum >> 8) & 0x03)); \
     (p)[1] = (seqNum & 0x00FF);                 \
     (p)[2] = (epoch);				\
     (p)[3] = (length);                          \
-    (p)[255] = (calculate_crc8(p, 255) & 0xFF);	\
+    (p)[4] = (flags);                           \
+    if (((flags) & PKT_FLAG_SEQ32) != 0) {      \
+	(p)[PKT_SEQ32_OFS (p)] = (((seqNum) >> 24) & 0xFF);     \
+	(p)[PKT_SEQ32_OFS (p) + 1] = (((seqNum) >> 16) & 0xFF); \
+	(p)[PKT_SEQ32_OFS (p) + 2] = (((seqNum) >> 8) & 0xFF);  \
+	(p)[PKT_SEQ32_OFS (p) + 3] = ((seqNum) & 0xFF);         \
+    }                                           \
 }
+/* Mark a frame already built as sent again.  The checksum is added as
+   each frame is queued to be sent (see pkt_seal). */
+#define PKT_MARK_RETRANSMIT(p) ((p)[4] |= PKT_FLAG_RETRANSMIT)
 
-#define PKT_CRC(p) ((int)(p[255]))
-#define PREV_SEQ_NUM(n) (((n) + 0x3FF) & 0x3FF)
-#define NEXT_SEQ_NUM(n) (((n) + 0x01) & 0x3FF)
-#define EPOCH_IS_EARLIER(e,f) \
-	(((((unsigned)(f)) - ((unsigned)(e))) & 0xFF) <= 0x80)
+/* Sequence numbers are unsigned ints, compared modulo 2^32. */
+#define SEQ_NUM_MASK    0xFFFFFFFFU            /* sequence space - 1 */
+#define PREV_SEQ_NUM(n) ((unsigned int)((n) - 1))
+#define NEXT_SEQ_NUM(n) ((unsigned int)((n) + 1))
+#define SEQ_DIFF(a,b)   ((unsigned int)((b) - (a)))  /* frames from a to b */
+#define SEQ_BEFORE(a,b) ((int)((unsigned int)(a) - (unsigned int)(b)) < 0)
+/* the sequence number nearest <ref> with low 10 bits <s> */
+#define SEQ_EXTEND(ref,s) \
+	((unsigned int)(ref) + \
+	 (((((unsigned int)(s) - (unsigned int)(ref)) & 0x3FF) ^ 0x200) - 0x200))
+/* Epochs are unsigned long longs.  A frame without a session carries
+   only the low 8 bits, which are taken as the epoch nearest <ref>. */
+#define EPOCH_EXTEND(ref,e) \
+	((unsigned long long)(ref) + \
+	 (long long)((int)((((unsigned int)(e) - (unsigned int)(ref)) & 0xFF) ^ \
+			   0x80) - 0x80))
+#define EPOCH_BEFORE(a,b) ((long long)((a) - (b)) < 0)
 
 
 #ifdef  __cplusplus
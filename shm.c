@@ -0,0 +1,722 @@
+/*									tab:8
+ *
+ * shm.c - source file for the shared-memory link in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    shm.c
+ * History:
+ *		1
+ *		First written.
+ */
+
+#define _GNU_SOURCE   /* for memfd_create and accept4 */
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "shm.h"
+
+/*
+    The SHM module carries datagrams through shared memory.  See shm.h.
+
+    The shared memory holds a header, which the joining end checks, and
+    the two rings.  Ring 0 carries items from the end that created the
+    link to the end that joined it, and ring 1 the other way.  Each ring
+    has a control block, a length for each slot, and the slots.  As in
+    the FQ module, the reader owns the head and the writer the tail;
+    here they count items forever, and the slot is the count modulo the
+    (power of two) ring length, so that a ring can fill every slot.  The
+    head, tail and sleeping flag are on separate cache lines, so that
+    the two processes write different lines.
+
+    The indices are read with acquire and written with release ordering,
+    so that an item and its length are complete before the other end
+    sees it.  To sleep, the reader sets <sleeping>, then looks at the
+    tail once more; the writer advances the tail, then looks at
+    <sleeping>.  A full fence between the store and the load on each
+    side ensures that at least one of them sees the other's store, so
+    that the reader is never left asleep with an item waiting.
+
+    Each link also has one eventfd for each ring, on which its reader
+    sleeps.  The memory and the eventfds are passed to the joining end
+    as SCM_RIGHTS over the rendezvous socket.  A process-local link_t
+    describes the mapping; the sending thread reads the current one
+    through <link>, and the receiving thread replaces it when the end
+    that created it goes away.
+
+    The sending thread may still be using a link just replaced, so the
+    receiving thread keeps it on the <prev> list until it is safe to
+    free.  Each link is numbered in order of creation by <gen>, and the
+    sending thread stores in <sender_gen> the number of the link it is
+    about to use.  Once it has, any link with a lower number is no
+    longer in use, and the receiving thread frees it (see
+    reclaim_links).
+*/
+
+#define SHM_MAGIC       0x4D503353   /* "MP3S", marks an initialized link */
+#define SHM_CACHE_LINE  64           /* bytes per cache line              */
+#define SHM_BACKLOG     4            /* joins queued on rendezvous socket */
+#define SHM_RETRY_US    10000        /* wait before retrying rendezvous   */
+
+/* round <n> up to a whole number of cache lines */
+#define SHM_ALIGN(n) \
+	(((n) + SHM_CACHE_LINE - 1) & ~(size_t)(SHM_CACHE_LINE - 1))
+
+/* header at the start of the shared memory */
+typedef struct {
+    unsigned int magic;           /* SHM_MAGIC                            */
+    unsigned int ring_len;        /* items in each ring                   */
+    unsigned int item_len;        /* bytes allowed per item               */
+} shm_hdr_t;
+
+/* control block of a ring in shared memory */
+typedef struct {
+    unsigned int head;            /* next item to take; written by reader */
+    unsigned char pad0[SHM_CACHE_LINE - sizeof (unsigned int)];
+    unsigned int tail;            /* next slot to fill; written by writer */
+    unsigned char pad1[SHM_CACHE_LINE - sizeof (unsigned int)];
+    unsigned int sleeping;        /* reader waits on eventfd              */
+    unsigned char pad2[SHM_CACHE_LINE - sizeof (unsigned int)];
+} ring_ctl_t;
+
+/* one direction of a link, as mapped by this process */
+typedef struct {
+    ring_ctl_t* ctl;              /* control block                        */
+    int* length;                  /* length of item in each slot          */
+    unsigned char* data;          /* slots                                */
+    int efd;                      /* eventfd on which the reader sleeps   */
+} ring_t;
+
+/* a link, as mapped by this process */
+typedef struct link_t link_t;
+struct link_t {
+    void* mem;                    /* shared memory mapping                */
+    int mem_fd;                   /* memfd of the shared memory           */
+    int efd[2];                   /* eventfds of rings 0 and 1            */
+    ring_t tx;                    /* ring on which we send                */
+    ring_t rx;                    /* ring from which we receive           */
+    link_t* prev;                 /* link that this one replaced, until
+				     freed                                */
+    unsigned int gen;             /* number of link, from 1 upward        */
+};
+
+/* SHM structure definition */
+struct shm_t {
+    struct sockaddr_un addr;      /* rendezvous socket address            */
+    socklen_t addr_len;           /*   and its length                     */
+    unsigned int ring_len;        /* items in each ring                   */
+    unsigned int item_len;        /* bytes allowed per item               */
+    size_t ring_size;             /* bytes of shared memory per ring      */
+    size_t mem_len;               /* bytes of shared memory               */
+    int listen_fd;                /* rendezvous socket if we created the
+				     link, or -1                          */
+    int peer_fd;                  /* connection to other end, or -1       */
+    int joining;                  /* waiting on <peer_fd> for the link    */
+    link_t* link;                 /* current link                         */
+    unsigned int sender_gen;      /* number of link last used by sending
+				     thread, or 0                         */
+};
+
+
+static int accept_peer (shm_t* shm);
+static link_t* attach_link (shm_t* shm, int mem_fd, const int* efd,
+			    int side, int init);
+static void drop_peer (shm_t* shm);
+static void free_link (shm_t* shm, link_t* link);
+static void install_link (shm_t* shm, link_t* link);
+static link_t* new_link (shm_t* shm);
+static void reclaim_links (shm_t* shm);
+static int rendezvous (shm_t* shm);
+static void service (shm_t* shm, short listen_events, short peer_events);
+static shm_err_t take_link (shm_t* shm);
+
+
+/*
+   Accept a connection on the rendezvous socket of SHM <shm> and hand
+   it the current link.  The new peer replaces any earlier one.  Return
+   1 on success, 0 if the peer went away before it was given the link,
+   or -1 if accept failed.
+*/
+static int
+accept_peer (shm_t* shm)
+{
+    link_t* link = shm->link;
+    char ok = 1;
+    struct iovec iov = {&ok, 1};
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE (3 * sizeof (int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    int fd, fds[3] = {link->mem_fd, link->efd[0], link->efd[1]};
+
+    if ((fd = accept4 (shm->listen_fd, NULL, NULL, SOCK_CLOEXEC)) == -1)
+	return (errno == ECONNABORTED || errno == EINTR ? 0 : -1);
+
+    memset (&msg, 0, sizeof (msg));
+    memset (&ctl, 0, sizeof (ctl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof (ctl.buf);
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+    memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+    if (sendmsg (fd, &msg, MSG_NOSIGNAL) != 1) {
+	(void)close (fd);
+	return 0;
+    }
+
+    drop_peer (shm);
+    shm->peer_fd = fd;
+    return 1;
+}
+
+
+/*
+   Map the shared memory <mem_fd> of a link of SHM <shm>, with eventfds
+   <efd> for its two rings, and return a new link_t for it, or NULL
+   (with errno set) on failure.  The end that created the link is
+   <side> 0, and sends on ring 0; the end that joined it is <side> 1.
+   If <init> is set, the memory is new, and is set up.  The link_t
+   takes the descriptors.
+*/
+static link_t*
+attach_link (shm_t* shm, int mem_fd, const int* efd, int side, int init)
+{
+    link_t* link;
+    unsigned char* base;
+    ring_t* ring;
+    shm_hdr_t* hdr;
+    int k;
+
+    if ((link = malloc (sizeof (link_t))) == NULL)
+	return NULL;
+    if ((link->mem = mmap (NULL, shm->mem_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, mem_fd, 0)) == MAP_FAILED) {
+	free (link);
+	return NULL;
+    }
+    link->mem_fd = mem_fd;
+    link->efd[0] = efd[0];
+    link->efd[1] = efd[1];
+    link->prev = NULL;
+    link->gen = 0;
+
+    for (k = 0; k < 2; k++) {
+	ring = (k == side ? &link->tx : &link->rx);
+	base = ((unsigned char*)link->mem + SHM_CACHE_LINE +
+		k * shm->ring_size);
+	ring->ctl = (ring_ctl_t*)base;
+	ring->length = (int*)(base + sizeof (ring_ctl_t));
+	ring->data = (base + sizeof (ring_ctl_t) +
+		      SHM_ALIGN (shm->ring_len * sizeof (int)));
+	ring->efd = efd[k];
+    }
+
+    /* A new memfd is zero-filled, so only the header needs writing. */
+    if (init) {
+	hdr = link->mem;
+	hdr->ring_len = shm->ring_len;
+	hdr->item_len = shm->item_len;
+	__atomic_store_n (&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    return link;
+}
+
+
+/*
+   Close the connection of SHM <shm> to the other end, if any.
+*/
+static void
+drop_peer (shm_t* shm)
+{
+    if (shm->peer_fd != -1)
+	(void)close (shm->peer_fd);
+    shm->peer_fd = -1;
+    shm->joining = 0;
+}
+
+
+/*
+   Unmap link <link> of SHM <shm>, close its descriptors, and free it.
+*/
+static void
+free_link (shm_t* shm, link_t* link)
+{
+    (void)munmap (link->mem, shm->mem_len);
+    (void)close (link->mem_fd);
+    (void)close (link->efd[0]);
+    (void)close (link->efd[1]);
+    free (link);
+}
+
+
+/*
+   Make <link> the current link of SHM <shm>, numbering it after the
+   link that it replaces, which is kept until the sending thread has
+   moved on (see reclaim_links).
+*/
+static void
+install_link (shm_t* shm, link_t* link)
+{
+    link->prev = shm->link;
+    link->gen = (shm->link == NULL ? 1 : shm->link->gen + 1);
+    __atomic_store_n (&shm->link, link, __ATOMIC_RELEASE);
+}
+
+
+/*
+   Create the shared memory and eventfds of a new link for SHM <shm>,
+   and return a link_t for it, or NULL (with errno set) on failure.
+*/
+static link_t*
+new_link (shm_t* shm)
+{
+    int mem_fd, efd[2] = {-1, -1}, err;
+    link_t* link = NULL;
+
+    if ((mem_fd = memfd_create ("mp3-relay-link", MFD_CLOEXEC)) == -1)
+	return NULL;
+    if (ftruncate (mem_fd, shm->mem_len) == 0 &&
+	(efd[0] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) != -1 &&
+	(efd[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) != -1 &&
+	(link = attach_link (shm, mem_fd, efd, 0, 1)) != NULL)
+	return link;
+
+    err = errno;
+    (void)close (mem_fd);
+    if (efd[0] != -1)
+	(void)close (efd[0]);
+    if (efd[1] != -1)
+	(void)close (efd[1]);
+    errno = err;
+    return NULL;
+}
+
+
+/*
+   Free the links of SHM <shm> that were replaced before the one that
+   the sending thread last used.  The acquire pairs with the release in
+   shm_send, so that the sending thread is done with them.
+*/
+static void
+reclaim_links (shm_t* shm)
+{
+    unsigned int used = __atomic_load_n (&shm->sender_gen, __ATOMIC_ACQUIRE);
+    link_t* keep;
+    link_t* link;
+
+    for (keep = shm->link; keep->prev != NULL && keep->prev->gen >= used;
+	 keep = keep->prev);
+    while ((link = keep->prev) != NULL) {
+	keep->prev = link->prev;
+	free_link (shm, link);
+    }
+}
+
+
+/*
+   Meet the other end of SHM <shm> at the rendezvous socket.  If no one
+   holds the socket, take it and create a new link, which becomes the
+   current one; peers that connect later are given it (see
+   accept_peer).  Otherwise, connect to the end holding the socket,
+   which will send its link (see take_link).  Return 1 on success, 0 if
+   the attempt should be retried shortly, or -1 (with errno set) on
+   failure.
+*/
+static int
+rendezvous (shm_t* shm)
+{
+    int fd, err;
+    link_t* link;
+
+    if ((fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+	return -1;
+
+    if (bind (fd, (struct sockaddr*)&shm->addr, shm->addr_len) == 0) {
+	if (listen (fd, SHM_BACKLOG) == -1 || (link = new_link (shm)) == NULL) {
+	    err = errno;
+	    (void)close (fd);
+	    errno = err;
+	    return -1;
+	}
+	shm->listen_fd = fd;
+	install_link (shm, link);
+	return 1;
+    }
+
+    /* A refused connection means that the holder of the socket has not
+       yet called listen, or has just closed it. */
+    if (errno == EADDRINUSE &&
+	connect (fd, (struct sockaddr*)&shm->addr, shm->addr_len) == 0) {
+	shm->peer_fd = fd;
+	shm->joining = 1;
+	return 1;
+    }
+    err = errno;
+    (void)close (fd);
+    errno = err;
+    return (err == EADDRINUSE || err == ECONNREFUSED ? 0 : -1);
+}
+
+
+/*
+   Deal with events on the rendezvous socket (<listen_events>) and the
+   connection to the other end (<peer_events>) of SHM <shm>: accept a
+   new peer, take the link from the end that created it, or notice that
+   the other end has gone.  If the end that created our link has gone,
+   meet the next one (see rendezvous).
+*/
+static void
+service (shm_t* shm, short listen_events, short peer_events)
+{
+    if (listen_events != 0)
+	(void)accept_peer (shm);
+
+    if (peer_events != 0) {
+	if (!shm->joining || take_link (shm) != SHM_OK)
+	    drop_peer (shm);
+    }
+
+    if (shm->listen_fd == -1 && shm->peer_fd == -1)
+	(void)rendezvous (shm);
+}
+
+
+/*
+   Receive the link sent by the end that created it over the connection
+   of SHM <shm>, and make it the current link.  Possible return values
+   and meanings include:
+     SHM_OK                 success
+     SHM_BAD_PARAMETER      the link's sizes differ from ours
+     SHM_OUT_OF_MEMORY      inadequate memory to map the link
+     SHM_SYSCALL_FAILED     no link was received (see errno)
+*/
+static shm_err_t
+take_link (shm_t* shm)
+{
+    char ok;
+    struct iovec iov = {&ok, 1};
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE (3 * sizeof (int))];
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    shm_hdr_t* hdr;
+    link_t* link;
+    int fds[3], k;
+
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof (ctl.buf);
+    if (recvmsg (shm->peer_fd, &msg, MSG_CMSG_CLOEXEC) != 1 ||
+	(cmsg = CMSG_FIRSTHDR (&msg)) == NULL ||
+	cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	cmsg->cmsg_len != CMSG_LEN (sizeof (fds))) {
+	errno = ECONNRESET;
+	return SHM_SYSCALL_FAILED;
+    }
+    memcpy (fds, CMSG_DATA (cmsg), sizeof (fds));
+
+    if ((link = attach_link (shm, fds[0], fds + 1, 1, 0)) == NULL) {
+	for (k = 0; k < 3; k++)
+	    (void)close (fds[k]);
+	return SHM_OUT_OF_MEMORY;
+    }
+    hdr = link->mem;
+    if (__atomic_load_n (&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+	hdr->ring_len != shm->ring_len || hdr->item_len != shm->item_len) {
+	free_link (shm, link);
+	return SHM_BAD_PARAMETER;
+    }
+
+    shm->joining = 0;
+    install_link (shm, link);
+    return SHM_OK;
+}
+
+
+/*
+   Create or join the link named <name>, with rings holding <ring_len>
+   items (a power of two) of up to <item_len> bytes, and wait until the
+   other end has attached.  Both ends must pass the same sizes.
+   Possible return values and meanings include:
+     SHM_OK                 success; <new_shm> points to a pointer to
+				 the new SHM
+     SHM_BAD_PARAMETER      one or mores parameters passed were invalid,
+				 or the peer's sizes differ
+     SHM_OUT_OF_MEMORY      inadequate memory to create SHM requested
+     SHM_SYSCALL_FAILED     the link could not be set up (see errno)
+*/
+shm_err_t
+shm_create (shm_t** new_shm, const char* name, int ring_len, int item_len)
+{
+    shm_t* shm;
+    shm_err_t err;
+    int rv;
+
+    /* Check parameters. */
+    if (new_shm == NULL || name == NULL ||
+	strlen (name) + 1 > sizeof (shm->addr.sun_path) ||
+	ring_len < 1 || ring_len > SHM_MAX_RING_LEN ||
+	(ring_len & (ring_len - 1)) != 0 ||
+	item_len < 1 || item_len > SHM_MAX_ITEM_LEN)
+	return SHM_BAD_PARAMETER;
+
+    if ((shm = malloc (sizeof (shm_t))) == NULL)
+	return SHM_OUT_OF_MEMORY;
+
+    /* The name goes in the abstract namespace: a leading null byte,
+       and no terminating one. */
+    memset (&shm->addr, 0, sizeof (shm->addr));
+    shm->addr.sun_family = AF_UNIX;
+    memcpy (shm->addr.sun_path + 1, name, strlen (name));
+    shm->addr_len = offsetof (struct sockaddr_un, sun_path) + 1 + strlen (name);
+
+    shm->ring_len = ring_len;
+    shm->item_len = item_len;
+    shm->ring_size = (sizeof (ring_ctl_t) + SHM_ALIGN (ring_len * sizeof (int)) +
+		      SHM_ALIGN ((size_t)ring_len * item_len));
+    shm->mem_len = SHM_CACHE_LINE + 2 * shm->ring_size;
+    shm->listen_fd = -1;
+    shm->peer_fd = -1;
+    shm->joining = 0;
+    shm->link = NULL;
+    shm->sender_gen = 0;
+
+    /* Wait for the other end: the first to arrive waits for a peer to
+       accept, and the second for the link. */
+    while (1) {
+	if ((rv = rendezvous (shm)) == -1) {
+	    err = SHM_SYSCALL_FAILED;
+	    break;
+	}
+	if (rv == 0) {
+	    usleep (SHM_RETRY_US);
+	    continue;
+	}
+	if (shm->listen_fd != -1) {
+	    while ((rv = accept_peer (shm)) == 0);
+	    err = (rv == 1 ? SHM_OK : SHM_SYSCALL_FAILED);
+	    break;
+	}
+	if ((err = take_link (shm)) != SHM_SYSCALL_FAILED)
+	    break;
+	drop_peer (shm);
+    }
+
+    if (err != SHM_OK) {
+	(void)shm_destroy (shm);
+	return err;
+    }
+    *new_shm = shm;
+    return SHM_OK;
+}
+
+
+/*
+   Send the <len> bytes at <buf> to the other end of SHM <shm>, waking
+   it if it is asleep.  Possible return values and meanings include:
+     SHM_OK                 success
+     SHM_BAD_PARAMETER      one or mores parameters passed were invalid
+     SHM_RING_FULL          not sent (ring full)
+*/
+shm_err_t
+shm_send (shm_t* shm, const void* buf, int len)
+{
+    link_t* link;
+    ring_t* ring;
+    unsigned int tail, slot;
+
+    /* Check parameters. */
+    if (shm == NULL || buf == NULL || len < 0 || len > shm->item_len)
+	return SHM_BAD_PARAMETER;
+
+    /* Say that earlier links are no longer in use (see reclaim_links).
+       Only this thread writes <sender_gen>, and it does so only when
+       the link changes. */
+    link = __atomic_load_n (&shm->link, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n (&shm->sender_gen, __ATOMIC_RELAXED) != link->gen)
+	__atomic_store_n (&shm->sender_gen, link->gen, __ATOMIC_RELEASE);
+    ring = &link->tx;
+    tail = ring->ctl->tail;
+    if (tail - __atomic_load_n (&ring->ctl->head, __ATOMIC_ACQUIRE) >=
+	shm->ring_len)
+	return SHM_RING_FULL;
+
+    slot = tail & (shm->ring_len - 1);
+    memcpy (ring->data + (size_t)slot * shm->item_len, buf, len);
+    ring->length[slot] = len;
+    __atomic_store_n (&ring->ctl->tail, tail + 1, __ATOMIC_RELEASE);
+
+    /* Wake the reader if it has said that it is going to sleep. */
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&ring->ctl->sleeping, __ATOMIC_RELAXED))
+	(void)eventfd_write (ring->efd, 1);
+
+    return SHM_OK;
+}
+
+
+/*
+   Receive an item from SHM <shm> into the buffer <buf>.  The <buf_len>
+   is a value-result argument that specifies the amount of buffer space
+   available and returns the amount written on success.  If the ring is
+   empty, wait up to <wait_ms> milliseconds (0 not to wait) for an item.
+   An item that does not fit is dropped.  Possible return values and
+   meanings include:
+     SHM_OK                 success
+     SHM_BAD_PARAMETER      one or mores parameters passed were invalid
+     SHM_RING_EMPTY         nothing received (ring empty)
+     SHM_INADEQUATE_SPACE   buffer too small for next item (dropped)
+*/
+shm_err_t
+shm_recv (shm_t* shm, void* buf, int* buf_len, int wait_ms)
+{
+    ring_t* ring = NULL;
+    struct pollfd pfds[3];
+    unsigned int head, slot;
+    eventfd_t trash;
+    short listen_events, peer_events;
+    int len, n, waited = 0;
+
+    /* Check parameters. */
+    if (shm == NULL || buf == NULL || buf_len == NULL || *buf_len < 0)
+	return SHM_BAD_PARAMETER;
+
+    /* Only this thread replaces the link, so it can be read plainly. */
+    if (shm->link->prev != NULL)
+	reclaim_links (shm);
+    while (1) {
+	ring = &shm->link->rx;
+	head = ring->ctl->head;
+	if (head != __atomic_load_n (&ring->ctl->tail, __ATOMIC_ACQUIRE))
+	    break;
+	if (waited || wait_ms == 0)
+	    return SHM_RING_EMPTY;
+
+	/* Say that we are going to sleep, then look once more. */
+	__atomic_store_n (&ring->ctl->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	if (head != __atomic_load_n (&ring->ctl->tail, __ATOMIC_ACQUIRE)) {
+	    __atomic_store_n (&ring->ctl->sleeping, 0, __ATOMIC_RELAXED);
+	    break;
+	}
+
+	/* Sleep until woken, and watch the rendezvous socket and the
+	   other end meanwhile.  With the ring busy, the reader rarely
+	   sleeps, but a peer that comes or goes leaves it empty for a
+	   while, and then it does. */
+	n = 0;
+	pfds[n].fd = ring->efd;
+	pfds[n++].events = POLLIN;
+	if (shm->listen_fd != -1) {
+	    pfds[n].fd = shm->listen_fd;
+	    pfds[n++].events = POLLIN;
+	}
+	if (shm->peer_fd != -1) {
+	    pfds[n].fd = shm->peer_fd;
+	    pfds[n++].events = POLLIN;
+	}
+	n = poll (pfds, n, wait_ms);
+	__atomic_store_n (&ring->ctl->sleeping, 0, __ATOMIC_RELAXED);
+	(void)eventfd_read (ring->efd, &trash);
+	waited = 1;
+
+	if (n > 0) {
+	    n = 1;
+	    listen_events = peer_events = 0;
+	    if (shm->listen_fd != -1)
+		listen_events = pfds[n++].revents;
+	    if (shm->peer_fd != -1)
+		peer_events = pfds[n].revents;
+	    service (shm, listen_events, peer_events);
+	} else if (shm->listen_fd == -1 && shm->peer_fd == -1)
+	    service (shm, 0, 0);
+    }
+
+    /* A length beyond the slot can only come from a broken peer; the
+       item is dropped either way. */
+    slot = head & (shm->ring_len - 1);
+    len = ring->length[slot];
+    if (len < 0 || len > shm->item_len || len > *buf_len) {
+	__atomic_store_n (&ring->ctl->head, head + 1, __ATOMIC_RELEASE);
+	return SHM_INADEQUATE_SPACE;
+    }
+    memcpy (buf, ring->data + (size_t)slot * shm->item_len, len);
+    *buf_len = len;
+    __atomic_store_n (&ring->ctl->head, head + 1, __ATOMIC_RELEASE);
+
+    return SHM_OK;
+}
+
+
+/*
+   Destroy the SHM <shm>, detaching from the other end, and free all
+   memory associated with it.  Possible return values and meanings
+   include:
+     SHM_OK                 success
+     SHM_BAD_PARAMETER      parameter passed was invalid
+*/
+shm_err_t
+shm_destroy (shm_t* shm)
+{
+    link_t* link;
+
+    /* Check parameters. */
+    if (shm == NULL)
+	return SHM_BAD_PARAMETER;
+
+    drop_peer (shm);
+    if (shm->listen_fd != -1)
+	(void)close (shm->listen_fd);
+    while ((link = shm->link) != NULL) {
+	shm->link = link->prev;
+	free_link (shm, link);
+    }
+    free (shm);
+
+    return SHM_OK;
+}
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void
+shm_error (const char* msg, shm_err_t err)
+{
+    static const char* const shm_err_str[SHM_NO_SUCH_ERR] = {
+	"no error reported",
+	"bad parameter passed to SHM function",
+	"memory allocation failed",
+	"shared-memory link could not be set up",
+	"ring full",
+	"ring empty",
+	"buffer too small for next item",
+    };
+
+    if (msg == NULL)
+	fputs ("NULL message passed to shm_error.\n", stderr);
+    else if (err < 0 || err >= SHM_NO_SUCH_ERR)
+	fprintf (stderr, "%s: invalid error code passed to shm_error.\n", msg);
+    else
+	fprintf (stderr, "%s: %s\n", msg, shm_err_str[err]);
+}
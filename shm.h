@@ -0,0 +1,127 @@
+/*									tab:8
+ *
+ * shm.h - header file for the shared-memory link in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    shm.h
+ * History:
+ *		1
+ *		First written.
+ */
+
+#if !defined (SHM_H)
+#define SHM_H
+
+/*
+    The SHM module carries datagrams between two processes on the same
+    host through shared memory, in place of a UDP socket.  SHM stands for
+    Shared-Memory link.  The link has two rings, one in each direction,
+    laid out like FQ queues (fixed-size items, with a length for each)
+    in memory that both processes map.  Each ring has one writer and one
+    reader, and neither takes a lock or makes a system call while the
+    ring has room and items to take.  A reader with nothing to take
+    sleeps on an eventfd, which the writer writes only if the reader has
+    said that it is asleep.
+
+    Like a datagram socket, a link is unreliable: an item that finds its
+    ring full is dropped, and items written while no peer is attached
+    wait in the ring (or are dropped) and reach the next peer to attach.
+
+    The two ends meet through a UNIX socket in the abstract namespace,
+    named by the caller.  The first end to arrive creates the shared
+    memory and the eventfds, and hands them to the other over the socket
+    (and again to each peer that attaches later, such as a restarted
+    one).  If the end that created the link goes away, the other creates
+    or joins a new link the next time it waits for an item.  Memory of
+    a link replaced in this way is released once the sending thread has
+    sent on the new one.
+
+    An SHM supports one sending thread and one receiving thread at a
+    time; higher levels of concurrency are not supported.
+*/
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+typedef struct shm_t shm_t;       /* opaque shared-memory link structure     */
+
+typedef enum {                    /* error messages defined by SHM module    */
+    SHM_OK = 0,                   /* operation suceeded                      */
+    SHM_BAD_PARAMETER,            /* bad parameter passed to SHM routine     */
+    SHM_OUT_OF_MEMORY,            /* memory allocation failed                */
+    SHM_SYSCALL_FAILED,           /* a system call failed (see errno)        */
+    SHM_RING_FULL,                /* not sent (ring full)                    */
+    SHM_RING_EMPTY,               /* nothing received (ring empty)           */
+    SHM_INADEQUATE_SPACE,         /* buffer too small for next item          */
+    SHM_NO_SUCH_ERR               /* limit on possible error codes           */
+} shm_err_t;
+
+/* most items allowed in each ring, and longest item allowed */
+#define SHM_MAX_RING_LEN 65536
+#define SHM_MAX_ITEM_LEN 65536
+
+
+/*
+   Create or join the link named <name>, with rings holding <ring_len>
+   items (a power of two) of up to <item_len> bytes, and wait until the
+   other end has attached.  Both ends must pass the same sizes.
+   Possible return values and meanings include:
+     SHM_OK                 success; <new_shm> points to a pointer to
+				 the new SHM
+     SHM_BAD_PARAMETER      one or mores parameters passed were invalid,
+				 or the peer's sizes differ
+     SHM_OUT_OF_MEMORY      inadequate memory to create SHM requested
+     SHM_SYSCALL_FAILED     the link could not be set up (see errno)
+*/
+shm_err_t shm_create (shm_t** new_shm, const char* name, int ring_len,
+		      int item_len);
+
+
+/*
+   Send the <len> bytes at <buf> to the other end of SHM <shm>, waking
+   it if it is asleep.  Possible return values and meanings include:
+     SHM_OK                 success
+     SHM_BAD_PARAMETER      one or mores parameters passed were invalid
+     SHM_RING_FULL          not sent (ring full)
+*/
+shm_err_t shm_send (shm_t* shm, const void* buf, int len);
+
+
+/*
+   Receive an item from SHM <shm> into the buffer <buf>.  The <buf_len>
+   is a value-result argument that specifies the amount of buffer space
+   available and returns the amount written on success.  If the ring is
+   empty, wait up to <wait_ms> milliseconds (0 not to wait) for an item.
+   An item that does not fit is dropped.  Possible return values and
+   meanings include:
+     SHM_OK                 success
+     SHM_BAD_PARAMETER      one or mores parameters passed were invalid
+     SHM_RING_EMPTY         nothing received (ring empty)
+     SHM_INADEQUATE_SPACE   buffer too small for next item (dropped)
+*/
+shm_err_t shm_recv (shm_t* shm, void* buf, int* buf_len, int wait_ms);
+
+
+/*
+   Destroy the SHM <shm>, detaching from the other end, and free all
+   memory associated with it.  Possible return values and meanings
+   include:
+     SHM_OK                 success
+     SHM_BAD_PARAMETER      parameter passed was invalid
+*/
+shm_err_t shm_destroy (shm_t* shm);
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void shm_error (const char* msg, shm_err_t err);
+
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* SHM_H */
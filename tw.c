@@ -0,0 +1,455 @@
+/*									tab:8
+ *
+ * tw.c - source file for timer wheel abstraction in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    tw.c
+ * History:
+ *		1
+ *		First written.
+ */
+
+#include <pthread.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tw.h"
+
+/*
+    The TW module keeps timers for all channels.  See tw.h.
+
+    Ticks are counted in 64 bits from the creation of the wheel, so that
+    they do not wrap, and all ticks up to and including <now> have been
+    processed.  A pending timer that expires at tick <expires>, <delta>
+    ticks after <now>, sits on level <level>, the lowest for which
+    <delta> is less than 64^(<level> + 1), in slot <expires> / 64^<level>
+    modulo 64.  Slot <s> of a level above the first is moved down when
+    the ticks counted at that level next reach <s>, which is when the
+    first tick of its span begins.  Each slot is a list linked through
+    the timers, and each timer's <pprev> points to the link that points
+    to it, so a timer can be removed without finding its slot.  All fields are protected by the lock.
+*/
+
+
+/* size of the wheel: levels, and slots per level (a power of two) */
+#define TW_LEVELS    4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS     (1 << TW_SLOT_BITS)
+
+
+/* TW structure definition */
+struct tw_t {
+    unsigned long tick_ns;    /* length of tick (nanoseconds)             */
+    struct timespec origin;   /* time of tick 0 (CLOCK_MONOTONIC)         */
+    unsigned long long now;   /* last tick processed                      */
+    unsigned long long armed; /* tick for which timerfd is set (0 if not) */
+    int pending;              /* number of timers pending                 */
+    int fd;                   /* timerfd driving the wheel                */
+    uint64_t occupied[TW_LEVELS];           /* bitmap of non-empty slots  */
+    tw_timer_t* slot[TW_LEVELS][TW_SLOTS];  /* timers in each slot        */
+    pthread_mutex_t lock;     /* lock on all of the above                 */
+};
+
+
+/*
+   Return the time in nanoseconds since tick 0 of TW <tw>, or -1 with
+   errno set if the clock cannot be read.
+*/
+static long long
+elapsed_ns (tw_t* tw)
+{
+    struct timespec ts;
+
+    if (clock_gettime (CLOCK_MONOTONIC, &ts) == -1)
+	return -1;
+    return ((ts.tv_sec - tw->origin.tv_sec) * 1000000000LL +
+	    (ts.tv_nsec - tw->origin.tv_nsec));
+}
+
+
+/*
+   Link pending timer <timer> into the slot of TW <tw> that suits its
+   expiry tick.  A timer that has already expired goes into the slot of
+   the current tick, to be run with it, and one too far off goes as far
+   as the wheel reaches, to be placed again when that slot is moved.
+*/
+static void
+link_timer (tw_t* tw, tw_timer_t* timer)
+{
+    unsigned long long delta, expires = timer->expires;
+    int level, slot;
+
+    if (expires < tw->now)
+	expires = tw->now;
+    delta = expires - tw->now;
+    if (delta > TW_MAX_TICKS)
+	expires = tw->now + (delta = TW_MAX_TICKS);
+    for (level = 0; level < TW_LEVELS - 1 &&
+		    delta >= (1UL << (TW_SLOT_BITS * (level + 1))); level++);
+    slot = (expires >> (TW_SLOT_BITS * level)) & (TW_SLOTS - 1);
+
+    if ((timer->next = tw->slot[level][slot]) != NULL)
+	timer->next->pprev = &timer->next;
+    tw->slot[level][slot] = timer;
+    timer->pprev = &tw->slot[level][slot];
+    tw->occupied[level] |= ((uint64_t)1 << slot);
+}
+
+
+/*
+   Unlink pending timer <timer> from its slot of TW <tw>, noting whether
+   the slot is now empty.  A timer is first in its slot if its <pprev>
+   points into the table of slots.
+*/
+static void
+unlink_timer (tw_t* tw, tw_timer_t* timer)
+{
+    long idx = timer->pprev - &tw->slot[0][0];
+
+    if ((*timer->pprev = timer->next) != NULL)
+	timer->next->pprev = timer->pprev;
+    else if (idx >= 0 && idx < TW_LEVELS * TW_SLOTS)
+	tw->occupied[idx / TW_SLOTS] &= ~((uint64_t)1 << (idx % TW_SLOTS));
+    timer->pprev = NULL;
+}
+
+
+/*
+   Take the list of timers out of slot <slot> on level <level> of TW
+   <tw>, leaving the slot empty, and return it.
+*/
+static tw_timer_t*
+take_slot (tw_t* tw, int level, int slot)
+{
+    tw_timer_t* list = tw->slot[level][slot];
+
+    tw->slot[level][slot] = NULL;
+    tw->occupied[level] &= ~((uint64_t)1 << slot);
+    return list;
+}
+
+
+/*
+   Process tick <tick>, the one after the last processed, on TW <tw>: move
+   down the timers of any higher slots whose spans begin with the tick,
+   then run the timers that expire at it.
+*/
+static void
+process_tick (tw_t* tw, unsigned long long tick)
+{
+    tw_timer_t* list;
+    tw_timer_t* timer;
+    int level, slot;
+
+    tw->now = tick;
+    for (level = 1; level < TW_LEVELS; level++) {
+	if ((tick & ((1UL << (TW_SLOT_BITS * level)) - 1)) != 0)
+	    break;
+	slot = (tick >> (TW_SLOT_BITS * level)) & (TW_SLOTS - 1);
+	for (list = take_slot (tw, level, slot); (timer = list) != NULL; ) {
+	    list = timer->next;
+	    link_timer (tw, timer);
+	}
+    }
+
+    for (list = take_slot (tw, 0, tick & (TW_SLOTS - 1));
+	 (timer = list) != NULL; ) {
+	list = timer->next;
+	timer->pprev = NULL;
+	tw->pending--;
+	timer->func (timer, timer->arg);
+    }
+}
+
+
+/*
+   Return the first tick after the last processed at which TW <tw> has
+   anything to do: a first-level slot whose timers expire, or a higher
+   slot to be moved down.  Returns 0 if no timers are pending.
+*/
+static unsigned long long
+next_tick (tw_t* tw)
+{
+    unsigned long long best = 0, tick;
+    uint64_t bits;
+    int level, shift, from;
+
+    for (level = 0; level < TW_LEVELS; level++) {
+	if ((bits = tw->occupied[level]) == 0)
+	    continue;
+	/* Rotate the bitmap so that bit 0 is the slot after the one in
+	   progress, and find the first occupied slot from there. */
+	shift = TW_SLOT_BITS * level;
+	from = ((tw->now >> shift) + 1) & (TW_SLOTS - 1);
+	if (from != 0)
+	    bits = (bits >> from) | (bits << (TW_SLOTS - from));
+	tick = ((tw->now >> shift) + 1 + __builtin_ctzll (bits)) << shift;
+	if (best == 0 || tick < best)
+	    best = tick;
+    }
+    return best;
+}
+
+
+/*
+   Set the timerfd of TW <tw> to fire at tick <tick>, or disarm it if
+   <tick> is 0.  Returns 0 on success, or -1 with errno set on failure.
+*/
+static int
+set_clock (tw_t* tw, unsigned long long tick)
+{
+    struct itimerspec its;
+    unsigned long long ns;
+
+    memset (&its, 0, sizeof (its));
+    if (tick != 0) {
+	ns = tw->origin.tv_nsec + tick * tw->tick_ns;
+	its.it_value.tv_sec = tw->origin.tv_sec + ns / 1000000000ULL;
+	its.it_value.tv_nsec = ns % 1000000000ULL;
+    }
+    if (timerfd_settime (tw->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+	return -1;
+    tw->armed = tick;
+    return 0;
+}
+
+
+/*
+   Create a new TW with ticks of <tick_ns> nanoseconds.  Possible return
+   values and meanings include:
+     TW_OK                  success; <new_tw> points to a pointer to
+				 the new TW
+     TW_BAD_PARAMETER       one or mores parameters passed were invalid
+     TW_OUT_OF_MEMORY       inadequate memory to create TW requested
+     TW_CLOCK_FAILED        timerfd could not be created (see errno)
+*/
+tw_err_t
+tw_create (tw_t** new_tw, unsigned long tick_ns)
+{
+    tw_t* tw;
+
+    /* Check parameters. */
+    if (new_tw == NULL || tick_ns == 0)
+	return TW_BAD_PARAMETER;
+
+    /* Allocate necessary memory. */
+    if ((tw = calloc (1, sizeof (tw_t))) == NULL)
+	return TW_OUT_OF_MEMORY;
+
+    if (pthread_mutex_init (&tw->lock, NULL) != 0) {
+	free (tw);
+	return TW_OUT_OF_MEMORY;
+    }
+    if (clock_gettime (CLOCK_MONOTONIC, &tw->origin) == -1 ||
+	(tw->fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) {
+	(void)pthread_mutex_destroy (&tw->lock);
+	free (tw);
+	return TW_CLOCK_FAILED;
+    }
+    tw->tick_ns = tick_ns;
+
+    *new_tw = tw;
+    return TW_OK;
+}
+
+
+/*
+   Set up timer <timer> to call <func> with argument <arg> on expiry.  A
+   timer must be set up before it is used, and must not be set up again
+   while pending.
+*/
+void
+tw_timer_init (tw_timer_t* timer, tw_func_t func, void* arg)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->func = func;
+    timer->arg = arg;
+}
+
+
+/*
+   Arm timer <timer> on TW <tw> to expire <delay_ns> nanoseconds from now,
+   rounded up to whole ticks (at least one, at most TW_MAX_TICKS).  A
+   timer already pending is moved.  Possible return values and meanings
+   include:
+     TW_OK                  success
+     TW_BAD_PARAMETER       one or mores parameters passed were invalid
+     TW_CLOCK_FAILED        timerfd could not be set (see errno)
+*/
+tw_err_t
+tw_arm (tw_t* tw, tw_timer_t* timer, unsigned long long delay_ns)
+{
+    unsigned long long expires;
+    long long ns;
+    tw_err_t rv = TW_OK;
+
+    /* Check parameters. */
+    if (tw == NULL || timer == NULL || timer->func == NULL)
+	return TW_BAD_PARAMETER;
+
+    if (delay_ns / tw->tick_ns >= TW_MAX_TICKS)
+	delay_ns = (TW_MAX_TICKS - 1) * tw->tick_ns;
+
+    (void)pthread_mutex_lock (&tw->lock);
+    if ((ns = elapsed_ns (tw)) == -1)
+	rv = TW_CLOCK_FAILED;
+    else {
+	/* Expire at the end of the tick in which the delay ends, and not
+	   in the tick in progress. */
+	expires = (ns + delay_ns + tw->tick_ns - 1) / tw->tick_ns;
+	if (expires <= ns / tw->tick_ns)
+	    expires = ns / tw->tick_ns + 1;
+	if (timer->pprev != NULL)
+	    unlink_timer (tw, timer);
+	else
+	    tw->pending++;
+	timer->expires = expires;
+	link_timer (tw, timer);
+
+	/* Wake up early for a timer that expires before the tick for
+	   which the timerfd is set. */
+	if ((tw->armed == 0 || timer->expires < tw->armed) &&
+	    set_clock (tw, timer->expires) == -1)
+	    rv = TW_CLOCK_FAILED;
+    }
+    (void)pthread_mutex_unlock (&tw->lock);
+
+    return rv;
+}
+
+
+/*
+   Cancel timer <timer> on TW <tw>, if it is pending.
+*/
+void
+tw_cancel (tw_t* tw, tw_timer_t* timer)
+{
+    (void)pthread_mutex_lock (&tw->lock);
+    if (timer->pprev != NULL) {
+	unlink_timer (tw, timer);
+	tw->pending--;
+    }
+    (void)pthread_mutex_unlock (&tw->lock);
+}
+
+
+/*
+   Return 1 if timer <timer> is pending on TW <tw>, or 0 if not.
+*/
+int
+tw_pending (tw_t* tw, tw_timer_t* timer)
+{
+    int rv;
+
+    (void)pthread_mutex_lock (&tw->lock);
+    rv = (timer->pprev != NULL);
+    (void)pthread_mutex_unlock (&tw->lock);
+
+    return rv;
+}
+
+
+/*
+   Wait until the next tick at which TW <tw> has anything to do, then
+   call the functions of all timers that have expired.  Meant to be
+   called in a loop by one thread.  The wait may end early, after a timer
+   is armed to expire sooner, or if a signal arrives.  Possible return
+   values and meanings include:
+     TW_OK                  success
+     TW_BAD_PARAMETER       parameter passed was invalid
+     TW_CLOCK_FAILED        timerfd could not be read or set (see errno)
+*/
+tw_err_t
+tw_run (tw_t* tw)
+{
+    uint64_t expirations;
+    unsigned long long tick, cur;
+    long long ns;
+    tw_err_t rv = TW_OK;
+
+    /* Check parameter. */
+    if (tw == NULL)
+	return TW_BAD_PARAMETER;
+
+    if (read (tw->fd, &expirations, sizeof (expirations)) == -1 &&
+	errno != EINTR)
+	return TW_CLOCK_FAILED;
+
+    (void)pthread_mutex_lock (&tw->lock);
+    if ((ns = elapsed_ns (tw)) == -1)
+	rv = TW_CLOCK_FAILED;
+    else {
+	/* Go through the ticks that have passed, skipping those with
+	   nothing to do.  With no timers pending, just catch up. */
+	cur = ns / tw->tick_ns;
+	while (tw->now < cur) {
+	    if (tw->pending == 0) {
+		tw->now = cur;
+		break;
+	    }
+	    if ((tick = next_tick (tw)) > cur)
+		tw->now = cur;
+	    else
+		process_tick (tw, tick);
+	}
+	if (set_clock (tw, next_tick (tw)) == -1)
+	    rv = TW_CLOCK_FAILED;
+    }
+    (void)pthread_mutex_unlock (&tw->lock);
+
+    return rv;
+}
+
+
+/*
+   Destroy the TW <tw> and free all memory associated with it.  Timers
+   still pending are forgotten.  Possible return values and meanings
+   include:
+     TW_BAD_PARAMETER       parameter passed was invalid
+     TW_OK                  success
+*/
+tw_err_t
+tw_destroy (tw_t* tw)
+{
+    /* Check parameter. */
+    if (tw == NULL)
+	return TW_BAD_PARAMETER;
+
+    (void)close (tw->fd);
+    (void)pthread_mutex_destroy (&tw->lock);
+    free (tw);
+
+    return TW_OK;
+}
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void
+tw_error (const char* msg, tw_err_t err)
+{
+    static const char* const tw_err_str[TW_NO_SUCH_ERR] = {
+	"no error reported",
+	"bad parameter passed to TW function",
+	"memory allocation failed",
+	"timerfd operation failed",
+    };
+
+    if (msg == NULL)
+	fputs ("NULL message passed to tw_error.\n", stderr);
+    else if (err < 0 || err >= TW_NO_SUCH_ERR)
+	fprintf (stderr, "%s: invalid error code passed to tw_error.\n", msg);
+    else
+	fprintf (stderr, "%s: %s\n", msg, tw_err_str[err]);
+}
@@ -0,0 +1,151 @@
+/*									tab:8
+ *
+ * tw.h - header file for timer wheel abstraction in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    tw.h
+ * History:
+ *		1
+ *		First written.
+ */
+
+#if !defined (TW_H)
+#define TW_H
+
+/*
+    The TW module defines a hierarchical timer wheel, which keeps the
+    timers of many threads and runs them from a single timerfd on the
+    monotonic clock.  TW stands for Timer Wheel.  Time is counted in ticks
+    of a length chosen at creation.  A timer due within 64 ticks sits in
+    the slot for its expiry tick on the first level of the wheel; one due
+    later sits on a higher level, each slot of which spans 64 times as
+    many ticks as a slot of the level below.  As each level comes round,
+    the timers in the next slot of the level above are moved down.
+    Arming and cancelling a timer therefore cost the same however many
+    timers are pending, and a timer runs less than one tick late.
+
+    The timerfd is set for the next tick at which there is anything to
+    do, so an idle wheel costs nothing.  Occupied slots are kept in a
+    bitmap for each level, and that tick is found with find-first-set
+    scans, as in the RB module.
+
+    Timers belong to the caller, which usually embeds them in its own
+    structures; the wheel only links them together.  Unlike the RB and
+    BQ modules, a TW is thread-safe.  The functions of expired timers are
+    called by the thread calling tw_run, with the wheel locked.  They must
+    be brief, must not use the wheel, and must not take a lock that any
+    thread holds while arming or cancelling a timer.  In return, once
+    tw_cancel returns, the function of the timer cancelled is not called.
+*/
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define TW_MAX_TICKS  ((1UL << 24) - 1)  /* limit on timer delay (ticks)     */
+
+typedef struct tw_t tw_t;         /* opaque timer wheel structure            */
+typedef struct tw_timer_t tw_timer_t;  /* timer, embedded by the caller      */
+
+/* function called when <timer> expires, with the argument given for it */
+typedef void (*tw_func_t) (tw_timer_t* timer, void* arg);
+
+/* timer structure definition; set up by tw_timer_init, and otherwise
+   private to the TW module */
+struct tw_timer_t {
+    tw_timer_t* next;             /* next timer in the same slot             */
+    tw_timer_t** pprev;           /* link to this timer (NULL if idle)       */
+    unsigned long long expires;   /* tick at which timer expires             */
+    tw_func_t func;               /* function to call on expiry              */
+    void* arg;                    /* argument for function                   */
+};
+
+typedef enum {                    /* error messages defined by TW module     */
+    TW_OK = 0,                    /* operation suceeded                      */
+    TW_BAD_PARAMETER,             /* bad parameter passed to TW routine      */
+    TW_OUT_OF_MEMORY,             /* memory allocation failed                */
+    TW_CLOCK_FAILED,              /* timerfd call failed (see errno)         */
+    TW_NO_SUCH_ERR                /* limit on possible error codes           */
+} tw_err_t;
+
+
+/*
+   Create a new TW with ticks of <tick_ns> nanoseconds.  Possible return
+   values and meanings include:
+     TW_OK                  success; <new_tw> points to a pointer to
+				 the new TW
+     TW_BAD_PARAMETER       one or mores parameters passed were invalid
+     TW_OUT_OF_MEMORY       inadequate memory to create TW requested
+     TW_CLOCK_FAILED        timerfd could not be created (see errno)
+*/
+tw_err_t tw_create (tw_t** new_tw, unsigned long tick_ns);
+
+
+/*
+   Set up timer <timer> to call <func> with argument <arg> on expiry.  A
+   timer must be set up before it is used, and must not be set up again
+   while pending.
+*/
+void tw_timer_init (tw_timer_t* timer, tw_func_t func, void* arg);
+
+
+/*
+   Arm timer <timer> on TW <tw> to expire <delay_ns> nanoseconds from now,
+   rounded up to whole ticks (at least one, at most TW_MAX_TICKS).  A
+   timer already pending is moved.  Possible return values and meanings
+   include:
+     TW_OK                  success
+     TW_BAD_PARAMETER       one or mores parameters passed were invalid
+     TW_CLOCK_FAILED        timerfd could not be set (see errno)
+*/
+tw_err_t tw_arm (tw_t* tw, tw_timer_t* timer,
+		 unsigned long long delay_ns);
+
+
+/*
+   Cancel timer <timer> on TW <tw>, if it is pending.
+*/
+void tw_cancel (tw_t* tw, tw_timer_t* timer);
+
+
+/*
+   Return 1 if timer <timer> is pending on TW <tw>, or 0 if not.
+*/
+int tw_pending (tw_t* tw, tw_timer_t* timer);
+
+
+/*
+   Wait until the next tick at which TW <tw> has anything to do, then
+   call the functions of all timers that have expired.  Meant to be
+   called in a loop by one thread.  The wait may end early, after a timer
+   is armed to expire sooner, or if a signal arrives.  Possible return
+   values and meanings include:
+     TW_OK                  success
+     TW_BAD_PARAMETER       parameter passed was invalid
+     TW_CLOCK_FAILED        timerfd could not be read or set (see errno)
+*/
+tw_err_t tw_run (tw_t* tw);
+
+
+/*
+   Destroy the TW <tw> and free all memory associated with it.  Timers
+   still pending are forgotten.  Possible return values and meanings
+   include:
+     TW_BAD_PARAMETER       parameter passed was invalid
+     TW_OK                  success
+*/
+tw_err_t tw_destroy (tw_t* tw);
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void tw_error (const char* msg, tw_err_t err);
+
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* TW_H */
@@ -0,0 +1,471 @@
+/*									tab:8
+ *
+ * ur.c - source file for io_uring abstraction in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    ur.c
+ * History:
+ *		1
+ *		First written.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined (__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define UR_SUPPORTED 1
+#endif
+
+#include "ur.h"
+
+/*
+    The UR module queues socket operations on an io_uring.  See ur.h.
+
+    The submission and completion rings are shared with the kernel.  We
+    own the tail of the submission ring and the head of the completion
+    ring; the kernel owns the others.  Each index is read with acquire
+    and written with release ordering, so that entries are complete
+    before either side sees them.  <queued> counts the entries added to
+    the submission ring but not yet passed to io_uring_enter.
+*/
+
+#if defined (UR_SUPPORTED)
+
+/* Flags missing from headers older than the kernels that have them. */
+#if !defined (IORING_ACCEPT_MULTISHOT)
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+#if !defined (IORING_CQE_F_MORE)
+#define IORING_CQE_F_MORE       (1U << 1)
+#endif
+
+
+/* UR structure definition */
+struct ur_t {
+    int fd;                       /* io_uring file descriptor             */
+    unsigned int queued;          /* entries not yet submitted            */
+
+    void* sq_ring;                /* submission ring mapping              */
+    size_t sq_ring_len;           /*   and its length                     */
+    unsigned int* sq_head;        /* first entry not consumed by kernel   */
+    unsigned int* sq_tail;        /* next entry to fill                   */
+    unsigned int sq_mask;         /* ring index mask                      */
+    unsigned int sq_entries;      /* number of entries in ring            */
+    unsigned int* sq_array;       /* ring of indices into <sqes>          */
+    struct io_uring_sqe* sqes;    /* submission queue entries             */
+    size_t sqes_len;              /*   and the length of their mapping    */
+
+    void* cq_ring;                /* completion ring mapping              */
+    size_t cq_ring_len;           /*   and its length                     */
+    unsigned int* cq_head;        /* next completion to take              */
+    unsigned int* cq_tail;        /* next completion kernel will post     */
+    unsigned int cq_mask;         /* ring index mask                      */
+    struct io_uring_cqe* cqes;    /* completion queue entries             */
+
+    unsigned char* buf;           /* registered buffer (NULL if none)     */
+    int buf_size;                 /* size of registered buffer (bytes)    */
+};
+
+
+/*
+   Return a cleared submission queue entry for the next request on UR
+   <ur>, or NULL if the submission ring is full.  The entry is added to
+   the ring, and so should be filled in at once.
+*/
+static struct io_uring_sqe*
+get_sqe (ur_t* ur)
+{
+    unsigned int tail = *ur->sq_tail, idx;
+    struct io_uring_sqe* sqe;
+
+    if (tail - __atomic_load_n (ur->sq_head, __ATOMIC_ACQUIRE) >=
+	ur->sq_entries)
+	return NULL;
+    idx = tail & ur->sq_mask;
+    sqe = &ur->sqes[idx];
+    memset (sqe, 0, sizeof (*sqe));
+    ur->sq_array[idx] = idx;
+    return sqe;
+}
+
+
+/*
+   Make the entry last returned by get_sqe on UR <ur> visible to the
+   kernel.
+*/
+static void
+put_sqe (ur_t* ur)
+{
+    __atomic_store_n (ur->sq_tail, *ur->sq_tail + 1, __ATOMIC_RELEASE);
+    ur->queued++;
+}
+
+
+/*
+   Unmap the rings of UR <ur>, close it, and free it.  Usable on a UR
+   that is only partly set up.
+*/
+static void
+free_ur (ur_t* ur)
+{
+    if (ur->sqes != NULL)
+	(void)munmap (ur->sqes, ur->sqes_len);
+    if (ur->cq_ring != NULL)
+	(void)munmap (ur->cq_ring, ur->cq_ring_len);
+    if (ur->sq_ring != NULL)
+	(void)munmap (ur->sq_ring, ur->sq_ring_len);
+    if (ur->fd != -1)
+	(void)close (ur->fd);
+    free (ur->buf);
+    free (ur);
+}
+
+
+/*
+   Create a new UR with room for <entries> requests (a power of two) in
+   flight, and a registered buffer of <buf_size> bytes (none if zero).
+   Possible return values and meanings include:
+     UR_OK                  success; <new_ur> points to a pointer to
+				 the new UR
+     UR_BAD_PARAMETER       one or mores parameters passed were invalid
+     UR_OUT_OF_MEMORY       inadequate memory to create UR requested
+     UR_NOT_SUPPORTED       io_uring is not available (see errno)
+*/
+ur_err_t
+ur_create (ur_t** new_ur, int entries, int buf_size)
+{
+    struct io_uring_params params;
+    struct iovec iov;
+    ur_t* ur;
+    char* base;
+
+    /* Check parameters. */
+    if (new_ur == NULL || entries < 1 || (entries & (entries - 1)) != 0 ||
+	buf_size < 0)
+	return UR_BAD_PARAMETER;
+
+    /* Allocate necessary memory. */
+    if ((ur = calloc (1, sizeof (ur_t))) == NULL)
+	return UR_OUT_OF_MEMORY;
+    ur->fd = -1;
+    if (buf_size > 0 &&
+	posix_memalign ((void**)&ur->buf, getpagesize (), buf_size) != 0) {
+	free (ur);
+	return UR_OUT_OF_MEMORY;
+    }
+    ur->buf_size = buf_size;
+
+    /* Set up the ring, and map its three parts. */
+    memset (&params, 0, sizeof (params));
+    if ((ur->fd = syscall (__NR_io_uring_setup, entries, &params)) == -1) {
+	free_ur (ur);
+	return UR_NOT_SUPPORTED;
+    }
+    ur->sq_ring_len = params.sq_off.array + params.sq_entries *
+		      sizeof (unsigned int);
+    ur->cq_ring_len = params.cq_off.cqes + params.cq_entries *
+		      sizeof (struct io_uring_cqe);
+    ur->sqes_len = params.sq_entries * sizeof (struct io_uring_sqe);
+    if ((ur->sq_ring = mmap (NULL, ur->sq_ring_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ur->fd,
+			     IORING_OFF_SQ_RING)) == MAP_FAILED ||
+	(ur->cq_ring = mmap (NULL, ur->cq_ring_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ur->fd,
+			     IORING_OFF_CQ_RING)) == MAP_FAILED ||
+	(ur->sqes = mmap (NULL, ur->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ur->fd,
+			  IORING_OFF_SQES)) == MAP_FAILED) {
+	if (ur->sq_ring == MAP_FAILED)
+	    ur->sq_ring = NULL;
+	if (ur->cq_ring == MAP_FAILED)
+	    ur->cq_ring = NULL;
+	if (ur->sqes == MAP_FAILED)
+	    ur->sqes = NULL;
+	free_ur (ur);
+	return UR_OUT_OF_MEMORY;
+    }
+
+    base = ur->sq_ring;
+    ur->sq_head = (unsigned int*)(base + params.sq_off.head);
+    ur->sq_tail = (unsigned int*)(base + params.sq_off.tail);
+    ur->sq_mask = *(unsigned int*)(base + params.sq_off.ring_mask);
+    ur->sq_entries = *(unsigned int*)(base + params.sq_off.ring_entries);
+    ur->sq_array = (unsigned int*)(base + params.sq_off.array);
+    base = ur->cq_ring;
+    ur->cq_head = (unsigned int*)(base + params.cq_off.head);
+    ur->cq_tail = (unsigned int*)(base + params.cq_off.tail);
+    ur->cq_mask = *(unsigned int*)(base + params.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+    /* Register the buffer.  This pins its pages, which can fail under a
+       low locked memory limit on older kernels. */
+    if (buf_size > 0) {
+	iov.iov_base = ur->buf;
+	iov.iov_len = buf_size;
+	if (syscall (__NR_io_uring_register, ur->fd, IORING_REGISTER_BUFFERS,
+		     &iov, 1) == -1) {
+	    free_ur (ur);
+	    return UR_NOT_SUPPORTED;
+	}
+    }
+
+    *new_ur = ur;
+    return UR_OK;
+}
+
+
+/*
+   Return the registered buffer of UR <ur>.
+*/
+unsigned char*
+ur_buffer (ur_t* ur)
+{
+    return ur->buf;
+}
+
+
+/*
+   Return the file descriptor of UR <ur>, which polls readable while
+   completions are waiting to be taken.
+*/
+int
+ur_fd (ur_t* ur)
+{
+    return ur->fd;
+}
+
+
+/*
+   Queue a write of the <len> bytes at <data>, which must lie within the
+   registered buffer of UR <ur>, to file descriptor <fd>.  On a connected
+   datagram socket, the write sends one datagram.  The completion
+   carries <tag> and the result of the write (bytes written, or -errno).
+   Possible return values and meanings include:
+     UR_OK                  success
+     UR_BAD_PARAMETER       one or mores parameters passed were invalid
+     UR_RING_FULL           not queued (submit and collect completions
+				 first)
+*/
+ur_err_t
+ur_write_fixed (ur_t* ur, int fd, const unsigned char* data, int len,
+		unsigned long tag)
+{
+    struct io_uring_sqe* sqe;
+
+    /* Check parameters. */
+    if (ur == NULL || data == NULL || len < 0 || data < ur->buf ||
+	data + len > ur->buf + ur->buf_size)
+	return UR_BAD_PARAMETER;
+
+    if ((sqe = get_sqe (ur)) == NULL)
+	return UR_RING_FULL;
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)data;
+    sqe->len = len;
+    sqe->buf_index = 0;
+    sqe->user_data = tag;
+    put_sqe (ur);
+
+    return UR_OK;
+}
+
+
+/*
+   Queue a multishot accept on listening socket <fd> of UR <ur>, giving
+   new connections the accept4 flags <flags> (such as SOCK_NONBLOCK).
+   Each completion carries <tag> and the new connection's file
+   descriptor (or -errno).  Possible return values and meanings include:
+     UR_OK                  success
+     UR_BAD_PARAMETER       one or mores parameters passed were invalid
+     UR_RING_FULL           not queued (submit and collect completions
+				 first)
+*/
+ur_err_t
+ur_accept (ur_t* ur, int fd, int flags, unsigned long tag)
+{
+    struct io_uring_sqe* sqe;
+
+    /* Check parameter. */
+    if (ur == NULL)
+	return UR_BAD_PARAMETER;
+
+    if ((sqe = get_sqe (ur)) == NULL)
+	return UR_RING_FULL;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = flags;
+    sqe->user_data = tag;
+    put_sqe (ur);
+
+    return UR_OK;
+}
+
+
+/*
+   Submit all requests queued on UR <ur>, then wait until at least
+   <wait> completions are ready (0 to return at once).  Possible return
+   values and meanings include:
+     UR_OK                  success
+     UR_BAD_PARAMETER       one or mores parameters passed were invalid
+     UR_SYSCALL_FAILED      io_uring_enter failed (see errno; EINTR means
+				 that a signal arrived while waiting)
+*/
+ur_err_t
+ur_submit (ur_t* ur, int wait)
+{
+    long rv;
+
+    /* Check parameters. */
+    if (ur == NULL || wait < 0)
+	return UR_BAD_PARAMETER;
+
+    /* Nothing to do if nothing is queued and enough has completed. */
+    if (ur->queued == 0 &&
+	__atomic_load_n (ur->cq_tail, __ATOMIC_ACQUIRE) - *ur->cq_head >=
+	(unsigned int)wait)
+	return UR_OK;
+
+    if ((rv = syscall (__NR_io_uring_enter, ur->fd, ur->queued, wait,
+		       (wait > 0 ? IORING_ENTER_GETEVENTS : 0), NULL, 0)) ==
+	-1)
+	return UR_SYSCALL_FAILED;
+    ur->queued -= rv;
+
+    return UR_OK;
+}
+
+
+/*
+   Take the next completion from UR <ur>, if any.  Returns 1 with <*tag>
+   set to the tag of the request, <*res> to its result, and <*more> to 1
+   if a multishot request will complete again, or returns 0 if no
+   completion is ready.
+*/
+int
+ur_complete (ur_t* ur, unsigned long* tag, int* res, int* more)
+{
+    unsigned int head = *ur->cq_head;
+    struct io_uring_cqe* cqe;
+
+    if (head == __atomic_load_n (ur->cq_tail, __ATOMIC_ACQUIRE))
+	return 0;
+    cqe = &ur->cqes[head & ur->cq_mask];
+    *tag = cqe->user_data;
+    *res = cqe->res;
+    *more = ((cqe->flags & IORING_CQE_F_MORE) != 0);
+    __atomic_store_n (ur->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+
+/*
+   Destroy the UR <ur> and free all memory associated with it.  Requests
+   still in flight are cancelled.  Possible return values and meanings
+   include:
+     UR_BAD_PARAMETER       parameter passed was invalid
+     UR_OK                  success
+*/
+ur_err_t
+ur_destroy (ur_t* ur)
+{
+    /* Check parameter. */
+    if (ur == NULL)
+	return UR_BAD_PARAMETER;
+
+    free_ur (ur);
+
+    return UR_OK;
+}
+
+#else /* !UR_SUPPORTED */
+
+/*
+   Without io_uring in the system headers, there is no UR to create, and
+   the other routines are never reached.
+*/
+ur_err_t
+ur_create (ur_t** new_ur, int entries, int buf_size)
+{
+    errno = ENOSYS;
+    return UR_NOT_SUPPORTED;
+}
+
+unsigned char*
+ur_buffer (ur_t* ur)
+{
+    return NULL;
+}
+
+int
+ur_fd (ur_t* ur)
+{
+    return -1;
+}
+
+ur_err_t
+ur_write_fixed (ur_t* ur, int fd, const unsigned char* data, int len,
+		unsigned long tag)
+{
+    return UR_BAD_PARAMETER;
+}
+
+ur_err_t
+ur_accept (ur_t* ur, int fd, int flags, unsigned long tag)
+{
+    return UR_BAD_PARAMETER;
+}
+
+ur_err_t
+ur_submit (ur_t* ur, int wait)
+{
+    return UR_BAD_PARAMETER;
+}
+
+int
+ur_complete (ur_t* ur, unsigned long* tag, int* res, int* more)
+{
+    return 0;
+}
+
+ur_err_t
+ur_destroy (ur_t* ur)
+{
+    return UR_BAD_PARAMETER;
+}
+
+#endif /* UR_SUPPORTED */
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void
+ur_error (const char* msg, ur_err_t err)
+{
+    static const char* const ur_err_str[UR_NO_SUCH_ERR] = {
+	"no error reported",
+	"bad parameter passed to UR function",
+	"memory allocation failed",
+	"io_uring not supported",
+	"io_uring submission queue full",
+	"io_uring_enter failed",
+    };
+
+    if (msg == NULL)
+	fputs ("NULL message passed to ur_error.\n", stderr);
+    else if (err < 0 || err >= UR_NO_SUCH_ERR)
+	fprintf (stderr, "%s: invalid error code passed to ur_error.\n", msg);
+    else
+	fprintf (stderr, "%s: %s\n", msg, ur_err_str[err]);
+}
@@ -0,0 +1,150 @@
+/*									tab:8
+ *
+ * ur.h - header file for io_uring abstraction in the MP3 relay
+ *
+ * Version:	    1
+ * Filename:	    ur.h
+ * History:
+ *		1
+ *		First written.
+ */
+
+#if !defined (UR_H)
+#define UR_H
+
+/*
+    The UR module wraps a Linux io_uring, through which a thread can queue
+    many socket operations and submit them, and collect their results,
+    with one system call.  UR stands for User Ring.  The module talks to
+    the kernel directly, without liburing.
+
+    Each UR has one registered buffer, set up at creation, from which
+    writes are made without the kernel mapping the pages for each one.
+    Accepts are multishot: one request accepts connections on a listening
+    socket until it fails or is cancelled.  Every request carries a tag
+    chosen by the caller, which comes back with each of its completions.
+
+    On kernels without io_uring (or where it is disabled), and on systems
+    whose headers predate it, ur_create fails with UR_NOT_SUPPORTED and
+    the caller should fall back to ordinary system calls.  Multishot
+    accept needs a newer kernel than the rest; where it is missing, the
+    first completion of the accept fails with -EINVAL.
+
+    Like the FQ and RB modules, a UR is not thread-safe; it is meant to
+    be owned by a single thread.
+*/
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+typedef struct ur_t ur_t;         /* opaque io_uring structure               */
+
+typedef enum {                    /* error messages defined by UR module     */
+    UR_OK = 0,                    /* operation suceeded                      */
+    UR_BAD_PARAMETER,             /* bad parameter passed to UR routine      */
+    UR_OUT_OF_MEMORY,             /* memory allocation failed                */
+    UR_NOT_SUPPORTED,             /* no io_uring on this system              */
+    UR_RING_FULL,                 /* no room to queue another request        */
+    UR_SYSCALL_FAILED,            /* io_uring_enter failed (see errno)       */
+    UR_NO_SUCH_ERR                /* limit on possible error codes           */
+} ur_err_t;
+
+
+/*
+   Create a new UR with room for <entries> requests (a power of two) in
+   flight, and a registered buffer of <buf_size> bytes (none if zero).
+   Possible return values and meanings include:
+     UR_OK                  success; <new_ur> points to a pointer to
+				 the new UR
+     UR_BAD_PARAMETER       one or mores parameters passed were invalid
+     UR_OUT_OF_MEMORY       inadequate memory to create UR requested
+     UR_NOT_SUPPORTED       io_uring is not available (see errno)
+*/
+ur_err_t ur_create (ur_t** new_ur, int entries, int buf_size);
+
+
+/*
+   Return the registered buffer of UR <ur>.
+*/
+unsigned char* ur_buffer (ur_t* ur);
+
+
+/*
+   Return the file descriptor of UR <ur>, which polls readable while
+   completions are waiting to be taken.
+*/
+int ur_fd (ur_t* ur);
+
+
+/*
+   Queue a write of the <len> bytes at <data>, which must lie within the
+   registered buffer of UR <ur>, to file descriptor <fd>.  On a connected
+   datagram socket, the write sends one datagram.  The completion
+   carries <tag> and the result of the write (bytes written, or -errno).
+   Possible return values and meanings include:
+     UR_OK                  success
+     UR_BAD_PARAMETER       one or mores parameters passed were invalid
+     UR_RING_FULL           not queued (submit and collect completions
+				 first)
+*/
+ur_err_t ur_write_fixed (ur_t* ur, int fd, const unsigned char* data,
+			 int len, unsigned long tag);
+
+
+/*
+   Queue a multishot accept on listening socket <fd> of UR <ur>, giving
+   new connections the accept4 flags <flags> (such as SOCK_NONBLOCK).
+   Each completion carries <tag> and the new connection's file
+   descriptor (or -errno).  Possible return values and meanings include:
+     UR_OK                  success
+     UR_BAD_PARAMETER       one or mores parameters passed were invalid
+     UR_RING_FULL           not queued (submit and collect completions
+				 first)
+*/
+ur_err_t ur_accept (ur_t* ur, int fd, int flags, unsigned long tag);
+
+
+/*
+   Submit all requests queued on UR <ur>, then wait until at least
+   <wait> completions are ready (0 to return at once).  Possible return
+   values and meanings include:
+     UR_OK                  success
+     UR_BAD_PARAMETER       one or mores parameters passed were invalid
+     UR_SYSCALL_FAILED      io_uring_enter failed (see errno; EINTR means
+				 that a signal arrived while waiting)
+*/
+ur_err_t ur_submit (ur_t* ur, int wait);
+
+
+/*
+   Take the next completion from UR <ur>, if any.  Returns 1 with <*tag>
+   set to the tag of the request, <*res> to its result, and <*more> to 1
+   if a multishot request will complete again, or returns 0 if no
+   completion is ready.
+*/
+int ur_complete (ur_t* ur, unsigned long* tag, int* res, int* more);
+
+
+/*
+   Destroy the UR <ur> and free all memory associated with it.  Requests
+   still in flight are cancelled.  Possible return values and meanings
+   include:
+     UR_BAD_PARAMETER       parameter passed was invalid
+     UR_OK                  success
+*/
+ur_err_t ur_destroy (ur_t* ur);
+
+
+/*
+    Print a human-readable error message for the condition corresponding
+    to error <err> to stderr, prefixed by the string <msg> and a colon.
+*/
+void ur_error (const char* msg, ur_err_t err);
+
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* UR_H */